@@ -1,5 +1,7 @@
 #include "ili9225.h"
 
+#include <string.h>
+
 struct commandAndData {
     uint16_t command;
     uint16_t data;
@@ -7,6 +9,19 @@ struct commandAndData {
 
 #define ARRAYSIZE(array)    (sizeof(array)/sizeof(array[0]))
 
+/* the window, GRAM pointer and GRAM data register commands ahead of a
+ * burst's pixels, register and value in turn */
+#define BURST_SETUP_WORDS   13
+
+static struct {
+    burst bursts[ILI9225_MAX_BURSTS];
+    int count;
+    int next;
+    const burst *current;
+    uint16_t setup[BURST_SETUP_WORDS];
+    int word;               // next setup word, past the last once the pixels are going
+} burstQueue;
+
 void ili9225_set_cs(state csState)
 {
     HAL_GPIO_WritePin(ILI9225_CS_GPIO_Port, ILI9225_CS_Pin, csState);
@@ -45,50 +60,23 @@ void ili9225_write_cmd(uint16_t cmd, uint16_t value)
     ili9225_set_cs(STATE_DISABLE);
 }
 
-void ili9225_init(void)
-{
-    /* ILI9225 init */
-    ili9225_set_rst(STATE_DISABLE);
-    ili9225_set_cs(STATE_DISABLE);
-    ili9225_set_dc(COMMAND);
-    HAL_Delay(10);
-
-    ili9225_set_rst(STATE_ENABLE);
-    HAL_Delay(20);
-    ili9225_set_rst(STATE_DISABLE);
-    HAL_Delay(50);
-
-    {
-        struct commandAndData commands[] = {
-            {ILI9225_POWER_CTRL1, 0x0000},
-            {ILI9225_POWER_CTRL2, 0x0000},
-            {ILI9225_POWER_CTRL3, 0x0000},
-            {ILI9225_POWER_CTRL4, 0x0000},
-            {ILI9225_POWER_CTRL5, 0x0000},
-        };
-        for (int i = 0; i < 5; i++)
-            ili9225_write_cmd(commands[i].command, commands[i].data);
-        HAL_Delay(40);
-    }
-
-    {
-        struct commandAndData commands[] = {
-            {ILI9225_POWER_CTRL2, 0x0018},
-            {ILI9225_POWER_CTRL3, 0x6121},
-            {ILI9225_POWER_CTRL4, 0x006f},
-            {ILI9225_POWER_CTRL5, 0x495f},
-            {ILI9225_POWER_CTRL1, 0x0800},
-        };
-        for (int i = 0; i < 5; i++)
-            ili9225_write_cmd(commands[i].command, commands[i].data);
-        HAL_Delay(10);
-    }
+static const struct commandAndData powerOff[] = {
+    {ILI9225_POWER_CTRL1, 0x0000},
+    {ILI9225_POWER_CTRL2, 0x0000},
+    {ILI9225_POWER_CTRL3, 0x0000},
+    {ILI9225_POWER_CTRL4, 0x0000},
+    {ILI9225_POWER_CTRL5, 0x0000},
+};
 
-    ili9225_write_cmd(ILI9225_POWER_CTRL2, 0x103b);
-    HAL_Delay(50);
+static const struct commandAndData powerOn[] = {
+    {ILI9225_POWER_CTRL2, 0x0018},
+    {ILI9225_POWER_CTRL3, 0x6121},
+    {ILI9225_POWER_CTRL4, 0x006f},
+    {ILI9225_POWER_CTRL5, 0x495f},
+    {ILI9225_POWER_CTRL1, 0x0800},
+};
 
-    {
-        struct commandAndData commands[] = {
+static const struct commandAndData setup[] = {
 			{ILI9225_DRIVER_OUTPUT_CTRL,	0x011C},
 			/* Set LCD inversion to disabled. */
 			{ILI9225_LCD_AC_DRIVING_CTRL, 0x0100},
@@ -147,14 +135,105 @@ void ili9225_init(void)
 
 			/* Enable full colour display. */
 			{ILI9225_DISP_CTRL1, 0x0012}
-        };
-        for (int i = 0; i < ARRAYSIZE(commands); i++)
-            ili9225_write_cmd(commands[i].command, commands[i].data);
-        HAL_Delay(50);
+};
+
+static struct {
+    volatile int step;      // next step of ili9225_init_step(), -1 when not running
+    volatile uint32_t wait; // ms before it is due, counted down by ili9225_init_tick()
+    volatile int ready;
+} initState = {-1, 0, 0};
+
+static void ili9225_write_cmds(const struct commandAndData *commands, int count)
+{
+    for (int i = 0; i < count; i++)
+        ili9225_write_cmd(commands[i].command, commands[i].data);
+}
+
+/* One step of the power on sequence. Returns the ms to wait before the
+ * next one, or -1 after the last. */
+static int ili9225_init_step(int step)
+{
+    switch (step) {
+    case 0:
+        ili9225_set_rst(STATE_DISABLE);
+        ili9225_set_cs(STATE_DISABLE);
+        ili9225_set_dc(COMMAND);
+        return 10;
+    case 1:
+        ili9225_set_rst(STATE_ENABLE);
+        return 20;
+    case 2:
+        ili9225_set_rst(STATE_DISABLE);
+        return 50;
+    case 3:
+        ili9225_write_cmds(powerOff, ARRAYSIZE(powerOff));
+        return 40;
+    case 4:
+        ili9225_write_cmds(powerOn, ARRAYSIZE(powerOn));
+        return 10;
+    case 5:
+        ili9225_write_cmd(ILI9225_POWER_CTRL2, 0x103b);
+        return 50;
+    case 6:
+        ili9225_write_cmds(setup, ARRAYSIZE(setup));
+        return 50;
+    case 7:
+        ili9225_write_cmd(ILI9225_DISP_CTRL1, 0x1017);
+        return 50;
+    default:
+        return -1;
+    }
+}
+
+void ili9225_init(void)
+{
+    int delay;
+
+    for (int step = 0; (delay = ili9225_init_step(step)) >= 0; step++)
+        HAL_Delay(delay);
+    initState.ready = 1;
+}
+
+/* ili9225_init() without blocking: ili9225_init_tick() counts the delays
+ * down every ms, e.g. from SysTick, and ili9225_init_poll() runs a step once
+ * it is due. Poll from the main loop, not an interrupt, the steps use
+ * blocking SPI with HAL_GetTick() timeouts; nothing else may use the SPI
+ * until ili9225_ready(). */
+void ili9225_init_start(void)
+{
+    initState.ready = 0;
+    initState.wait = 0;
+    initState.step = 0;
+}
+
+void ili9225_init_tick(void)
+{
+    if (initState.wait > 0)
+        initState.wait--;
+}
+
+// returns ili9225_ready()
+int ili9225_init_poll(void)
+{
+    int delay;
+
+    if (initState.step < 0 || initState.wait > 0)
+        return initState.ready;
+    delay = ili9225_init_step(initState.step);
+    if (delay < 0) {
+        initState.step = -1;
+        initState.ready = 1;
+        return 1;
     }
+    initState.step++;
+    // the next tick may come at once, wait one more like HAL_Delay()
+    initState.wait = delay + 1;
+    return 0;
+}
 
-    ili9225_write_cmd(ILI9225_DISP_CTRL1, 0x1017);
-    HAL_Delay(50);
+int ili9225_ready(void)
+{
+    return initState.ready;
 }
 
 void ili9225_set_window_area(uint16_t verticalStart, uint16_t verticalEnd, uint16_t horizontalStart, uint16_t horizontalEnd)
@@ -182,4 +261,84 @@ void ili9225_draw_bitmap(uint16_t *bitMap, uint16_t width, uint16_t height, tran
     } else if (xferMethod == DMA) {
         HAL_SPI_Transmit_DMA(&hspi4, (uint8_t *)bitMap, width * height);
     }
-}
\ No newline at end of file
+}
+
+/* Send the next setup word of the current burst by interrupt, each command
+ * in a CS cycle of its own like ili9225_write_cmd(), or its pixels by DMA once
+ * they are all out. Nothing here waits on the SPI, it runs in its interrupt. */
+static void ili9225_burst_step(void)
+{
+    int word = burstQueue.word++;
+
+    if (word == BURST_SETUP_WORDS) {
+        ili9225_set_dc(DATA);
+        HAL_SPI_Transmit_DMA(&hspi4, (uint8_t *)burstQueue.current->bitMap, burstQueue.current->length);
+        return;
+    }
+    if (word % 2 == 0) {
+        ili9225_set_cs(STATE_DISABLE);
+        ili9225_set_cs(STATE_ENABLE);
+        ili9225_set_dc(COMMAND);
+    } else {
+        ili9225_set_dc(DATA);
+    }
+    HAL_SPI_Transmit_IT(&hspi4, (uint8_t *)&burstQueue.setup[word], 1);
+}
+
+// what ili9225_set_window_area() and ili9225_set_gram_ptr() send, then the pixels
+static void ili9225_start_burst(const burst *b)
+{
+    const uint16_t setup[BURST_SETUP_WORDS] = {
+        ILI9225_HORIZONTAL_WINDOW_ADDR2, b->horizontalStart,
+        ILI9225_HORIZONTAL_WINDOW_ADDR1, b->horizontalEnd,
+        ILI9225_VERTICAL_WINDOW_ADDR2, b->verticalStart,
+        ILI9225_VERTICAL_WINDOW_ADDR1, b->verticalEnd,
+        ILI9225_RAM_ADDR_SET1, b->horizontalEnd,
+        ILI9225_RAM_ADDR_SET2, b->verticalStart,
+        ILI9225_GRAM_DATA_REG,
+    };
+
+    memcpy(burstQueue.setup, setup, sizeof(setup));
+    burstQueue.current = b;
+    burstQueue.word = 0;
+    ili9225_burst_step();
+}
+
+/* Send a list of rectangles as back-to-back DMA transfers, each after its
+ * setup commands sent by interrupt. The SPI transfer complete callback has to
+ * call ili9225_next_burst(), which sends what comes next and returns 0 once
+ * all of them are out. Returns 0 if nothing was started, either because count
+ * is 0 or a previous list is still going. */
+int ili9225_draw_bursts(const burst *bursts, int count)
+{
+    if (count <= 0 || ili9225_busy())
+        return 0;
+    if (count > ILI9225_MAX_BURSTS)
+        count = ILI9225_MAX_BURSTS;
+    for (int i = 0; i < count; i++)
+        burstQueue.bursts[i] = bursts[i];
+    burstQueue.count = count;
+    burstQueue.next = 1;
+    ili9225_start_burst(&burstQueue.bursts[0]);
+    return 1;
+}
+
+int ili9225_next_burst(void)
+{
+    if (burstQueue.word <= BURST_SETUP_WORDS) {
+        ili9225_burst_step();
+        return 1;
+    }
+    ili9225_set_cs(STATE_DISABLE);
+    if (burstQueue.next >= burstQueue.count) {
+        burstQueue.count = burstQueue.next = 0;
+        return 0;
+    }
+    ili9225_start_burst(&burstQueue.bursts[burstQueue.next++]);
+    return 1;
+}
+
+int ili9225_busy(void)
+{
+    return burstQueue.count != 0;
+}
@@ -26,6 +26,20 @@ typedef enum {
     DMA,
 } transferMethod;
 
+/* A rectangle of GRAM and the pixels that fill it, for the entry mode set by
+ * ili9225_init(): vertical address first, horizontal address counting down
+ * from horizontalEnd. */
+typedef struct {
+    uint16_t *bitMap;
+    uint32_t length;
+    uint16_t verticalStart;
+    uint16_t verticalEnd;
+    uint16_t horizontalStart;
+    uint16_t horizontalEnd;
+} burst;
+
+#define ILI9225_MAX_BURSTS      16
+
 #define ILI9225_WHITE          0x9dc2
 #define ILI9225_LIGHTGRAY      0x8d42
 #define ILI9225_DARKGRAY       0x3306
@@ -75,7 +89,14 @@ void ili9225_set_dc(state dcState);
 void ili9225_write_16(uint16_t value);
 void ili9225_write_cmd(uint16_t cmd, uint16_t value);
 void ili9225_init(void);
+void ili9225_init_start(void);
+void ili9225_init_tick(void);
+int ili9225_init_poll(void);
+int ili9225_ready(void);
 void ili9225_set_window_area(uint16_t verticalStart, uint16_t verticalEnd, uint16_t horizontalStart, uint16_t horizontalEnd);
 void ili9225_set_gram_ptr(uint16_t horizontal, uint16_t vertical);
 void ili9225_draw_bitmap(uint16_t *bitMap, uint16_t width, uint16_t height, transferMethod xferMethod);
-void ili9225_write_reg(uint16_t reg);
\ No newline at end of file
+void ili9225_write_reg(uint16_t reg);
+int ili9225_draw_bursts(const burst *bursts, int count);
+int ili9225_next_burst(void);
+int ili9225_busy(void);
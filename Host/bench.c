@@ -0,0 +1,260 @@
+/* gbdarm-bench: run a ROM headless for a number of frames and report how
+ * fast the core emulates it on the host. */
+#define GBDARM_DECLARATIONS_ONLY
+#include "gbdarm.h"
+#include "rom_source.h"
+
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_FRAMES      3000
+#define GB_FRAME_RATE       59.73
+#define MAX_SPANS           16
+
+static struct gb gb;
+static struct line_ring lineRing;
+static struct frame_buffers buffers;
+static struct rom_cache romCache;
+static struct rom_stream romStream;
+static uint8_t *romImage;
+static uint8_t *streamImage;
+// big enough for the scaled output too; with a line ring the first is the panel
+static uint16_t frameBuffers[FRAME_BUFFER_COUNT][SCALED_LINES * SCALED_LINE_LENGTH];
+static const char *paletteSetNames[PALETTE_SET_COUNT] = {
+    [PALETTE_SET_ILI9225]   = "ili9225",
+    [PALETTE_SET_SDL2]      = "sdl2",
+    [PALETTE_SET_GRAYSCALE] = "gray",
+};
+static const char *scalerModeNames[] = {
+    [SCALER_OFF]     = "off",
+    [SCALER_NEAREST] = "nearest",
+    [SCALER_BLEND]   = "blend",
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// stands in for the SD card: the bank cache reads from the mapped file
+static bool rom_fill(struct rom_cache *cache, int bank, uint8_t *dst)
+{
+    memcpy(dst, romImage + (size_t)bank * ROM_BANK_SIZE, ROM_BANK_SIZE);
+    return true;
+}
+
+/* stands in for the boot DMA: the banks up to the one waited for land now,
+ * the others never do if nothing maps them */
+static void rom_stream_wait(struct rom_stream *stream, int bank)
+{
+    for (; stream->loaded <= bank; stream->loaded++)
+        memcpy(streamImage + (size_t)stream->loaded * ROM_BANK_SIZE,
+               romImage + (size_t)stream->loaded * ROM_BANK_SIZE, ROM_BANK_SIZE);
+}
+
+/* stands in for the display DMA: copy everything waiting in the ring to
+ * the panel */
+static void ring_drain(struct line_ring *ring)
+{
+    uint16_t *pixels;
+    uint8_t first;
+    int count;
+
+    while ((count = line_ring_peek(ring, &pixels, &first)) > 0) {
+        memcpy(frameBuffers[0] + first * ring->lineLength, pixels, count * ring->lineLength * sizeof(uint16_t));
+        line_ring_release(ring, count);
+    }
+}
+
+/* FNV-1a over the last frame and the CPU registers, so a speed change can be
+ * told apart from a behaviour change */
+static uint32_t state_hash(void)
+{
+    uint32_t hash = 2166136261U;
+    const uint8_t *p;
+    size_t frameBytes = (gb.scaler.mode == SCALER_OFF) ? SCREEN_HEIGHT * SCREEN_WIDTH * 2 : sizeof(frameBuffers[0]);
+
+    p = (const uint8_t *)gb.frontBufferPtr;
+    for (size_t i = 0; i < frameBytes; i++)
+        hash = (hash ^ p[i]) * 16777619U;
+    p = (const uint8_t *)&gb.cpu;
+    for (size_t i = 0; i < sizeof(gb.cpu); i++)
+        hash = (hash ^ p[i]) * 16777619U;
+    return hash;
+}
+
+int main(int argc, char **argv)
+{
+    struct rom_source romSource;
+    uint8_t *rom;
+    uint16_t *front, *bufferPtrs[FRAME_BUFFER_COUNT];
+    long frames = DEFAULT_FRAMES;
+    uint64_t haltSkipped = 0, idleSkipped = 0, dirtyLines = 0, dirtySpans = 0, start, elapsed;
+    struct line_span spans[MAX_SPANS];
+    int spanCount;
+    double seconds;
+    bool idleLoopSkip = true, headless = false, ring = false, stream = false;
+    palette_set_t paletteSet = PALETTE_SET_ILI9225;
+    scaler_mode_t scalerMode = SCALER_OFF;
+    int frameSkip = 0, cacheSlots = 0, lines, opt;
+    uint64_t frameStart;
+
+    while ((opt = getopt(argc, argv, "HIS:c:lp:rs:")) != -1) {
+        switch (opt) {
+        case 'H':
+            headless = true;
+            break;
+        case 'I':
+            idleLoopSkip = false;
+            break;
+        case 'c':
+            cacheSlots = atoi(optarg);
+            if (cacheSlots < 2 || cacheSlots > ROM_CACHE_MAX_SLOTS)
+                goto usage;
+            break;
+        case 'l':
+            stream = true;
+            break;
+        case 'S':
+            for (scalerMode = 0; scalerMode <= SCALER_BLEND; scalerMode++)
+                if (!strcmp(optarg, scalerModeNames[scalerMode]))
+                    break;
+            if (scalerMode > SCALER_BLEND)
+                goto usage;
+            break;
+        case 'p':
+            for (paletteSet = 0; paletteSet < PALETTE_SET_COUNT; paletteSet++)
+                if (!strcmp(optarg, paletteSetNames[paletteSet]))
+                    break;
+            if (paletteSet == PALETTE_SET_COUNT)
+                goto usage;
+            break;
+        case 'r':
+            ring = true;
+            break;
+        case 's':
+            frameSkip = strcmp(optarg, "auto") ? atoi(optarg) : FRAMESKIP_AUTO;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+    if (argc < 2) {
+usage:
+        fprintf(stderr, "usage: %s [-HIlr] [-S scaler] [-c slots] [-p palette] [-s skip] <rom.gb> [frames]\n"
+                "  -H  headless, draw only the last frame\n"
+                "  -I  do not skip idle polling loops\n"
+                "  -c  page switchable ROM banks through a cache of 2-32 slots\n"
+                "  -l  start with bank 0 only, load the others as they are mapped\n"
+                "  -S  off (default), nearest or blend scaling to 176x220\n"
+                "  -p  ili9225 (default), sdl2 or gray shades\n"
+                "  -r  stream changed lines through a line ring, no back buffer\n"
+                "  -s  frames to skip after each drawn one, or auto\n", argv[0]);
+        return 1;
+    }
+    if (argc > 2)
+        frames = strtol(argv[2], NULL, 0);
+    if (frames <= 0) {
+        fprintf(stderr, "frames must be positive\n");
+        return 1;
+    }
+
+    rom = rom_source_open(&romSource, argv[1], false);
+    if (!rom)
+        return 1;
+    for (int i = 0; i < FRAME_BUFFER_COUNT; i++)
+        bufferPtrs[i] = frameBuffers[i];
+    gb.frontBufferPtr = frameBuffers[0];
+    if (ring) {
+        lineRing.kick = ring_drain;
+        gb.lineRing = &lineRing;
+    } else {
+        gb.backBufferPtr = frame_buffers_init(&buffers, bufferPtrs);
+    }
+    romImage = rom;
+    if (stream) {
+        streamImage = calloc(1, romSource.size);
+        memcpy(streamImage, rom, ROM_BANK_SIZE);
+        romStream.loaded = 1;
+        romStream.wait = rom_stream_wait;
+        gb.cart.romStream = &romStream;
+        rom = streamImage;
+    }
+    if (cacheSlots) {
+        rom_cache_init(&romCache, malloc((size_t)cacheSlots * ROM_BANK_SIZE), cacheSlots, rom_fill);
+        gb.cart.romCache = &romCache;
+    }
+    cartridge_load(&gb, rom);
+    gb.cart.idleLoopSkip = idleLoopSkip;
+    gb.ppu.paletteSet = paletteSet;
+    gb.scaler.mode = scalerMode;
+    gb.frameSkip.ratio = (headless) ? FRAMESKIP_HEADLESS : frameSkip;
+    load_state_after_booting(&gb);
+
+    start = frameStart = now_ns();
+    for (long i = 0; i < frames; i++) {
+        // headless still draws the last frame, for the state hash
+        if (headless && i == frames - 1)
+            gb_draw_next_frame(&gb);
+        while (!gb.ppu.frameReady)
+            gb_run_frame(&gb);
+        gb.ppu.frameReady = false;
+        gb_frame_skip_update(&gb, (now_ns() - frameStart) / 1000);
+        frameStart = now_ns();
+        haltSkipped += gb.sched.frameHaltSkipped;
+        idleSkipped += gb.sched.frameIdleSkipped;
+        if (ring)
+            continue;
+        gb.backBufferPtr = frame_buffers_done(&buffers, gb.frameSkip.drawn);
+        // the display is free at once here, present the frame
+        front = frame_buffers_scanout(&buffers);
+        if (!front)
+            continue;
+        gb.frontBufferPtr = front;
+        // what a partial display update would have sent
+        spanCount = ppu_take_dirty_spans(&gb, spans, MAX_SPANS);
+        spanCount = scaler_map_spans(&gb, spans, spanCount);
+        dirtySpans += spanCount;
+        for (int j = 0; j < spanCount; j++)
+            dirtyLines += spans[j].count;
+    }
+    elapsed = now_ns() - start;
+    seconds = elapsed / 1e9;
+    lines = (scalerMode == SCALER_OFF) ? SCREEN_HEIGHT : SCALED_LINES;
+
+    printf("frames:           %ld\n", frames);
+    printf("instructions:     %llu\n", (unsigned long long)gb.executedInstructions);
+    printf("time:             %.3f s\n", seconds);
+    printf("frames/s:         %.1f (%.2fx realtime)\n", frames / seconds, frames / seconds / GB_FRAME_RATE);
+    printf("instructions/s:   %.0f\n", gb.executedInstructions / seconds);
+    printf("ns/instruction:   %.2f\n", (double)elapsed / gb.executedInstructions);
+    printf("HALT skipped:     %.0f cycles/frame (%.1f%% of emulated time)\n",
+           (double)haltSkipped / frames, 100.0 * haltSkipped / gb.sched.cycles);
+    printf("idle skipped:     %.0f cycles/frame (%.1f%% of emulated time)\n",
+           (double)idleSkipped / frames, 100.0 * idleSkipped / gb.sched.cycles);
+    printf("tile cache:       %.1f KiB, %.1f%% hit rate\n", sizeof(gb.tileCache) / 1024.0,
+           100.0 * gb.tileCache.hits / ((uint64_t)gb.tileCache.hits + gb.tileCache.misses));
+    if (!ring)
+        printf("dirty lines:      %.1f/frame in %.1f spans (%.1f%% of lines)\n", (double)dirtyLines / frames,
+           (double)dirtySpans / frames, 100.0 * dirtyLines / frames / lines);
+    if (cacheSlots)
+        printf("ROM cache:        %d slots, %u hits, %u misses (%.1f%% hit rate), %u errors\n", cacheSlots,
+               romCache.hits, romCache.misses, 100.0 * romCache.hits / ((uint64_t)romCache.hits + romCache.misses),
+               romCache.errors);
+    if (stream)
+        printf("ROM stream:       %d of %d banks loaded\n", romStream.loaded, gb.cart.rom.bankNumber);
+    printf("skipped frames:   %u\n", gb.frameSkip.skipped);
+    if (!ring)
+        printf("display frames:   %u dropped, %u duplicated\n", buffers.dropped, buffers.duplicated);
+    printf("state hash:       %08x\n", state_hash());
+
+    free(romCache.slots);
+    free(streamImage);
+    rom_source_close(&romSource);
+    return 0;
+}
@@ -0,0 +1,3 @@
+/* Host build of the emulator core: the whole core lives in gbdarm.h, this
+ * translation unit is what libgbdarm.a is made of. */
+#include "gbdarm.h"
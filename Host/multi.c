@@ -0,0 +1,174 @@
+/* gbdarm-multi: run the same ROM in many processes at once and report how
+ * long loading it took and how much memory each instance needs, to compare
+ * mapping the ROM with copying it. */
+#define GBDARM_DECLARATIONS_ONLY
+#include "gbdarm.h"
+#include "rom_source.h"
+
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_INSTANCES   64
+#define DEFAULT_FRAMES      600
+
+static struct gb gb;
+static uint16_t frameBuffers[2][SCREEN_HEIGHT * SCREEN_WIDTH];
+
+struct instance_result {
+    uint64_t loadNs;
+    long rssKiB;
+    long rssFileKiB;
+    long rssAnonKiB;
+    long pssKiB;
+    bool ok;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// a "Name:   value kB" line of a /proc/self file, -1 if missing
+static long proc_kib(const char *path, const char *name)
+{
+    char line[256];
+    long value = -1;
+    size_t len = strlen(name);
+    FILE *fp = fopen(path, "r");
+
+    if (!fp)
+        return -1;
+    while (fgets(line, sizeof(line), fp)) {
+        if (!strncmp(line, name, len) && line[len] == ':') {
+            value = strtol(line + len + 1, NULL, 10);
+            break;
+        }
+    }
+    fclose(fp);
+    return value;
+}
+
+/* one instance: load, run, then wait for the others before measuring, so
+ * PSS splits the shared pages between all of them */
+static void instance_run(const char *path, bool copy, long frames, int resultFd, int readyFd, int goFd)
+{
+    struct instance_result result = {0};
+    struct rom_source romSource;
+    uint64_t start;
+    uint8_t *rom;
+    char c;
+
+    // cartridge_load() prints the header, once per instance is too many
+    freopen("/dev/null", "w", stdout);
+    start = now_ns();
+    rom = rom_source_open(&romSource, path, copy);
+    if (rom) {
+        gb.frontBufferPtr = frameBuffers[0];
+        gb.backBufferPtr = frameBuffers[1];
+        cartridge_load(&gb, rom);
+        load_state_after_booting(&gb);
+        result.loadNs = now_ns() - start;
+        for (long i = 0; i < frames; i++) {
+            while (!gb.ppu.frameReady)
+                gb_run_frame(&gb);
+            gb.ppu.frameReady = false;
+        }
+        result.ok = true;
+    }
+    write(readyFd, "", 1);
+    read(goFd, &c, 1);
+    result.rssKiB = proc_kib("/proc/self/status", "VmRSS");
+    result.rssFileKiB = proc_kib("/proc/self/status", "RssFile");
+    result.rssAnonKiB = proc_kib("/proc/self/status", "RssAnon");
+    result.pssKiB = proc_kib("/proc/self/smaps_rollup", "Pss");
+    write(resultFd, &result, sizeof(result));
+    if (rom)
+        rom_source_close(&romSource);
+    _exit(result.ok ? 0 : 1);
+}
+
+int main(int argc, char **argv)
+{
+    int instances = DEFAULT_INSTANCES, opt, results[2], ready[2], go[2], ok = 0;
+    long frames = DEFAULT_FRAMES;
+    bool copy = false;
+    struct instance_result result, sum = {0};
+    uint64_t maxLoadNs = 0;
+    char c;
+
+    while ((opt = getopt(argc, argv, "cn:")) != -1) {
+        switch (opt) {
+        case 'c':
+            copy = true;
+            break;
+        case 'n':
+            instances = atoi(optarg);
+            break;
+        default:
+            goto usage;
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+    if (argc < 2 || instances <= 0) {
+usage:
+        fprintf(stderr, "usage: %s [-c] [-n instances] <rom.gb> [frames]\n"
+                "  -c  copy the ROM into each instance instead of mapping it\n"
+                "  -n  instances to run at once (default %d)\n", argv[0], DEFAULT_INSTANCES);
+        return 1;
+    }
+    if (argc > 2)
+        frames = strtol(argv[2], NULL, 0);
+
+    if (pipe(results) < 0 || pipe(ready) < 0 || pipe(go) < 0) {
+        perror("pipe");
+        return 1;
+    }
+    fflush(stdout);
+    for (int i = 0; i < instances; i++) {
+        pid_t pid = fork();
+
+        if (pid < 0) {
+            perror("fork");
+            return 1;
+        }
+        if (pid == 0) {
+            close(go[1]);
+            instance_run(argv[1], copy, frames, results[1], ready[1], go[0]);
+        }
+    }
+    close(go[0]);
+    for (int i = 0; i < instances; i++)
+        read(ready[0], &c, 1);
+    // all of them are loaded and still running, let them measure
+    close(go[1]);
+    for (int i = 0; i < instances; i++) {
+        if (read(results[0], &result, sizeof(result)) != sizeof(result) || !result.ok)
+            continue;
+        ok++;
+        sum.loadNs += result.loadNs;
+        sum.rssKiB += result.rssKiB;
+        sum.rssFileKiB += result.rssFileKiB;
+        sum.rssAnonKiB += result.rssAnonKiB;
+        sum.pssKiB += result.pssKiB;
+        if (result.loadNs > maxLoadNs)
+            maxLoadNs = result.loadNs;
+    }
+    while (wait(NULL) > 0)
+        ;
+    if (!ok) {
+        fprintf(stderr, "no instance ran\n");
+        return 1;
+    }
+
+    printf("instances:        %d, ROM %s\n", ok, copy ? "copied" : "mapped");
+    printf("load time:        %.1f us mean, %.1f us max\n", sum.loadNs / 1e3 / ok, maxLoadNs / 1e3);
+    printf("RSS:              %ld KiB mean (%ld KiB file, %ld KiB anonymous)\n",
+           sum.rssKiB / ok, sum.rssFileKiB / ok, sum.rssAnonKiB / ok);
+    printf("PSS:              %ld KiB mean, %ld KiB total\n", sum.pssKiB / ok, sum.pssKiB);
+    return 0;
+}
@@ -0,0 +1,90 @@
+#include "rom_source.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define ROM_HEADER_END      0x150
+
+/* Map the file over an anonymous reservation of src->size bytes, so banks
+ * past the end of a short file read as zero like the copy's padding. */
+static bool rom_source_map(struct rom_source *src, int fd, size_t fileSize)
+{
+    uint8_t *base;
+
+    base = mmap(NULL, src->size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return false;
+    if (mmap(base, fileSize, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(base, src->size);
+        return false;
+    }
+    // banks are jumped between, readahead around a fault is wasted; the whole
+    // file is wanted soon though
+    madvise(base, fileSize, MADV_RANDOM);
+    madvise(base, fileSize, MADV_WILLNEED);
+    src->data = base;
+    src->mapped = true;
+    return true;
+}
+
+static bool rom_source_copy(struct rom_source *src, int fd, size_t fileSize)
+{
+    ssize_t n;
+
+    src->data = calloc(1, src->size);
+    if (!src->data)
+        return false;
+    for (size_t done = 0; done < fileSize; done += n) {
+        n = pread(fd, src->data + done, fileSize - done, done);
+        if (n <= 0) {
+            free(src->data);
+            src->data = NULL;
+            return false;
+        }
+    }
+    src->mapped = false;
+    return true;
+}
+
+/* Returns the ROM, or NULL after printing why not. copy forces reading it
+ * into memory the way the device does; mapping falls back to that too. */
+uint8_t *rom_source_open(struct rom_source *src, const char *path, bool copy)
+{
+    struct stat st;
+    uint8_t romSize;
+    size_t headerSize;
+    int fd;
+
+    memset(src, 0, sizeof(*src));
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < ROM_HEADER_END || pread(fd, &romSize, 1, 0x0148) != 1) {
+        fprintf(stderr, "%s: not a GameBoy ROM\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    headerSize = (romSize <= 8) ? (size_t)32 * 1024 << romSize : (size_t)st.st_size;
+    src->size = (headerSize > (size_t)st.st_size) ? headerSize : (size_t)st.st_size;
+    if ((copy || !rom_source_map(src, fd, st.st_size)) && !rom_source_copy(src, fd, st.st_size))
+        fprintf(stderr, "%s: read failed\n", path);
+    close(fd);
+    return src->data;
+}
+
+void rom_source_close(struct rom_source *src)
+{
+    if (src->mapped)
+        munmap(src->data, src->size);
+    else
+        free(src->data);
+    src->data = NULL;
+}
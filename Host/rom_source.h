@@ -0,0 +1,20 @@
+/* ROM images for host builds. The file is mapped read-only rather than
+ * copied, so every process running the same ROM shares one page-cache copy;
+ * data goes straight to cartridge_load(). */
+#ifndef ROM_SOURCE_H
+#define ROM_SOURCE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct rom_source {
+    uint8_t *data;
+    size_t size;        // at least the size the header declares, zero filled
+    bool mapped;        // false when the file had to be copied
+};
+
+uint8_t *rom_source_open(struct rom_source *src, const char *path, bool copy);
+void rom_source_close(struct rom_source *src);
+
+#endif
@@ -0,0 +1,93 @@
+/* Helpers for the host tests run by make test: a check macro, a ROM that
+ * does nothing but spin, and random screen changes to feed the PPU with. */
+#ifndef TEST_H
+#define TEST_H
+
+/* Tests linked against libgbdarm define GBDARM_DECLARATIONS_ONLY first,
+ * tests built with their own flags get the whole core from here. */
+#include "gbdarm.h"
+
+#define TEST_WRITES_MAX     64
+
+static int testChecks, testFailures;
+
+#define CHECK(cond, ...) do { \
+    testChecks++; \
+    if (!(cond)) { \
+        testFailures++; \
+        fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+        fprintf(stderr, __VA_ARGS__); \
+        fputc('\n', stderr); \
+    } \
+} while (0)
+
+// prints the summary to stderr, the exit status for main()
+static inline int test_done(const char *name)
+{
+    fprintf(stderr, "%s: %d checks, %d failed\n", name, testChecks, testFailures);
+    return testFailures != 0;
+}
+
+static inline uint32_t test_random(uint32_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+// 32 KiB without an MBC, spinning on JR -2 at the entry point
+static inline uint8_t *test_rom(void)
+{
+    static uint8_t rom[32 * KiB];
+
+    rom[0x0100] = 0x18;
+    rom[0x0101] = 0xfe;
+    rom[0x0147] = 0x00;
+    rom[0x0148] = 0x00;
+    return rom;
+}
+
+/* Random VRAM and register writes for the next frame: a few tiles, map
+ * cells, now and then a scroll or palette change, so some lines change and
+ * most do not. Apply the same list to each core being compared. */
+static inline int test_screen_writes(uint32_t *rng, uint16_t *addrs, uint8_t *vals)
+{
+    int n = 0, count = test_random(rng) % 24;
+
+    for (int i = 0; i < count; i++) {
+        switch (test_random(rng) % 8) {
+        case 0: case 1: case 2:
+            addrs[n] = 0x8000 + test_random(rng) % 0x0800;     // tile data of tiles 0-127
+            break;
+        case 3: case 4: case 5:
+            addrs[n] = 0x9800 + test_random(rng) % 0x0400;     // BG map cell
+            vals[n++] = test_random(rng) % 128;
+            continue;
+        case 6:
+            addrs[n] = (test_random(rng) & 1) ? 0xff42 : 0xff43;  // SCY, SCX
+            break;
+        default:
+            addrs[n] = 0xff47;                                  // BGP
+            break;
+        }
+        vals[n++] = test_random(rng);
+    }
+    return n;
+}
+
+static inline void test_apply_writes(struct gb *gb, const uint16_t *addrs, const uint8_t *vals, int n)
+{
+    for (int i = 0; i < n; i++)
+        bus_write(gb, addrs[i], vals[i]);
+}
+
+// runs up to the next VBlank
+static inline void test_run_frame(struct gb *gb)
+{
+    while (!gb->ppu.frameReady)
+        gb_run_frame(gb);
+    gb->ppu.frameReady = false;
+}
+
+#endif
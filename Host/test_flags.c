@@ -0,0 +1,70 @@
+/* test_flags: run every opcode and every CB opcode once from random register,
+ * flag and WRAM states and print the state each leaves behind. make test
+ * builds it with and without GBDARM_LAZY_FLAGS and compares the two outputs,
+ * so the lazy flags must give the same F, registers and memory everywhere.
+ * It carries its own copy of the core to be built with either flag. */
+#include "gbdarm.h"
+#include "test.h"
+
+#define RUNS_PER_OPCODE     256
+
+static struct gb gb;
+static uint16_t frameBuffers[2][SCREEN_HEIGHT * SCREEN_WIDTH];
+
+static void run_opcode(uint32_t *rng, bool prefixed, int op, int run)
+{
+    uint32_t hash = 2166136261U;
+
+    gb.mode = NORMAL;
+    gb.interrupt.ie = 0;
+    gb.cpu.ime = test_random(rng) & 1;
+    gb.cpu.af.a = test_random(rng);
+    gb.cpu.af.f = test_random(rng) & 0xf0;
+    if (run & 1) {
+        // anywhere, so jumps and 16-bit arithmetic see all carries
+        gb.cpu.bc.val = test_random(rng);
+        gb.cpu.de.val = test_random(rng);
+        gb.cpu.hl.val = 0xc000 | (test_random(rng) & 0x1fff);
+    } else {
+        // into WRAM, so (BC), (DE) and (HL) read back what they wrote
+        gb.cpu.bc.val = 0xc100 | (test_random(rng) & 0xff);
+        gb.cpu.de.val = 0xc200 | (test_random(rng) & 0xff);
+        gb.cpu.hl.val = 0xc300 | (test_random(rng) & 0xff);
+    }
+    gb.cpu.sp = 0xcf00 | (test_random(rng) & 0xfe);
+    gb.cpu.pc = 0xc000;
+    for (int i = 0x100; i < 0x1f00; i++)
+        gb.workRAM[i] = test_random(rng);
+    gb.workRAM[0] = prefixed ? 0xcb : op;
+    gb.workRAM[1] = prefixed ? op : test_random(rng);
+    gb.workRAM[2] = test_random(rng) | 0xc0;       // high byte of a16, in WRAM or above
+    gb.workRAM[3] = test_random(rng);
+
+    cpu_run(&gb, 1);
+    gb.ppu.frameReady = false;
+
+    for (int i = 0; i < 0x2000; i++)
+        hash = (hash ^ gb.workRAM[i]) * 16777619U;
+    printf("%s%02x %04x %04x %04x %04x %04x %04x %d %d %08x\n", prefixed ? "cb" : "", op,
+           gb.cpu.af.a << 8 | gb.cpu.af.f, gb.cpu.bc.val, gb.cpu.de.val, gb.cpu.hl.val,
+           gb.cpu.sp, gb.cpu.pc, gb.cpu.ime, gb.mode, hash);
+}
+
+int main(void)
+{
+    uint32_t rng = 12345;
+
+    gb.frontBufferPtr = frameBuffers[0];
+    gb.backBufferPtr = frameBuffers[1];
+    cartridge_load(&gb, test_rom());
+    load_state_after_booting(&gb);
+    gb.cart.idleLoopSkip = false;
+
+    for (int op = 0; op < 256; op++)
+        for (int run = 0; run < RUNS_PER_OPCODE; run++)
+            run_opcode(&rng, false, op, run);
+    for (int op = 0; op < 256; op++)
+        for (int run = 0; run < RUNS_PER_OPCODE; run++)
+            run_opcode(&rng, true, op, run);
+    return 0;
+}
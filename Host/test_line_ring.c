@@ -0,0 +1,286 @@
+/* test_line_ring: the line ring on its own (a full ring, index wraparound,
+ * how line_ring_peek() splits runs), then fed by the PPU while a randomly
+ * late consumer copies the lines it is handed into a panel, which must end up
+ * as the frame the frame-buffer build drew. */
+#define GBDARM_DECLARATIONS_ONLY
+#include "gbdarm.h"
+#include "test.h"
+
+#define TEST_LINE_LENGTH    8
+#define SEQUENCE_LINES      1000
+#define PPU_FRAMES          300
+
+static struct line_ring ring;
+static int kicks, waits, waitsToFree;
+
+static void count_kick(struct line_ring *r)
+{
+    kicks++;
+}
+
+// frees the oldest slot on the waitsToFree-th call
+static void late_wait(struct line_ring *r)
+{
+    if (++waits == waitsToFree)
+        line_ring_release(r, 1);
+}
+
+static void ring_reset(uint32_t index, void (*kick)(struct line_ring *), void (*wait)(struct line_ring *))
+{
+    memset(&ring, 0, sizeof(ring));
+    ring.lineLength = TEST_LINE_LENGTH;
+    ring.head = ring.tail = index;
+    ring.kick = kick;
+    ring.wait = wait;
+    kicks = waits = 0;
+}
+
+// pushes a line whose pixels all hold tag
+static uint16_t *push(uint8_t lineNumber, uint16_t tag)
+{
+    uint16_t *pixels = line_ring_slot(&ring, lineNumber);
+
+    for (int i = 0; i < ring.lineLength; i++)
+        pixels[i] = tag;
+    line_ring_commit(&ring);
+    return pixels;
+}
+
+static void test_full_ring(void)
+{
+    uint16_t *pixels;
+    uint8_t first;
+    int n;
+
+    ring_reset(0, count_kick, late_wait);
+    waitsToFree = 3;
+    for (int i = 0; i < LINE_RING_SLOTS; i++)
+        push(i, i);
+    CHECK(ring.head - ring.tail == LINE_RING_SLOTS, "full ring holds %u lines", ring.head - ring.tail);
+    CHECK(waits == 0, "wait called %d times before the ring was full", waits);
+    CHECK(kicks == LINE_RING_SLOTS - LINE_RING_BLOCK + 1, "%d kicks, one per commit from a block on", kicks);
+
+    // one more waits until the consumer frees the oldest slot, then reuses it
+    pixels = push(LINE_RING_SLOTS, 0x1234);
+    CHECK(waits == waitsToFree, "wait called %d times, slot freed on call %d", waits, waitsToFree);
+    CHECK(pixels == ring.pixels, "line pushed into slot %d instead of the freed slot 0",
+          (int)(pixels - ring.pixels) / ring.lineLength);
+    CHECK(ring.head - ring.tail == LINE_RING_SLOTS, "ring not full again");
+
+    n = line_ring_peek(&ring, &pixels, &first);
+    CHECK(n == LINE_RING_BLOCK && first == 1 && pixels == ring.pixels + ring.lineLength,
+          "peek after the wait: %d lines from line %d", n, first);
+    line_ring_release(&ring, LINE_RING_SLOTS);
+    line_ring_flush(&ring);
+    CHECK(line_ring_peek(&ring, &pixels, &first) == 0, "empty ring peeks lines");
+}
+
+static void test_peek_split(void)
+{
+    static const uint8_t gap[] = {10, 11, 12, 20, 21, 23, 22};
+    static const int gapRuns[][2] = {{10, 3}, {20, 2}, {23, 1}, {22, 1}};
+    uint16_t *pixels;
+    uint8_t first;
+    int n;
+
+    // runs stop where the line numbers do not follow on
+    ring_reset(0, NULL, NULL);
+    for (int i = 0; i < (int)sizeof(gap); i++)
+        push(gap[i], i);
+    for (int i = 0; i < 4; i++) {
+        n = line_ring_peek(&ring, &pixels, &first);
+        CHECK(n == gapRuns[i][1] && first == gapRuns[i][0],
+              "gap run %d: %d lines from line %d, expected %d from %d", i, n, first, gapRuns[i][1], gapRuns[i][0]);
+        line_ring_release(&ring, n);
+    }
+
+    // and where the slots wrap around, though the lines follow on
+    ring_reset(LINE_RING_SLOTS - 2, NULL, NULL);
+    for (int i = 0; i < 4; i++)
+        push(5 + i, i);
+    n = line_ring_peek(&ring, &pixels, &first);
+    CHECK(n == 2 && first == 5 && pixels == ring.pixels + (LINE_RING_SLOTS - 2) * ring.lineLength,
+          "run before the slot wrap: %d lines from line %d", n, first);
+    line_ring_release(&ring, n);
+    n = line_ring_peek(&ring, &pixels, &first);
+    CHECK(n == 2 && first == 7 && pixels == ring.pixels, "run after the slot wrap: %d lines from line %d", n, first);
+    line_ring_release(&ring, n);
+
+    // and after a block
+    ring_reset(0, NULL, NULL);
+    for (int i = 0; i < LINE_RING_BLOCK + 2; i++)
+        push(i, i);
+    n = line_ring_peek(&ring, &pixels, &first);
+    CHECK(n == LINE_RING_BLOCK && first == 0, "run longer than a block: %d lines", n);
+}
+
+/* Lines go in and come out in order, slots wrapping many times over and the
+ * 32-bit indices wrapping past zero, with the consumer taking runs at random
+ * and the producer waiting for it when the ring is full. */
+static uint8_t sequenceLines[SEQUENCE_LINES];
+static int consumed;
+
+static void consume_run(struct line_ring *r)
+{
+    uint16_t *pixels;
+    uint8_t first;
+    int slot = r->tail % LINE_RING_SLOTS;
+    int n = line_ring_peek(r, &pixels, &first);
+
+    CHECK(n > 0 || r->head == r->tail, "peek found nothing in a ring of %u lines", r->head - r->tail);
+    CHECK(n <= LINE_RING_BLOCK && slot + n <= LINE_RING_SLOTS, "run of %d lines from slot %d", n, slot);
+    for (int i = 0; i < n; i++, consumed++) {
+        CHECK(first + i == sequenceLines[consumed], "line %d came out as %d, expected %d",
+              consumed, first + i, sequenceLines[consumed]);
+        for (int j = 0; j < r->lineLength; j++)
+            CHECK(pixels[i * r->lineLength + j] == (uint16_t)consumed, "pixels of line %d overwritten", consumed);
+    }
+    line_ring_release(r, n);
+}
+
+static void consume_on_wait(struct line_ring *r)
+{
+    waits++;
+    consume_run(r);
+}
+
+static void test_wraparound(void)
+{
+    uint32_t rng = 1;
+    int line = 0;
+
+    // a slot index that is not 0, LINE_RING_SLOTS - 38 lines before the index wraps
+    ring_reset(UINT32_MAX - 37, count_kick, consume_on_wait);
+    consumed = 0;
+    for (int i = 0; i < SEQUENCE_LINES; i++) {
+        // mostly the next line, now and then a jump as with unchanged lines
+        line = (test_random(&rng) % 5) ? line + 1 : (int)(test_random(&rng) % SCALED_LINES);
+        if (line >= SCALED_LINES)
+            line = 0;
+        sequenceLines[i] = line;
+        push(line, i);
+        if (test_random(&rng) % 3 == 0)
+            consume_run(&ring);
+    }
+    while (ring.head != ring.tail)
+        consume_run(&ring);
+    CHECK(consumed == SEQUENCE_LINES, "%d of %d lines came out", consumed, SEQUENCE_LINES);
+    CHECK(ring.head < SEQUENCE_LINES, "head did not wrap past zero");
+    CHECK(waits > 0, "the ring never filled up");
+}
+
+/* The PPU pushing into the ring: a consumer "DMA" that completes a transfer
+ * only now and then, sometimes not before the next frame is under way. */
+static struct gb fbGb, ringGb;
+static uint16_t frameBuffers[2][LCD_WIDTH * LCD_HEIGHT];
+static uint16_t panel[LCD_WIDTH * LCD_HEIGHT], lastDrawn[LCD_WIDTH * LCD_HEIGHT];
+static uint32_t dmaRng;
+static uint16_t *inFlight;
+static uint8_t inFlightFirst;
+static int inFlightCount, dmaWaits;
+
+static void dma_complete(struct line_ring *r)
+{
+    if (!inFlightCount)
+        return;
+    // the slots must still hold what was peeked until they are released
+    memcpy(panel + inFlightFirst * r->lineLength, inFlight, inFlightCount * r->lineLength * sizeof(uint16_t));
+    line_ring_release(r, inFlightCount);
+    inFlightCount = 0;
+}
+
+static void dma_start(struct line_ring *r)
+{
+    if (!inFlightCount)
+        inFlightCount = line_ring_peek(r, &inFlight, &inFlightFirst);
+}
+
+static void dma_kick(struct line_ring *r)
+{
+    if (test_random(&dmaRng) % 3 == 0)
+        dma_complete(r);
+    dma_start(r);
+}
+
+static void dma_wait(struct line_ring *r)
+{
+    dmaWaits++;
+    dma_complete(r);
+    dma_start(r);
+}
+
+static void test_ppu(int mode, int skip)
+{
+    uint32_t rng = 7 + mode * 16 + skip;
+    uint16_t addrs[TEST_WRITES_MAX], *swap;
+    uint8_t vals[TEST_WRITES_MAX];
+    int length = (mode == SCALER_OFF) ? SCREEN_WIDTH * SCREEN_HEIGHT : SCALED_LINES * SCALED_LINE_LENGTH;
+    int compared = 0, differ = 0, n;
+
+    memset(&fbGb, 0, sizeof(fbGb));
+    memset(&ringGb, 0, sizeof(ringGb));
+    memset(frameBuffers, 0, sizeof(frameBuffers));
+    memset(panel, 0, sizeof(panel));
+    memset(lastDrawn, 0, sizeof(lastDrawn));
+    memset(&ring, 0, sizeof(ring));
+    dmaRng = rng;
+    inFlightCount = dmaWaits = 0;
+
+    fbGb.frontBufferPtr = frameBuffers[0];
+    fbGb.backBufferPtr = frameBuffers[1];
+    cartridge_load(&fbGb, test_rom());
+    fbGb.scaler.mode = mode;
+    fbGb.frameSkip.ratio = skip;
+    load_state_after_booting(&fbGb);
+
+    ring.kick = dma_kick;
+    ring.wait = dma_wait;
+    ringGb.lineRing = &ring;
+    cartridge_load(&ringGb, test_rom());
+    ringGb.scaler.mode = mode;
+    ringGb.frameSkip.ratio = skip;
+    load_state_after_booting(&ringGb);
+
+    for (int frame = 0; frame < PPU_FRAMES; frame++) {
+        n = test_screen_writes(&rng, addrs, vals);
+        test_apply_writes(&fbGb, addrs, vals, n);
+        test_apply_writes(&ringGb, addrs, vals, n);
+        test_run_frame(&fbGb);
+        test_run_frame(&ringGb);
+        if (fbGb.frameSkip.drawn) {
+            memcpy(lastDrawn, fbGb.backBufferPtr, length * sizeof(uint16_t));
+            swap = fbGb.frontBufferPtr;
+            fbGb.frontBufferPtr = fbGb.backBufferPtr;
+            fbGb.backBufferPtr = swap;
+        }
+        gb_frame_skip_update(&fbGb, 1000);
+        gb_frame_skip_update(&ringGb, 1000);
+
+        // most frames the consumer catches up by the end, then the panel is whole
+        if (test_random(&rng) % 4 == 0)
+            continue;
+        while (ring.head != ring.tail || inFlightCount) {
+            dma_complete(&ring);
+            dma_start(&ring);
+        }
+        compared++;
+        if (memcmp(panel, lastDrawn, length * sizeof(uint16_t)))
+            differ++;
+    }
+    CHECK(differ == 0, "scaler %d, skip %d: %d of %d panels differ from the frame buffer", mode, skip, differ, compared);
+    CHECK(dmaWaits > 0, "scaler %d, skip %d: the ring never filled up", mode, skip);
+}
+
+int main(void)
+{
+    // cartridge_load() prints the header for every core
+    freopen("/dev/null", "w", stdout);
+    test_full_ring();
+    test_peek_split();
+    test_wraparound();
+    for (int mode = SCALER_OFF; mode <= SCALER_BLEND; mode++) {
+        test_ppu(mode, 0);
+        test_ppu(mode, 2);
+    }
+    return test_done("test_line_ring");
+}
@@ -0,0 +1,105 @@
+/* test_rom_cache: the bank cache when fill fails, as an SD card read can.
+ * A bank that reads on a retry is mapped; one that never reads leaves the
+ * bank mapped before it in place, intact, and is read again next time. */
+#define GBDARM_DECLARATIONS_ONLY
+#include "gbdarm.h"
+#include "test.h"
+
+#define BANKS               64      // 1 MiB, header size code 5
+#define SLOTS               4
+
+static struct gb gb;
+static struct rom_cache cache;
+static uint8_t image[BANKS * ROM_BANK_SIZE], slots[SLOTS * ROM_BANK_SIZE];
+static uint16_t frameBuffers[2][SCREEN_HEIGHT * SCREEN_WIDTH];
+static int failures[BANKS];         // reads of each bank that fail before one works
+
+static bool flaky_fill(struct rom_cache *c, int bank, uint8_t *dst)
+{
+    if (failures[bank] > 0) {
+        failures[bank]--;
+        memset(dst, 0xee, ROM_BANK_SIZE);   // what a failed DMA may leave
+        return false;
+    }
+    memcpy(dst, image + bank * ROM_BANK_SIZE, ROM_BANK_SIZE);
+    return true;
+}
+
+static void load(void)
+{
+    memset(&gb, 0, sizeof(gb));
+    rom_cache_init(&cache, slots, SLOTS, flaky_fill);
+    gb.cart.romCache = &cache;
+    gb.frontBufferPtr = frameBuffers[0];
+    gb.backBufferPtr = frameBuffers[1];
+    cartridge_load(&gb, image);
+    load_state_after_booting(&gb);
+}
+
+// the whole of 4000-7fff holds the bank's number
+static bool mapped(int bank)
+{
+    for (int addr = 0x4000; addr < 0x8000; addr++) {
+        if (bus_read(&gb, addr) != bank)
+            return false;
+    }
+    return true;
+}
+
+static void map(int bank)
+{
+    bus_write(&gb, 0x2000, bank);
+}
+
+int main(void)
+{
+    uint32_t errors;
+
+    for (int bank = 1; bank < BANKS; bank++)
+        memset(image + bank * ROM_BANK_SIZE, bank, ROM_BANK_SIZE);
+    image[0x0147] = 0x19;   // MBC5
+    image[0x0148] = 0x05;
+    freopen("/dev/null", "w", stdout);
+
+    load();
+    CHECK(mapped(1), "bank 1 not mapped after loading");
+
+    // reads on the last try
+    failures[5] = ROM_CACHE_FILL_RETRIES - 1;
+    map(5);
+    CHECK(mapped(5), "bank 5 not mapped after %d failed reads", ROM_CACHE_FILL_RETRIES - 1);
+    CHECK(cache.errors == ROM_CACHE_FILL_RETRIES - 1, "%u errors counted", cache.errors);
+
+    // never reads: bank 5 stays, until a later try works
+    failures[7] = 2 * ROM_CACHE_FILL_RETRIES;
+    errors = cache.errors;
+    map(7);
+    CHECK(mapped(5), "bank 5 not kept when bank 7 failed");
+    CHECK(cache.errors - errors == ROM_CACHE_FILL_RETRIES, "%u errors counted", cache.errors - errors);
+    map(7);
+    CHECK(mapped(5), "bank 5 not kept when bank 7 failed again");
+    map(7);
+    CHECK(mapped(7), "bank 7 not mapped once it read");
+
+    // with all the slots it can pinned, the mapped bank's slot is still not the one refilled
+    CHECK(rom_cache_pin(&cache, 20) && rom_cache_pin(&cache, 21), "two of four slots not pinned");
+    CHECK(!rom_cache_pin(&cache, 22), "a third of four slots pinned");
+    for (int bank = 30; bank < 40; bank++) {
+        map(bank - 1);
+        failures[bank] = ROM_CACHE_FILL_RETRIES;
+        map(bank);
+        CHECK(mapped(bank - 1), "bank %d not kept when bank %d failed", bank - 1, bank);
+    }
+    map(20);
+    CHECK(mapped(20), "pinned bank 20 not mapped");
+
+    // bank 1 failing while loading leaves bank 0 there
+    memset(failures, 0, sizeof(failures));
+    failures[1] = INT32_MAX;
+    load();
+    CHECK(gb.mbc.romx == gb.mbc.rom0, "romx is not bank 0 after bank 1 failed to load");
+    failures[1] = 0;
+    map(1);
+    CHECK(mapped(1), "bank 1 not mapped once it read");
+    return test_done("test_rom_cache");
+}
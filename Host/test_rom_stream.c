@@ -0,0 +1,86 @@
+/* test_rom_stream: a ROM streamed in after boot, as from the SD card, with
+ * only bank 0 there at first. Loading, running and switching banks must not
+ * wait for the stream; the first read of a bank that is not in yet waits for
+ * that bank and no further. */
+#define GBDARM_DECLARATIONS_ONLY
+#include "gbdarm.h"
+#include "test.h"
+
+#define BANKS               8       // 128 KiB, header size code 2
+
+static struct gb gb;
+static struct rom_stream stream;
+static uint8_t image[BANKS * ROM_BANK_SIZE], streamed[BANKS * ROM_BANK_SIZE];
+static uint16_t frameBuffers[2][SCREEN_HEIGHT * SCREEN_WIDTH];
+static int waits, waitedBank;
+
+// the rest of the stream arriving at once up to the bank asked for
+static void stream_wait(struct rom_stream *s, int bank)
+{
+    waits++;
+    waitedBank = bank;
+    for (; s->loaded <= bank; s->loaded++)
+        memcpy(streamed + s->loaded * ROM_BANK_SIZE, image + s->loaded * ROM_BANK_SIZE, ROM_BANK_SIZE);
+}
+
+static void load(void)
+{
+    memset(&gb, 0, sizeof(gb));
+    memset(streamed, 0, sizeof(streamed));
+    memcpy(streamed, image, ROM_BANK_SIZE);
+    stream.loaded = 1;
+    stream.wait = stream_wait;
+    waits = 0;
+    gb.cart.romStream = &stream;
+    gb.frontBufferPtr = frameBuffers[0];
+    gb.backBufferPtr = frameBuffers[1];
+    cartridge_load(&gb, streamed);
+    load_state_after_booting(&gb);
+}
+
+int main(void)
+{
+    for (int bank = 1; bank < BANKS; bank++)
+        memset(image + bank * ROM_BANK_SIZE, bank, ROM_BANK_SIZE);
+    image[0x0100] = 0x18;   // JR -2
+    image[0x0101] = 0xfe;
+    image[0x0150] = 0xfa;   // LD A,(0x4000)
+    image[0x0151] = 0x00;
+    image[0x0152] = 0x40;
+    image[0x0153] = 0x18;   // JR -2
+    image[0x0154] = 0xfe;
+    image[0x0147] = 0x19;   // MBC5
+    image[0x0148] = 0x02;
+    freopen("/dev/null", "w", stdout);
+
+    // booting and running out of bank 0 leave the stream alone
+    load();
+    CHECK(waits == 0, "loading waited %d times for the stream", waits);
+    test_run_frame(&gb);
+    CHECK(waits == 0, "a frame in bank 0 waited %d times for the stream", waits);
+    CHECK(stream.loaded == 1, "%d banks loaded before any was read", stream.loaded);
+
+    // so does switching to a bank that is not in
+    bus_write(&gb, 0x2000, 3);
+    CHECK(waits == 0, "switching to bank 3 waited for the stream");
+
+    // reading it waits for that bank, once
+    CHECK(bus_read(&gb, 0x4000) == 3, "bank 3 reads as %d", bus_read(&gb, 0x4000));
+    CHECK(waits == 1 && waitedBank == 3, "%d waits, the last for bank %d", waits, waitedBank);
+    CHECK(stream.loaded == 4, "%d banks loaded after waiting for bank 3", stream.loaded);
+    CHECK(bus_read(&gb, 0x7fff) == 3 && waits == 1, "bank 3 waited for again");
+    CHECK(gb.page.read[0x40] != NULL, "bank 3 not on the page table once read");
+
+    // a bank already in is mapped at once
+    bus_write(&gb, 0x2000, 2);
+    CHECK(gb.page.read[0x40] != NULL && waits == 1, "bank 2 not mapped straight away");
+    CHECK(bus_read(&gb, 0x4000) == 2 && bus_read(&gb, 0x7fff) == 2, "bank 2 not mapped");
+
+    // the CPU reading bank 1 for the first time
+    load();
+    gb.cpu.pc = 0x0150;
+    cpu_run(&gb, 1);
+    CHECK(gb.cpu.af.a == 1, "LD A,(0x4000) read %d from bank 1", gb.cpu.af.a);
+    CHECK(waits == 1 && waitedBank == 1, "%d waits, the last for bank %d", waits, waitedBank);
+    return test_done("test_rom_stream");
+}
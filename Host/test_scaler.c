@@ -0,0 +1,139 @@
+/* test_scaler: every pixel of every scaled frame against a floating-point
+ * reference scaled from the unscaled frame, and scaler_map_spans() against
+ * the output lines that actually changed, for SCALER_NEAREST and
+ * SCALER_BLEND. */
+#define GBDARM_DECLARATIONS_ONLY
+#include "gbdarm.h"
+#include "test.h"
+
+#include <math.h>
+
+#define FRAMES              200
+#define MAX_SPANS           16
+/* per RGB565 channel, in steps of that channel: the weights are 1/32 and
+ * each axis truncates once */
+#define BLEND_MAX_ERROR     2.0
+
+static struct gb gbs[SCALER_BLEND + 1];
+static uint16_t frameBuffers[SCALER_BLEND + 1][2][LCD_WIDTH * LCD_HEIGHT];
+static uint16_t previous[SCALER_BLEND + 1][LCD_WIDTH * LCD_HEIGHT];
+
+static double channel(uint16_t color, int k)
+{
+    return (k == 0) ? color >> 11 : (k == 1) ? (color >> 5) & 0x3f : color & 0x1f;
+}
+
+// source position of the center of output pixel i, n output to m source pixels
+static double source_pos(int i, int n, int m)
+{
+    double pos = (i + 0.5) * m / n - 0.5;
+
+    return (pos < 0) ? 0 : (pos > m - 1) ? m - 1 : pos;
+}
+
+static double reference(const uint16_t *src, int mode, int line, int x, int k)
+{
+    double py, px, wy, wx, upper, lower;
+    int y0, x0, y1, x1;
+
+    if (mode == SCALER_NEAREST) {
+        y0 = (int)((line + 0.5) * SCREEN_HEIGHT / SCALED_LINES);
+        x0 = (int)((x + 0.5) * SCREEN_WIDTH / SCALED_LINE_LENGTH);
+        return channel(src[y0 * SCREEN_WIDTH + x0], k);
+    }
+    py = source_pos(line, SCALED_LINES, SCREEN_HEIGHT);
+    px = source_pos(x, SCALED_LINE_LENGTH, SCREEN_WIDTH);
+    y0 = (int)py;
+    x0 = (int)px;
+    y1 = (y0 < SCREEN_HEIGHT - 1) ? y0 + 1 : y0;
+    x1 = (x0 < SCREEN_WIDTH - 1) ? x0 + 1 : x0;
+    wy = py - y0;
+    wx = px - x0;
+    upper = channel(src[y0 * SCREEN_WIDTH + x0], k) * (1 - wx) + channel(src[y0 * SCREEN_WIDTH + x1], k) * wx;
+    lower = channel(src[y1 * SCREEN_WIDTH + x0], k) * (1 - wx) + channel(src[y1 * SCREEN_WIDTH + x1], k) * wx;
+    return upper * (1 - wy) + lower * wy;
+}
+
+// returns the largest difference from the reference
+static double compare_frame(int mode, int frame)
+{
+    const uint16_t *src = gbs[SCALER_OFF].backBufferPtr, *out = gbs[mode].backBufferPtr;
+    double error, maxError = 0;
+
+    for (int line = 0; line < SCALED_LINES; line++) {
+        for (int x = 0; x < SCALED_LINE_LENGTH; x++) {
+            for (int k = 0; k < 3; k++) {
+                error = fabs(channel(out[line * SCALED_LINE_LENGTH + x], k) - reference(src, mode, line, x, k));
+                if (error > maxError)
+                    maxError = error;
+                if (mode == SCALER_NEAREST)
+                    CHECK(error == 0, "frame %d: nearest pixel %d of line %d is off by %g", frame, x, line, error);
+                else
+                    CHECK(error < BLEND_MAX_ERROR, "frame %d: blended pixel %d of line %d is off by %g",
+                          frame, x, line, error);
+            }
+        }
+    }
+    return maxError;
+}
+
+// every output line that differs from the previous frame must be in a span
+static void check_spans(int mode, int frame)
+{
+    struct gb *gb = &gbs[mode];
+    struct line_span spans[MAX_SPANS];
+    const uint16_t *out = gb->backBufferPtr;
+    bool covered[SCALED_LINES] = {false};
+    int n = scaler_map_spans(gb, spans, ppu_take_dirty_spans(gb, spans, MAX_SPANS));
+
+    for (int i = 0; i < n; i++) {
+        CHECK(spans[i].first + spans[i].count <= SCALED_LINES, "frame %d: span %d+%d past the last line",
+              frame, spans[i].first, spans[i].count);
+        CHECK(i == 0 || spans[i].first > spans[i - 1].first + spans[i - 1].count,
+              "frame %d: spans %d and %d overlap or touch", frame, i - 1, i);
+        for (int line = spans[i].first; line < spans[i].first + spans[i].count && line < SCALED_LINES; line++)
+            covered[line] = true;
+    }
+    for (int line = 0; line < SCALED_LINES; line++) {
+        if (memcmp(out + line * SCALED_LINE_LENGTH, previous[mode] + line * SCALED_LINE_LENGTH,
+                   SCALED_LINE_LENGTH * sizeof(uint16_t)))
+            CHECK(covered[line], "frame %d, scaler %d: changed line %d is in no span", frame, mode, line);
+    }
+    memcpy(previous[mode], out, sizeof(previous[mode]));
+}
+
+int main(void)
+{
+    uint32_t rng = 99;
+    uint16_t addrs[TEST_WRITES_MAX];
+    uint8_t vals[TEST_WRITES_MAX];
+    double maxError[SCALER_BLEND + 1] = {0}, error;
+    int n;
+
+    // cartridge_load() prints the header for every core
+    freopen("/dev/null", "w", stdout);
+    for (int mode = SCALER_OFF; mode <= SCALER_BLEND; mode++) {
+        // the PPU redraws every line, so one back buffer is enough
+        gbs[mode].frontBufferPtr = frameBuffers[mode][0];
+        gbs[mode].backBufferPtr = frameBuffers[mode][1];
+        cartridge_load(&gbs[mode], test_rom());
+        gbs[mode].scaler.mode = mode;
+        load_state_after_booting(&gbs[mode]);
+    }
+    for (int frame = 0; frame < FRAMES; frame++) {
+        n = test_screen_writes(&rng, addrs, vals);
+        for (int mode = SCALER_OFF; mode <= SCALER_BLEND; mode++) {
+            test_apply_writes(&gbs[mode], addrs, vals, n);
+            test_run_frame(&gbs[mode]);
+        }
+        for (int mode = SCALER_NEAREST; mode <= SCALER_BLEND; mode++) {
+            error = compare_frame(mode, frame);
+            if (error > maxError[mode])
+                maxError[mode] = error;
+            check_spans(mode, frame);
+        }
+    }
+    fprintf(stderr, "test_scaler: largest difference from the reference, nearest %g, blend %.3f\n",
+            maxError[SCALER_NEAREST], maxError[SCALER_BLEND]);
+    return test_done("test_scaler");
+}
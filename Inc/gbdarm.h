@@ -30,11 +30,28 @@
 #define SDL2_COLOR_DGRAY                0x306230ff     /* Dark Gray */
 #define SDL2_COLOR_BLACK                0x0f380fff     /* Black */
 
+#define GRAYSCALE_COLOR_WHITE           0xffff
+#define GRAYSCALE_COLOR_LIGHTGRAY       0xad55
+#define GRAYSCALE_COLOR_DARKGRAY        0x52aa
+#define GRAYSCALE_COLOR_BLACK           0x0000
+
+// RGBA8888 -> RGB565
+#define RGB565(rgba)                    \
+    ((((rgba) >> 16) & 0xf800) | (((rgba) >> 13) & 0x07e0) | (((rgba) >> 11) & 0x001f))
+
 #define SYSTEM_CLOCK        4194304
 #define LCD_HEIGHT          220
 #define LCD_WIDTH           176
 #define SCREEN_WIDTH        160
 #define SCREEN_HEIGHT       144
+#define DIRTY_LINE_WORDS    ((SCREEN_HEIGHT + 31) / 32)    // a bit per line
+
+// RGB565 spread out as 0b00000gggggg00000rrrrr000000bbbbb, with room to blend
+#define RGB565_EXPAND(c)    (((uint32_t)(c) | (uint32_t)(c) << 16) & 0x07e0f81fU)
+#define RGB565_PACK(x)      ((uint16_t)(((x) & 0xf81f) | (((x) >> 16) & 0x07e0)))
+// a + (b - a) * w / 32 on expanded colors, rounded
+#define RGB565_BLEND(a, b, w)   \
+    ((((a) * (32 - (w)) + (b) * (w) + 0x02008010U) >> 5) & 0x07e0f81fU)
 
 #define KiB                 1024
 #define MiB                 1048576
@@ -117,6 +134,13 @@ typedef enum {
     BACK 
 } which_buffer_t;
 
+typedef enum {
+    BUFFER_FREE,
+    BUFFER_RENDERING,   // the PPU draws into it
+    BUFFER_QUEUED,      // a finished frame waiting for the display
+    BUFFER_SCANOUT,     // being sent, or on the panel until the next one is
+} buffer_state_t;
+
 typedef enum {
     NORMAL,
     HALT,
@@ -137,6 +161,14 @@ typedef enum {
     TRANSFERING,
 } dma_mode_t;
 
+typedef enum {
+    EVENT_TIMER,
+    EVENT_DMA,
+    EVENT_PPU,
+    EVENT_HOST,         // end of the budget gb_run_cycles() was given
+    EVENT_COUNT,
+} event_t;
+
 typedef enum {
     SQUARE1 = 1,
     SQUARE2 = 2,
@@ -151,6 +183,13 @@ typedef enum {
     BGP,
 } palette_t;
 
+typedef enum {
+    PALETTE_SET_ILI9225,
+    PALETTE_SET_SDL2,
+    PALETTE_SET_GRAYSCALE,
+    PALETTE_SET_COUNT,
+} palette_set_t;
+
 typedef enum {
     BG_WIN,
     SPRITE,
@@ -168,21 +207,14 @@ typedef enum {
     MBC3 = 0x11,
     MBC3_RAM = 0x12,
     MBC3_RAM_BATTERY = 0x13,
+    MBC5 = 0x19,
+    MBC5_RAM = 0x1a,
+    MBC5_RAM_BATTERY = 0x1b,
+    MBC5_RUMBLE = 0x1c,
+    MBC5_RUMBLE_RAM = 0x1d,
+    MBC5_RUMBLE_RAM_BATTERY = 0x1e,
 } rom_type_t;
 
-static uint8_t mbc1BitMask[] = {
-    [2]   = 0b00000001,
-    [4]   = 0b00000011,
-    [8]   = 0b00000111,
-    [16]  = 0b00001111,
-    [32]  = 0b00011111,
-    [64]  = 0b00011111,
-    [128] = 0b00011111,
-};
-
-const uint16_t ili9225Palette[4] = {ILI9225_COLOR_WHITE, ILI9225_COLOR_LIGHTGRAY, ILI9225_COLOR_DARKGRAY, ILI9225_COLOR_BLACK};
-const uint32_t sdl2Palette[4] = {SDL2_COLOR_WHITE, SDL2_COLOR_LGRAY, SDL2_COLOR_DGRAY, SDL2_COLOR_BLACK};
-
 struct cpu {
     bool ime;
     union {
@@ -233,18 +265,56 @@ struct cpu {
     uint16_t pc;
 };
 
+#define ROM_BANK_SIZE           (16 * KiB)
+#define ROM_MAX_BANKS           512     // 8 MiB, MBC5
+#define ROM_CACHE_MAX_SLOTS     32
+#define ROM_CACHE_FILL_RETRIES  3       // reads of a bank before giving up on it
+
+/* Switchable ROM banks paged in on demand, for ROMs bigger than RAM. Bank 0
+ * stays in cart.rom.data; when an MBC maps another bank that is not in a
+ * slot, fill reads it into the least recently mapped slot that is not
+ * pinned. Two slots always stay unpinned, so that is never the slot of the
+ * bank mapped now, which stays mapped if the new one cannot be read. */
+struct rom_cache {
+    uint8_t *slots;                             // slotCount banks, from the host, 2 or more
+    int slotCount;
+    int16_t slotBank[ROM_CACHE_MAX_SLOTS];      // bank in each slot, -1 for none
+    uint32_t slotUsed[ROM_CACHE_MAX_SLOTS];     // clock when last mapped
+    bool slotPinned[ROM_CACHE_MAX_SLOTS];
+    int8_t bankSlot[ROM_MAX_BANKS];             // slot holding each bank, -1 for none
+    uint32_t clock;
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t errors;                            // fills that failed, retries included
+    // read ROM_BANK_SIZE bytes of bank into dst, false on error
+    bool (*fill)(struct rom_cache *cache, int bank, uint8_t *dst);
+};
+
+/* A ROM still being read into rom.data while the emulator runs: banks below
+ * loaded are in, the rest land in order. A bank mapped before it is in stays
+ * off the page table until the CPU first reads it, which makes wait return
+ * once it has landed. loaded only grows, the host may bump it from an
+ * interrupt. */
+struct rom_stream {
+    int loaded;
+    void (*wait)(struct rom_stream *stream, int bank);
+};
+
 struct cartridge {
     struct rom {
-        uint8_t *data;
+        uint8_t *data;          // the whole ROM, or only bank 0 with a romCache
         char name[17];
         uint8_t type;
         int size;
         int bankNumber;
     } rom;
+    struct rom_cache *romCache; // NULL when rom.data holds the whole ROM
+    struct rom_stream *romStream;   // NULL when rom.data was read in beforehand
     struct ram {
         uint8_t data[32 * KiB];
         int size;
     } ram;
+    bool idleLoopSkip;          // clear for ROMs that misbehave with cpu_skip_idle_loop()
 };
 
 typedef enum ACCESS_MODE {
@@ -326,18 +396,134 @@ struct ppu {
     uint8_t ly;
     uint8_t lyc;
     uint8_t pal[3];
+    uint16_t palRGB[3][4];      // pal[] resolved to RGB565, rebuilt on writes
+    palette_set_t paletteSet;
     uint8_t wy;
     int8_t wx;
     uint16_t ticks;
     ppu_mode_t mode;
     bool scanLineReady;
     struct oam_entry oamEntry[10];
+    uint64_t lineSprites[SCREEN_HEIGHT];    // per line, a bit for each OAM entry on it
     uint8_t oamEntryCounter : 4;
     uint8_t spriteCounter : 4;
     bool statIntrLine;
     bool windowInFrame;
     int windowLineCounter;
     bool drawWindowThisLine;
+    uint32_t lineHash[SCREEN_HEIGHT];   // of each line as last drawn
+    uint32_t dirtyLines[DIRTY_LINE_WORDS];  // changed since ppu_take_dirty_spans()
+};
+
+// a run of changed lines of the back buffer
+struct line_span {
+    uint8_t first;
+    uint8_t count;
+};
+
+#define TILE_COUNT      384
+
+/* The tiles at 0x8000-0x97ff decoded to one color ID per pixel. A write to
+ * tile data marks its row dirty and the row is decoded again when next drawn. */
+struct tile_cache {
+    uint8_t pixels[TILE_COUNT][8][8];
+    uint8_t dirty[TILE_COUNT];      // one bit per row
+    uint32_t hits;
+    uint32_t misses;
+};
+
+#ifdef GBDARM_BG_SURFACE
+/* Both 256x256 tile maps (0x9800 and 0x9c00) as color IDs, so a BG or window
+ * line is copied out of a map row instead of being fetched tile by tile.
+ * A row of a cell is rendered again when the map entry, the tile data or the
+ * tile addressing mode changed. Palettes are applied when the line is copied. */
+struct bg_surface {
+    uint8_t ids[2][256][256];
+    uint8_t dirty[2][1024];             // per map cell, one bit per row
+    uint8_t pendingTiles[TILE_COUNT];   // rows written since the maps were checked
+    bool tilesPending;
+};
+#endif
+
+#define FRAME_US            16742   // one frame at 59.73 Hz
+#define FRAMESKIP_AUTO      -1
+#define FRAMESKIP_HEADLESS  -2      // draw only the frames gb_draw_next_frame() asks for
+#define FRAMESKIP_MAX       4       // most frames skipped in a row by the auto mode
+
+/* Skipped frames run the CPU and PPU as usual, LY, STAT and interrupts
+ * included, but draw no pixels, so the back buffer and the dirty lines stay
+ * as the last drawn frame left them. */
+struct frame_skip {
+    int ratio;          // frames skipped after each drawn one, FRAMESKIP_AUTO or _HEADLESS
+    bool skipping;      // the current frame is not drawn
+    int run;            // frames skipped since the last drawn one
+    int32_t lag;        // auto: microseconds behind the 59.73 Hz deadline
+    uint32_t skipped;
+    bool drawn;         // the frame that just completed was drawn
+};
+
+#define FRAME_BUFFER_COUNT  3
+
+/* Triple buffering: with one frame on its way to the display and one
+ * queued, the PPU still has a buffer to draw into, so emulation never waits
+ * for the display and the display never reads a frame being drawn. A queued
+ * frame that is not picked up before the next one finishes is dropped.
+ * Only one thread may call these; the display holds its buffer until it
+ * asks for the next one, so its interrupt does not need to. */
+struct frame_buffers {
+    uint16_t *buffers[FRAME_BUFFER_COUNT];
+    buffer_state_t states[FRAME_BUFFER_COUNT];
+    uint32_t dropped;       // finished frames replaced before they were shown
+    uint32_t duplicated;    // times the display was free with no new frame
+};
+
+#define SCALED_LINES        LCD_WIDTH   // output lines, one per panel column
+#define SCALED_LINE_LENGTH  LCD_HEIGHT  // pixels of an output line
+
+typedef enum {
+    SCALER_OFF,         // 160x144 lines straight into the back buffer
+    SCALER_NEAREST,
+    SCALER_BLEND,       // 2 taps per axis
+} scaler_mode_t;
+
+/* Stretches the PPU output over the whole 176x220 panel. The panel is mounted
+ * rotated, so a 160 pixel GB line becomes a 220 pixel panel column and the
+ * 144 lines are spread over the 176 columns. The PPU draws into line[] and
+ * each output line goes to the back buffer as soon as the source lines it
+ * is made of are drawn, SCALED_LINES lines of SCALED_LINE_LENGTH pixels.
+ * Positions are fixed point in 1/32 pixel with the pixel centres lined up. */
+struct scaler {
+    scaler_mode_t mode;
+    uint8_t srcX[SCALED_LINE_LENGTH];   // left source pixel of each output pixel
+    uint8_t weightX[SCALED_LINE_LENGTH];    // of the right one, 0-32
+    uint8_t srcY[SCALED_LINES];         // upper source line of each output line
+    uint8_t weightY[SCALED_LINES];      // of the lower one, 0-32
+    uint8_t readyY[SCALED_LINES];       // source line after which it can be made
+    uint8_t outFirst[SCREEN_HEIGHT];    // output lines made from each source line
+    uint8_t outLast[SCREEN_HEIGHT];
+    uint8_t next;                       // output line to make next
+    uint16_t line[SCREEN_WIDTH];
+    uint32_t rows[2][SCALED_LINE_LENGTH];   // last two source lines, scaled across
+};
+
+#define LINE_RING_SLOTS     16      // a power of two
+#define LINE_RING_BLOCK     4       // lines worth starting a transfer for
+
+/* Lines on their way to the display when there are no frame buffers: the PPU
+ * pushes each line that changed and the display driver sends them, typically
+ * from its DMA complete interrupt. One producer and one consumer, each only
+ * writes its own index, so no lock is needed. Slots are lineLength pixels
+ * apart, so a run of slots can go out in one transfer. */
+struct line_ring {
+    uint16_t pixels[LINE_RING_SLOTS * SCALED_LINE_LENGTH];
+    uint8_t lineNumbers[LINE_RING_SLOTS];
+    uint16_t lineLength;        // set by load_state_after_booting()
+    uint32_t head;              // lines pushed, written by the producer only
+    uint32_t tail;              // lines sent, written by the consumer only
+    // lines are waiting, start sending if nothing is in flight
+    void (*kick)(struct line_ring *ring);
+    // the ring is full, called until a slot is free; NULL spins
+    void (*wait)(struct line_ring *ring);
 };
 
 struct dma {
@@ -347,6 +533,28 @@ struct dma {
     uint16_t startAddr;
 };
 
+/* The timer, OAM DMA and PPU are only brought up to date when their next
+ * event is due or the CPU touches one of their registers. cycles counts
+ * M-cycles since boot; synced is how far each peripheral has caught up.
+ * lastSync is when cpu_tick last ran, idleLoopPc/idleLoopEnd where and when
+ * the last short backward JR was taken.
+ * haltSkipped and idleSkipped count the cycles HALT and polling loops
+ * jumped over in the current frame and are latched into frameHaltSkipped
+ * and frameIdleSkipped when the frame completes. */
+struct scheduler {
+    uint64_t cycles;
+    uint64_t nextEvent;
+    uint64_t deadline[EVENT_COUNT];
+    uint64_t synced[EVENT_COUNT];
+    uint64_t lastSync;
+    uint64_t idleLoopEnd;
+    uint16_t idleLoopPc;
+    uint32_t haltSkipped;
+    uint32_t frameHaltSkipped;
+    uint32_t idleSkipped;
+    uint32_t frameIdleSkipped;
+};
+
 struct joypad {
     union {
         uint8_t val;
@@ -375,9 +583,24 @@ struct mbc3 {
     bool hasBattery;
 };
 
+struct mbc5 {
+    bool ramEnable;
+    uint16_t romBank : 9;
+    uint8_t ramBank : 4;
+    bool hasBattery;
+};
+
+/* rom0, romx and sram are the bases of the banks currently mapped at
+ * 0000-3fff, 4000-7fff and a000-bfff (sram is NULL while RAM is disabled),
+ * refreshed by the map functions whenever a bank or enable register changes */
 struct mbc {
     struct mbc1 mbc1;
     struct mbc3 mbc3;
+    struct mbc5 mbc5;
+    uint8_t *rom0;
+    uint8_t *romx;              // NULL while romxBank is still streaming in
+    uint8_t *sram;
+    int romxBank;
 };
 
 struct serial {
@@ -389,6 +612,7 @@ struct gb {
     which_buffer_t whichBuffer; 
     uint16_t *frontBufferPtr;
     uint16_t *backBufferPtr;
+    struct line_ring *lineRing;     // stream lines here instead, NULL for frame buffers
     uint8_t vRAM[0x2000];
     uint8_t externalRAM[8 * KiB];
     uint8_t workRAM[0x2000];
@@ -396,66 +620,30 @@ struct gb {
     uint8_t oam[0xa0];
     uint8_t unused[0x60];
     uint8_t highRAM[0x7f];
+    struct tile_cache tileCache;
+#ifdef GBDARM_BG_SURFACE
+    struct bg_surface bgSurface;
+#endif
     gb_mode_t mode;
     struct cpu cpu;
     struct cartridge cart;
     struct interrupt interrupt;
     struct timer timer;
     struct ppu ppu;
+    struct frame_skip frameSkip;
+    struct scaler scaler;
     struct dma dma;
     struct joypad joypad;
     struct mbc mbc;
     struct serial serial;
-    int executedCycle;
-};
-
-const uint16_t palette[4] = {COLOR_WHITE, COLOR_LIGHTGRAY, COLOR_DARKGRAY, COLOR_BLACK};
-
-const int timerClockFrequency[] = {
-    [0] = 1024,
-    [1] = 16,
-    [2] = 64,
-    [3] = 256
-};
-
-const uint8_t instrCycle[256] = {
-//  x0 x1 x2 x3 x4 x5 x6 x7 x8 x9 xA xB xC xD xE xF
-    1, 3, 2, 2, 1, 1, 2, 1, 5, 2, 2, 2, 1, 1, 2, 1, // 0x
-    1, 3, 2, 2, 1, 1, 2, 1, 3, 2, 2, 2, 1, 1, 2, 1, // 1x
-    2, 3, 2, 2, 1, 1, 2, 1, 2, 2, 2, 2, 1, 1, 2, 1, // 2x
-    2, 3, 2, 2, 3, 3, 3, 1, 2, 2, 2, 2, 1, 1, 2, 1, // 3x
-    1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1, // 4x
-    1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1, // 5x
-    1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1, // 6x
-    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 1, // 7x
-    1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1, // 8x
-    1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1, // 9x
-    1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1, // Ax
-    1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1, // Bx
-    2, 3, 3, 4, 3, 4, 2, 4, 2, 4, 3, 0, 3, 6, 2, 4, // Cx
-    2, 3, 3, 4, 3, 4, 2, 4, 2, 4, 3, 1, 3, 6, 2, 4, // Dx
-    3, 3, 2, 0, 0, 4, 2, 4, 4, 1, 4, 0, 0, 0, 2, 4, // Ex
-    3, 3, 2, 1, 0, 4, 2, 4, 4, 2, 4, 1, 0, 0, 2, 4, // Fx
-};
-
-const uint8_t cbInstrCycle[256] = {
-//  x0 x1 x2 x3 x4 x5 x6 x7 x8 x9 xA xB xC xD xE xF
-    2, 2, 2, 2, 2, 2, 4, 2, 2, 2, 2, 2, 2, 2, 4, 2, // 0x 
-    2, 2, 2, 2, 2, 2, 4, 2, 2, 2, 2, 2, 2, 2, 4, 2, // 1x 
-    2, 2, 2, 2, 2, 2, 4, 2, 2, 2, 2, 2, 2, 2, 4, 2, // 2x 
-    2, 2, 2, 2, 2, 2, 4, 2, 2, 2, 2, 2, 2, 2, 4, 2, // 3x 
-    2, 2, 2, 2, 2, 2, 3, 2, 2, 2, 2, 2, 2, 2, 3, 2, // 4x 
-    2, 2, 2, 2, 2, 2, 3, 2, 2, 2, 2, 2, 2, 2, 3, 2, // 5x 
-    2, 2, 2, 2, 2, 2, 3, 2, 2, 2, 2, 2, 2, 2, 3, 2, // 6x 
-    2, 2, 2, 2, 2, 2, 3, 2, 2, 2, 2, 2, 2, 2, 3, 2, // 7x 
-    2, 2, 2, 2, 2, 2, 4, 2, 2, 2, 2, 2, 2, 2, 4, 2, // 8x 
-    2, 2, 2, 2, 2, 2, 4, 2, 2, 2, 2, 2, 2, 2, 4, 2, // 9x 
-    2, 2, 2, 2, 2, 2, 4, 2, 2, 2, 2, 2, 2, 2, 4, 2, // Ax 
-    2, 2, 2, 2, 2, 2, 4, 2, 2, 2, 2, 2, 2, 2, 4, 2, // Bx 
-    2, 2, 2, 2, 2, 2, 4, 2, 2, 2, 2, 2, 2, 2, 4, 2, // Cx 
-    2, 2, 2, 2, 2, 2, 4, 2, 2, 2, 2, 2, 2, 2, 4, 2, // Dx 
-    2, 2, 2, 2, 2, 2, 4, 2, 2, 2, 2, 2, 2, 2, 4, 2, // Ex 
-    2, 2, 2, 2, 2, 2, 4, 2, 2, 2, 2, 2, 2, 2, 4, 2, // Fx 
+    /* direct pointers for every 256-byte page of the address space, NULL
+     * where the access needs bus_read_slow/bus_write_slow */
+    struct page_table {
+        uint8_t *read[256];
+        uint8_t *write[256];
+    } page;
+    struct scheduler sched;
+    uint64_t executedInstructions;
 };
 
 #define INTERRUPT_REQUEST(intr_src)                     \
@@ -464,6 +652,20 @@ const uint8_t cbInstrCycle[256] = {
 #define IS_INTERRUPT_PENDING()                          \
     (gb->interrupt.ie & gb->interrupt.flag & 0x1f)
 
+#define EVENT_NEVER     UINT64_MAX
+#define FRAME_CYCLES    17556       // 154 lines of 456 dots, in M-cycles
+
+#define SCHEDULE_EVENT(event, delay)                            \
+    gb->sched.deadline[event] = gb->sched.cycles + (delay)
+
+// run the peripherals at the end of the current instruction
+#define SCHEDULE_SYNC()                                         \
+    gb->sched.nextEvent = gb->sched.cycles
+
+// the same from inside the interpreter, which counts cycles in a local
+#define CPU_SCHEDULE_SYNC()                                     \
+    gb->sched.nextEvent = cycles
+
 #define GET_MEM_REGION(addr)                    \
     ((IN_RANGE(addr, 0x0000, 0x7fff) << 0)|     \
     (IN_RANGE(addr, 0x8000, 0x9fff) << 1) |     \
@@ -499,14 +701,40 @@ const uint8_t cbInstrCycle[256] = {
     gb->ppu.stat.ppuMode = Mode;   \
     gb->ppu.mode = Mode
 
+/* cartridge declarations */
+void cartridge_load(struct gb *gb, uint8_t *rom);
+void load_state_after_booting(struct gb *gb);
+
 /* MBC declarations */
-uint8_t mbc1_read(struct gb *gb, uint16_t addr);
+void rom_cache_init(struct rom_cache *cache, uint8_t *slots, int slotCount,
+                    bool (*fill)(struct rom_cache *cache, int bank, uint8_t *dst));
+uint8_t *rom_cache_get(struct rom_cache *cache, int bank);
+bool rom_cache_pin(struct rom_cache *cache, int bank);
+uint8_t *mbc_rom_bank(struct gb *gb, int bank);
+uint8_t mbc_read(struct gb *gb, uint16_t addr);
+void mbc_map_banks(struct gb *gb);
 void mbc1_write(struct gb *gb, uint16_t addr, uint8_t val);
+void mbc1_map(struct gb *gb);
+void no_mbc_write(struct gb *gb, uint16_t addr, uint8_t val);
+void mbc3_write(struct gb *gb, uint16_t addr, uint8_t val);
+void mbc3_map(struct gb *gb);
+void mbc5_write(struct gb *gb, uint16_t addr, uint8_t val);
+void mbc5_map(struct gb *gb);
 
 /* bus declarations */
 uint8_t dma_get_data(struct gb *gb, uint16_t addr);
 uint8_t bus_read(struct gb *gb, uint16_t addr);
 void bus_write(struct gb *gb, uint16_t addr, uint8_t val);
+uint8_t bus_read_slow(struct gb *gb, uint16_t addr);
+void bus_write_slow(struct gb *gb, uint16_t addr, uint8_t val);
+void bus_map_pages(struct gb *gb, uint16_t start, uint16_t end, uint8_t *read, uint8_t *write);
+void bus_map_init(struct gb *gb);
+void dma_tick(struct gb *gb);
+
+/* scheduler declarations */
+void sched_init(struct gb *gb);
+int sched_elapsed(struct gb *gb, event_t event);
+void sched_update(struct gb *gb);
 
 /* interrupt declarations */
 uint8_t interrupt_read(struct gb *gb, uint16_t addr);
@@ -518,188 +746,315 @@ bool is_interrupt_pending(struct gb *gb);
 /* timer declarations */
 uint8_t timer_read(struct gb *gb, uint16_t addr);
 void timer_write(struct gb *gb, uint16_t addr, uint8_t val);
+void timer_tick(struct gb *gb);
 
 /* CPU declarations */
+typedef int (*cpu_run_t)(struct gb *gb, int budget);
+
 void cpu_step(struct gb *gb);
+int cpu_run(struct gb *gb, int budget);
+cpu_run_t cpu_run_select(struct gb *gb);
+int gb_run_cycles(struct gb *gb, int budget);
+int gb_run_frame(struct gb *gb);
+bool gb_frame_skip_update(struct gb *gb, int frameUs);
+void gb_draw_next_frame(struct gb *gb);
+uint16_t *frame_buffers_init(struct frame_buffers *fb, uint16_t *buffers[FRAME_BUFFER_COUNT]);
+uint16_t *frame_buffers_done(struct frame_buffers *fb, bool drawn);
+uint16_t *frame_buffers_scanout(struct frame_buffers *fb);
+void cpu_tick(struct gb *gb);
+int cpu_skip_idle_loop(struct gb *gb, uint64_t end, uint16_t pc, uint8_t jrOpcode, int len);
 void cpu_init(struct gb *gb);
 void cpu_cycle(struct gb *gb, int cycles);
 
 /* PPU declarations */
-int cmpfunc(const void *a, const void *b);
 uint8_t ppu_read(struct gb *gb, uint16_t addr);
 void ppu_write(struct gb *gb, uint16_t addr, uint8_t val);
+const uint8_t *ppu_tile_row(struct gb *gb, int tile, int row);
+uint8_t ppu_row_opaque(const uint8_t *row, bool xFlip);
+#ifdef GBDARM_BG_SURFACE
+void ppu_surface_check_tiles(struct gb *gb);
+const uint8_t *ppu_surface_row(struct gb *gb, uint16_t tileMap, uint8_t y, uint8_t x, int n);
+void ppu_surface_copy(struct gb *gb, const uint8_t *ids, uint8_t x, int i, int n, uint32_t *bgOpaque);
+#endif
+void ppu_oam_bin(struct gb *gb, int sprite);
+void ppu_oam_bin_all(struct gb *gb);
+void ppu_oam_scan(struct gb *gb);
+void ppu_palette_update(struct gb *gb, palette_t which);
+void ppu_set_palette_set(struct gb *gb, palette_set_t set);
 void ppu_draw_scanline(struct gb *gb);
+void ppu_line_check_dirty(struct gb *gb);
+int ppu_line_spans(uint32_t *lines, struct line_span *spans, int max);
+int ppu_take_dirty_spans(struct gb *gb, struct line_span *spans, int max);
+void scaler_init(struct gb *gb);
+void scaler_line(struct gb *gb);
+int scaler_map_spans(struct gb *gb, struct line_span *spans, int count);
+uint16_t *line_ring_slot(struct line_ring *ring, uint8_t lineNumber);
+void line_ring_commit(struct line_ring *ring);
+void line_ring_flush(struct line_ring *ring);
+int line_ring_peek(struct line_ring *ring, uint16_t **pixels, uint8_t *first);
+void line_ring_release(struct line_ring *ring, int count);
+void ppu_line_push(struct gb *gb);
+void ppu_check_stat_intr(struct gb *gb);
+int ppu_cycles_to_event(struct gb *gb);
+bool ppu_tick(struct gb *gb);
+
+/* Host builds that only link against libgbdarm define GBDARM_DECLARATIONS_ONLY
+ * to get the types and prototypes above without a second copy of the core. */
+#ifndef GBDARM_DECLARATIONS_ONLY
+
+static uint8_t mbc1BitMask[] = {
+    [2]   = 0b00000001,
+    [4]   = 0b00000011,
+    [8]   = 0b00000111,
+    [16]  = 0b00001111,
+    [32]  = 0b00011111,
+    [64]  = 0b00011111,
+    [128] = 0b00011111,
+};
+
+const uint16_t ili9225Palette[4] = {ILI9225_COLOR_WHITE, ILI9225_COLOR_LIGHTGRAY, ILI9225_COLOR_DARKGRAY, ILI9225_COLOR_BLACK};
+const uint32_t sdl2Palette[4] = {SDL2_COLOR_WHITE, SDL2_COLOR_LGRAY, SDL2_COLOR_DGRAY, SDL2_COLOR_BLACK};
+const uint16_t paletteSets[PALETTE_SET_COUNT][4] = {
+    [PALETTE_SET_ILI9225]   = {ILI9225_COLOR_WHITE, ILI9225_COLOR_LIGHTGRAY, ILI9225_COLOR_DARKGRAY, ILI9225_COLOR_BLACK},
+    [PALETTE_SET_SDL2]      = {RGB565(SDL2_COLOR_WHITE), RGB565(SDL2_COLOR_LGRAY), RGB565(SDL2_COLOR_DGRAY), RGB565(SDL2_COLOR_BLACK)},
+    [PALETTE_SET_GRAYSCALE] = {GRAYSCALE_COLOR_WHITE, GRAYSCALE_COLOR_LIGHTGRAY, GRAYSCALE_COLOR_DARKGRAY, GRAYSCALE_COLOR_BLACK},
+};
+
+const uint16_t palette[4] = {COLOR_WHITE, COLOR_LIGHTGRAY, COLOR_DARKGRAY, COLOR_BLACK};
+
+const int timerClockFrequency[] = {
+    [0] = 1024,
+    [1] = 16,
+    [2] = 64,
+    [3] = 256
+};
+
+const uint8_t instrCycle[256] = {
+//  x0 x1 x2 x3 x4 x5 x6 x7 x8 x9 xA xB xC xD xE xF
+    1, 3, 2, 2, 1, 1, 2, 1, 5, 2, 2, 2, 1, 1, 2, 1, // 0x
+    1, 3, 2, 2, 1, 1, 2, 1, 3, 2, 2, 2, 1, 1, 2, 1, // 1x
+    2, 3, 2, 2, 1, 1, 2, 1, 2, 2, 2, 2, 1, 1, 2, 1, // 2x
+    2, 3, 2, 2, 3, 3, 3, 1, 2, 2, 2, 2, 1, 1, 2, 1, // 3x
+    1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1, // 4x
+    1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1, // 5x
+    1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1, // 6x
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 1, // 7x
+    1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1, // 8x
+    1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1, // 9x
+    1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1, // Ax
+    1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1, // Bx
+    2, 3, 3, 4, 3, 4, 2, 4, 2, 4, 3, 0, 3, 6, 2, 4, // Cx
+    2, 3, 3, 4, 3, 4, 2, 4, 2, 4, 3, 1, 3, 6, 2, 4, // Dx
+    3, 3, 2, 0, 0, 4, 2, 4, 4, 1, 4, 0, 0, 0, 2, 4, // Ex
+    3, 3, 2, 1, 0, 4, 2, 4, 4, 2, 4, 1, 0, 0, 2, 4, // Fx
+};
+
+const uint8_t cbInstrCycle[256] = {
+//  x0 x1 x2 x3 x4 x5 x6 x7 x8 x9 xA xB xC xD xE xF
+    2, 2, 2, 2, 2, 2, 4, 2, 2, 2, 2, 2, 2, 2, 4, 2, // 0x 
+    2, 2, 2, 2, 2, 2, 4, 2, 2, 2, 2, 2, 2, 2, 4, 2, // 1x 
+    2, 2, 2, 2, 2, 2, 4, 2, 2, 2, 2, 2, 2, 2, 4, 2, // 2x 
+    2, 2, 2, 2, 2, 2, 4, 2, 2, 2, 2, 2, 2, 2, 4, 2, // 3x 
+    2, 2, 2, 2, 2, 2, 3, 2, 2, 2, 2, 2, 2, 2, 3, 2, // 4x 
+    2, 2, 2, 2, 2, 2, 3, 2, 2, 2, 2, 2, 2, 2, 3, 2, // 5x 
+    2, 2, 2, 2, 2, 2, 3, 2, 2, 2, 2, 2, 2, 2, 3, 2, // 6x 
+    2, 2, 2, 2, 2, 2, 3, 2, 2, 2, 2, 2, 2, 2, 3, 2, // 7x 
+    2, 2, 2, 2, 2, 2, 4, 2, 2, 2, 2, 2, 2, 2, 4, 2, // 8x 
+    2, 2, 2, 2, 2, 2, 4, 2, 2, 2, 2, 2, 2, 2, 4, 2, // 9x 
+    2, 2, 2, 2, 2, 2, 4, 2, 2, 2, 2, 2, 2, 2, 4, 2, // Ax 
+    2, 2, 2, 2, 2, 2, 4, 2, 2, 2, 2, 2, 2, 2, 4, 2, // Bx 
+    2, 2, 2, 2, 2, 2, 4, 2, 2, 2, 2, 2, 2, 2, 4, 2, // Cx 
+    2, 2, 2, 2, 2, 2, 4, 2, 2, 2, 2, 2, 2, 2, 4, 2, // Dx 
+    2, 2, 2, 2, 2, 2, 4, 2, 2, 2, 2, 2, 2, 2, 4, 2, // Ex 
+    2, 2, 2, 2, 2, 2, 4, 2, 2, 2, 2, 2, 2, 2, 4, 2, // Fx 
+};
 
 /**********************************************************************************************/
 /************************************* CPU related parts **************************************/
 /**********************************************************************************************/
 
+/* The interpreter copies gb->cpu into a local struct cpu for the whole run
+ * and only writes it back around cpu_tick() and on return, so the opcode
+ * macros below work on cpu rather than gb->cpu. */
 #define CPU_FETCH_BYTE()                   \
-    bus_read(gb, gb->cpu.pc++)
+    bus_read(gb, cpu.pc++)
 
 #define CPU_FETCH_WORD(ret)            \
     lsb = CPU_FETCH_BYTE();            \
     msb = CPU_FETCH_BYTE();            \
     ret = TO_U16(lsb, msb)
 
-uint16_t sm83_fetch_word(struct gb *gb)
-{
-    uint8_t lsb = CPU_FETCH_BYTE();
-    uint8_t msb = CPU_FETCH_BYTE();
-
-    return TO_U16(lsb, msb);
-}
-
 #define CPU_PUSH_BYTE(val)             \
-    bus_write(gb, --gb->cpu.sp, val)
+    bus_write(gb, --cpu.sp, val)
 
-void cpu_push_word(struct gb *gb, uint16_t val)
-{
-    CPU_PUSH_BYTE(MSB(val));
-    CPU_PUSH_BYTE(LSB(val));
-}
+#define CPU_PUSH_WORD(val)             \
+    CPU_PUSH_BYTE(MSB(val));           \
+    CPU_PUSH_BYTE(LSB(val))
 
-uint8_t cpu_pop_byte(struct gb *gb)
-{
-    gb->cpu.sp++;
-    return bus_read(gb, gb->cpu.sp - 1);
-}
+#define CPU_POP_WORD(ret)              \
+    lsb = bus_read(gb, cpu.sp++);      \
+    msb = bus_read(gb, cpu.sp++);      \
+    ret = TO_U16(lsb, msb)
 
-uint16_t cpu_pop_word(struct gb *gb)
+/* for interrupt dispatch, which runs outside the interpreter */
+void cpu_push_word(struct gb *gb, uint16_t val)
 {
-    uint8_t lsb = cpu_pop_byte(gb);
-    uint8_t msb = cpu_pop_byte(gb);
-
-    return TO_U16(lsb, msb);
+    bus_write(gb, --gb->cpu.sp, MSB(val));
+    bus_write(gb, --gb->cpu.sp, LSB(val));
 }
 
-#define TOGGLE_ZNH(res, fn, fh)             \
-    gb->cpu.af.flag.z = !(uint8_t)(res);      \
-    gb->cpu.af.flag.n = (bool)(fn);           \
-    gb->cpu.af.flag.h = (bool)(fh)
-
-void toggle_znh(struct gb *gb, uint8_t res, bool n, bool h)
-{
-    gb->cpu.af.flag.z = !res;
-    gb->cpu.af.flag.n = n;
-    gb->cpu.af.flag.h = h;
-}
+/* Flags. The eager build writes them to the af.flag bitfield one at a time.
+ * With GBDARM_LAZY_FLAGS the interpreter keeps, in locals, what each flag is
+ * derived from instead: Z is set while flagZ is zero, H is bit 4 of flagH and
+ * C is bit 8 of flagC. An ALU op then stores its result and a ^ b ^ result as
+ * they are, and F is only put together for PUSH AF and when leaving the
+ * interpreter. The SET_FLAGS arguments take the same form in both builds. */
+#ifdef GBDARM_LAZY_FLAGS
+#define FLAG_Z                  (!flagZ)
+#define FLAG_N                  (flagN)
+#define FLAG_H                  BIT(flagH, 4)
+#define FLAG_C                  BIT(flagC, 8)
+
+#define SET_FLAGS_ZNH(fz, fn, fh)       \
+    flagZ = (fz);                       \
+    flagN = (fn);                       \
+    flagH = (fh)
+
+#define SET_FLAGS(fz, fn, fh, fc)       \
+    SET_FLAGS_ZNH(fz, fn, fh);          \
+    flagC = (fc)
+
+#define LOAD_FLAGS()                    \
+    flagZ = !cpu.af.flag.z;             \
+    flagN = cpu.af.flag.n;              \
+    flagH = cpu.af.flag.h << 4;         \
+    flagC = cpu.af.flag.c << 8
+
+#define STORE_FLAGS()                   \
+    cpu.af.f = (FLAG_Z << 7) | (FLAG_N << 6) | (FLAG_H << 5) | (FLAG_C << 4)
+#else
+#define FLAG_Z                  cpu.af.flag.z
+#define FLAG_N                  cpu.af.flag.n
+#define FLAG_H                  cpu.af.flag.h
+#define FLAG_C                  cpu.af.flag.c
+
+#define SET_FLAGS_ZNH(fz, fn, fh)       \
+    cpu.af.flag.z = !(uint8_t)(fz);     \
+    cpu.af.flag.n = (bool)(fn);         \
+    cpu.af.flag.h = BIT(fh, 4)
+
+#define SET_FLAGS(fz, fn, fh, fc)       \
+    SET_FLAGS_ZNH(fz, fn, fh);          \
+    cpu.af.flag.c = BIT(fc, 8)
+
+#define LOAD_FLAGS()
+#define STORE_FLAGS()
+#endif
 
 /* CPU Instructions */
 
 #define LD_INDIRECT_HL_N(n)     \
-    bus_write(gb, gb->cpu.hl.val, n)
+    bus_write(gb, cpu.hl.val, n)
 
 #define LDH_INDIRECT_C_A()      \
-    bus_write(gb, 0xff00 + gb->cpu.bc.c, gb->cpu.af.a)
+    bus_write(gb, 0xff00 + cpu.bc.c, cpu.af.a)
 
 #define LDH_A_INDIRECT_C()      \
-    gb->cpu.af.a = bus_read(gb, 0xff00 + gb->cpu.bc.c)
+    cpu.af.a = bus_read(gb, 0xff00 + cpu.bc.c)
 
 #define LDH_INDIRECT_N_A(n)     \
-    bus_write(gb, 0xff00 + n, gb->cpu.af.a)
+    bus_write(gb, 0xff00 + n, cpu.af.a)
 
 #define LDH_A_INDIRECT_N(n)     \
-    gb->cpu.af.a = bus_read(gb, 0xff00 + n)
+    cpu.af.a = bus_read(gb, 0xff00 + n)
 
 #define LD_INDIRECT_NN_SP(nn)   \
-    bus_write(gb, nn, LSB(gb->cpu.sp));   \
-    bus_write(gb, nn + 1, MSB(gb->cpu.sp))
+    bus_write(gb, nn, LSB(cpu.sp));       \
+    bus_write(gb, nn + 1, MSB(cpu.sp))
 
 #define PUSH_RR(rr)     \
-    cpu_push_word(gb, rr)
+    CPU_PUSH_WORD(rr)
 
 #define LD_HL_SP_PLUS_I8(i8)                                            \
-    gb->cpu.hl.val = gb->cpu.sp + (int8_t)i8;                           \
-    gb->cpu.af.flag.z = 0;                                              \
-    gb->cpu.af.flag.n = 0;                                              \
-    gb->cpu.af.flag.h = BIT((gb->cpu.sp + i8) ^ gb->cpu.sp ^ i8, 4);    \
-    gb->cpu.af.flag.c = BIT((gb->cpu.sp + i8) ^ gb->cpu.sp ^ i8, 8)
+    carryPerBit = (cpu.sp + i8) ^ cpu.sp ^ i8;                          \
+    cpu.hl.val = cpu.sp + (int8_t)i8;                                   \
+    SET_FLAGS(1, 0, carryPerBit, carryPerBit)
 
 #define ADD(b, d)                                   \
-    res = gb->cpu.af.a + b + d;                     \
-    carryPerBit = res ^ gb->cpu.af.a ^ b;         \
-    gb->cpu.af.a = res;                             \
-    TOGGLE_ZNH(res, 0, BIT(carryPerBit, 4));  \
-    gb->cpu.af.flag.c = BIT(carryPerBit, 8)       
-
-#define SUB(b, d)                                                                                               \
-    res = gb->cpu.af.a + ~b + 1 - d;                \
-    carryPerBit = res ^ gb->cpu.af.a ^ ~b;        \
-    gb->cpu.af.a = res;                             \
-    TOGGLE_ZNH(res, 1, !BIT(carryPerBit, 4)); \
-    gb->cpu.af.flag.c = !BIT(carryPerBit, 8);    
-
-#define CP(b)                                                                                                   \
-    TOGGLE_ZNH(gb->cpu.af.a + ~b + 1, 1, !BIT(gb->cpu.af.a ^ ~b ^ (gb->cpu.af.a + ~b + 1), 4));             \
-    gb->cpu.af.flag.c = !BIT(gb->cpu.af.a ^ ~b ^ (gb->cpu.af.a + ~b + 1), 8)
-
-#define INC_R(r)                                            \
-    TOGGLE_ZNH(r + 1, 0, BIT((r + 1) ^ r ^ 1, 4));      \
+    res = cpu.af.a + b + d;                         \
+    carryPerBit = res ^ cpu.af.a ^ b;               \
+    cpu.af.a = res;                                 \
+    SET_FLAGS(res, 0, carryPerBit, carryPerBit)
+
+#define SUB(b, d)                                   \
+    res = cpu.af.a - b - d;                         \
+    carryPerBit = res ^ cpu.af.a ^ b;               \
+    cpu.af.a = res;                                 \
+    SET_FLAGS(res, 1, carryPerBit, carryPerBit)
+
+#define CP(b)                                       \
+    res = cpu.af.a - b;                             \
+    carryPerBit = res ^ cpu.af.a ^ b;               \
+    SET_FLAGS(res, 1, carryPerBit, carryPerBit)
+
+#define INC_R(r)                                    \
+    SET_FLAGS_ZNH(r + 1, 0, r ^ (r + 1));           \
     r += 1
 
-#define INC_INDIRECT_HL()                                               \
-    operand = bus_read(gb, gb->cpu.hl.val);                             \
-    bus_write(gb, gb->cpu.hl.val, operand + 1);                         \
-    TOGGLE_ZNH(operand + 1, 0, BIT((operand + 1) ^ operand ^ 1U, 4))
+#define INC_INDIRECT_HL()                                       \
+    operand = bus_read(gb, cpu.hl.val);                         \
+    bus_write(gb, cpu.hl.val, operand + 1);                     \
+    SET_FLAGS_ZNH(operand + 1, 0, operand ^ (operand + 1))
 
-#define DEC_R(r)                                               \
-    TOGGLE_ZNH(r - 1, 1, !BIT((r - 1) ^ r ^ 0xff, 4));     \
+#define DEC_R(r)                                    \
+    SET_FLAGS_ZNH(r - 1, 1, r ^ (r - 1));           \
     r--;
 
-#define DEC_INDIRECT_HL()                                               \
-    operand = bus_read(gb, gb->cpu.hl.val);                             \
-    bus_write(gb, gb->cpu.hl.val, operand - 1);                         \
-    TOGGLE_ZNH(operand - 1, 1, !BIT((operand - 1) ^ operand ^ 0xff, 4))
+#define DEC_INDIRECT_HL()                                       \
+    operand = bus_read(gb, cpu.hl.val);                         \
+    bus_write(gb, cpu.hl.val, operand - 1);                     \
+    SET_FLAGS_ZNH(operand - 1, 1, operand ^ (operand - 1))
 
 #define AND(b)                          \
-    gb->cpu.af.a &= b;                  \
-    TOGGLE_ZNH(gb->cpu.af.a, 0, 1); \
-    gb->cpu.af.flag.c = 0
-
-#define OR(b)                              \
-    gb->cpu.af.a |= b;                     \
-    TOGGLE_ZNH(gb->cpu.af.a, 0, 0);    \
-    gb->cpu.af.flag.c = 0 
-
-#define XOR(b)                             \
-    gb->cpu.af.a ^= b;                     \
-    TOGGLE_ZNH(gb->cpu.af.a, 0, 0);    \
-    gb->cpu.af.flag.c = 0 
-
-#define CCF()                               \
-    gb->cpu.af.flag.n = 0;                  \
-    gb->cpu.af.flag.h = 0;                  \
-    gb->cpu.af.flag.c = !gb->cpu.af.flag.c
-
-#define SCF()               \
-    gb->cpu.af.flag.n = 0;  \
-    gb->cpu.af.flag.h = 0;  \
-    gb->cpu.af.flag.c = 1
+    cpu.af.a &= b;                      \
+    SET_FLAGS(cpu.af.a, 0, 0x10, 0)
+
+#define OR(b)                           \
+    cpu.af.a |= b;                      \
+    SET_FLAGS(cpu.af.a, 0, 0, 0)
+
+#define XOR(b)                          \
+    cpu.af.a ^= b;                      \
+    SET_FLAGS(cpu.af.a, 0, 0, 0)
+
+#define CCF()                                       \
+    SET_FLAGS(!FLAG_Z, 0, 0, !FLAG_C << 8)
+
+#define SCF()                                       \
+    SET_FLAGS(!FLAG_Z, 0, 0, 0x100)
 
 #define DAA()                                                   \
-    a = gb->cpu.af.a;                                           \
-    if (!gb->cpu.af.flag.n) {                                   \
-        if (gb->cpu.af.flag.h || (gb->cpu.af.a & 0x0f) > 0x09)  \
+    a = cpu.af.a;                                               \
+    operand = FLAG_C << 8;                                      \
+    if (!FLAG_N) {                                              \
+        if (FLAG_H || (cpu.af.a & 0x0f) > 0x09)                 \
             a += 0x06;                                          \
-        if (gb->cpu.af.flag.c || gb->cpu.af.a > 0x99) {         \
+        if (FLAG_C || cpu.af.a > 0x99) {                        \
             a += 0x60;                                          \
-            gb->cpu.af.flag.c = 1;                              \
+            operand = 0x100;                                    \
         }                                                       \
     } else {                                                    \
-        if (gb->cpu.af.flag.h)                                  \
+        if (FLAG_H)                                             \
             a -= 0x06;                                          \
-        if (gb->cpu.af.flag.c)                                  \
+        if (FLAG_C)                                             \
             a -= 0x60;                                          \
     }                                                           \
-    gb->cpu.af.flag.z = !a;                                     \
-    gb->cpu.af.flag.h = 0;                                      \
-    gb->cpu.af.a = a;                                           \
+    SET_FLAGS(a, FLAG_N, 0, operand);                           \
+    cpu.af.a = a;                                               \
 
-#define CPL()                       \
-    gb->cpu.af.a = ~gb->cpu.af.a;   \
-    gb->cpu.af.flag.n = 1;          \
-    gb->cpu.af.flag.h = 1
+#define CPL()                                       \
+    cpu.af.a = ~cpu.af.a;                           \
+    SET_FLAGS(!FLAG_Z, 1, 0x10, FLAG_C << 8)
 
 #define INC_RR(rr)              \
     rr++
@@ -707,927 +1062,1090 @@ void toggle_znh(struct gb *gb, uint8_t res, bool n, bool h)
 #define DEC_RR(rr)              \
     rr--
 
+/* H and C come from bits 12 and 16 here */
 #define ADD_HL_RR(rr)                                                           \
-    gb->cpu.af.flag.n = 0;                                                      \
-    gb->cpu.af.flag.h = BIT((gb->cpu.hl.val + rr) ^ gb->cpu.hl.val ^ rr, 12);   \
-    gb->cpu.af.flag.c = BIT((gb->cpu.hl.val + rr) ^ gb->cpu.hl.val ^ rr, 16);   \
-    gb->cpu.hl.val = gb->cpu.hl.val + rr                                    
-
+    SET_FLAGS(!FLAG_Z, 0, ((cpu.hl.val + rr) ^ cpu.hl.val ^ rr) >> 8,           \
+              ((cpu.hl.val + rr) ^ cpu.hl.val ^ rr) >> 8);                      \
+    cpu.hl.val = cpu.hl.val + rr
 
 #define ADD_SP_I8(i8)                                                   \
-    gb->cpu.af.flag.z = gb->cpu.af.flag.n = 0;                          \
-    gb->cpu.af.flag.h = BIT((gb->cpu.sp + i8) ^ gb->cpu.sp ^ i8, 4);    \
-    gb->cpu.af.flag.c = BIT((gb->cpu.sp + i8) ^ gb->cpu.sp ^ i8, 8);    \
-    gb->cpu.sp = gb->cpu.sp + (int8_t)i8
-
-#define RLCA()      \
-    gb->cpu.af.flag.c = BIT(gb->cpu.af.a, 7);   \
-    gb->cpu.af.a = (gb->cpu.af.a << 1) | gb->cpu.af.flag.c; \
-    gb->cpu.af.flag.z = gb->cpu.af.flag.n = gb->cpu.af.flag.h = 0
-
-#define RRCA()          \
-    gb->cpu.af.flag.c = BIT(gb->cpu.af.a, 0);   \
-    gb->cpu.af.a = (gb->cpu.af.a >> 1) | (gb->cpu.af.flag.c << 7);  \
-    gb->cpu.af.flag.z = gb->cpu.af.flag.n = gb->cpu.af.flag.h = 0 
-
-#define RLA()           \
-    operand = BIT(gb->cpu.af.a, 7); \
-    gb->cpu.af.a = (gb->cpu.af.a << 1) | gb->cpu.af.flag.c; \
-    gb->cpu.af.flag.c = operand;    \
-    gb->cpu.af.flag.z = gb->cpu.af.flag.n = gb->cpu.af.flag.h = 0
-
-#define RRA()               \
-    operand = BIT(gb->cpu.af.a, 0);                                 \
-    gb->cpu.af.a = (gb->cpu.af.a >> 1) | (gb->cpu.af.flag.c << 7);  \
-    gb->cpu.af.flag.c = operand;           \
-    gb->cpu.af.flag.z = gb->cpu.af.flag.n = gb->cpu.af.flag.h = 0 
-
-#define RLC_R(r)                        \
-    gb->cpu.af.flag.c = BIT(r, 7);      \
-    r = (r << 1) | gb->cpu.af.flag.c;   \
-    gb->cpu.af.flag.z = !(r);           \
-    gb->cpu.af.flag.n = gb->cpu.af.flag.h = 0
-
-#define RLC_INDIRECT_HL()                           \
-    operand = bus_read(gb, gb->cpu.hl.val);         \
-    gb->cpu.af.flag.c = BIT(operand, 7);            \
-    operand = (operand << 1) | gb->cpu.af.flag.c;   \
-    bus_write(gb, gb->cpu.hl.val, operand);         \
-    gb->cpu.af.flag.z = !operand;                   \
-    gb->cpu.af.flag.n = gb->cpu.af.flag.h = 0
-
-#define RRC_R(r)                                \
-    gb->cpu.af.flag.c = BIT(r, 0);              \
-    r = (r >> 1) | (gb->cpu.af.flag.c << 7);    \
-    gb->cpu.af.flag.z = !(r);                   \
-    gb->cpu.af.flag.n = gb->cpu.af.flag.h = 0
-
-#define RRC_INDIRECT_HL()                       \
-    operand = bus_read(gb, gb->cpu.hl.val);     \
-    gb->cpu.af.flag.c = BIT(operand, 0);        \
-    operand = (operand >> 1) | (gb->cpu.af.flag.c << 7);    \
-    bus_write(gb, gb->cpu.hl.val, operand);     \
-    gb->cpu.af.flag.z = !operand;               \
-    gb->cpu.af.flag.n = gb->cpu.af.flag.h = 0  
+    carryPerBit = (cpu.sp + i8) ^ cpu.sp ^ i8;                          \
+    SET_FLAGS(1, 0, carryPerBit, carryPerBit);                          \
+    cpu.sp = cpu.sp + (int8_t)i8
+
+#define RLCA()                                                  \
+    res = (cpu.af.a << 1) | BIT(cpu.af.a, 7);                   \
+    cpu.af.a = res;                                             \
+    SET_FLAGS(1, 0, 0, res)
+
+#define RRCA()                                                  \
+    SET_FLAGS(1, 0, 0, BIT(cpu.af.a, 0) << 8);                  \
+    cpu.af.a = (cpu.af.a >> 1) | (cpu.af.a << 7)
+
+#define RLA()                                                   \
+    res = (cpu.af.a << 1) | FLAG_C;                             \
+    cpu.af.a = res;                                             \
+    SET_FLAGS(1, 0, 0, res)
+
+#define RRA()                                                   \
+    operand = BIT(cpu.af.a, 0) << 8;                            \
+    cpu.af.a = (cpu.af.a >> 1) | (FLAG_C << 7);                 \
+    SET_FLAGS(1, 0, 0, operand)
+
+#define RLC_R(r)                            \
+    res = (r << 1) | BIT(r, 7);             \
+    r = res;                                \
+    SET_FLAGS(res, 0, 0, res)
+
+#define RLC_INDIRECT_HL()                               \
+    operand = bus_read(gb, cpu.hl.val);                 \
+    operand = (operand << 1) | BIT(operand, 7);         \
+    bus_write(gb, cpu.hl.val, operand);                 \
+    SET_FLAGS(operand, 0, 0, operand)
+
+#define RRC_R(r)                            \
+    operand = BIT(r, 0) << 8;               \
+    r = (r >> 1) | (r << 7);                \
+    SET_FLAGS(r, 0, 0, operand)
+
+#define RRC_INDIRECT_HL()                               \
+    val = bus_read(gb, cpu.hl.val);                     \
+    operand = BIT(val, 0) << 8;                         \
+    val = (val >> 1) | (val << 7);                      \
+    bus_write(gb, cpu.hl.val, val);                     \
+    SET_FLAGS(val, 0, 0, operand)
 
 #define RL_R(r)                             \
-    operand = BIT(r, 7);                    \
-    r = (r << 1) | gb->cpu.af.flag.c;       \
-    gb->cpu.af.flag.z = !(r);               \
-    gb->cpu.af.flag.n = gb->cpu.af.flag.h = 0;  \
-    gb->cpu.af.flag.c = operand
-
-#define RL_INDIRECT_HL()                        \
-    val = bus_read(gb, gb->cpu.hl.val);         \
-    operand = BIT(val, 7);                      \
-    val = (val << 1) | gb->cpu.af.flag.c;       \
-    bus_write(gb, gb->cpu.hl.val, val);         \
-    gb->cpu.af.flag.z = !val;                   \
-    gb->cpu.af.flag.n = gb->cpu.af.flag.h = 0;  \
-    gb->cpu.af.flag.c = operand
-
-#define RR_R(r)                                 \
-    operand = BIT(r, 0);                        \
-    r = (r >> 1) | (gb->cpu.af.flag.c << 7);    \
-    gb->cpu.af.flag.z = !r;                     \
-    gb->cpu.af.flag.n = gb->cpu.af.flag.h = 0;  \
-    gb->cpu.af.flag.c = operand
-
-#define RR_INDIRECT_HL()                    \
-    val = bus_read(gb, gb->cpu.hl.val);     \
-    operand = BIT(val, 0);                  \
-    val = (val >> 1) | (gb->cpu.af.flag.c << 7);    \
-    bus_write(gb, gb->cpu.hl.val, val);     \
-    gb->cpu.af.flag.z = !val;               \
-    gb->cpu.af.flag.n = gb->cpu.af.flag.h = 0;      \
-    gb->cpu.af.flag.c = operand
-
-#define SLA_R(r)                                \
-    gb->cpu.af.flag.c = BIT(r, 7);              \
-    r <<= 1;                                    \
-    gb->cpu.af.flag.z = !r;                     \
-    gb->cpu.af.flag.n = gb->cpu.af.flag.h = 0
-
-#define SLA_INDIRECT_HL()                       \
-    val = bus_read(gb, gb->cpu.hl.val);         \
-    gb->cpu.af.flag.c = BIT(val, 7);            \
-    val <<= 1;                                  \
-    bus_write(gb, gb->cpu.hl.val, val);         \
-    gb->cpu.af.flag.z = !val;                   \
-    gb->cpu.af.flag.n = gb->cpu.af.flag.h = 0
-
-#define SRA_R(r)                                \
-    gb->cpu.af.flag.c = BIT(r, 0);              \
-    r = (r & 0x80) | (r >> 1);                  \
-    gb->cpu.af.flag.z = !r;                     \
-    gb->cpu.af.flag.n = gb->cpu.af.flag.h = 0
-
-#define SRA_INDIRECT_HL()                       \
-    val = bus_read(gb, gb->cpu.hl.val);         \
-    gb->cpu.af.flag.c = BIT(val, 0);            \
-    val = (val & 0x80) | (val >> 1);            \
-    bus_write(gb, gb->cpu.hl.val, val);         \
-    gb->cpu.af.flag.z = !val;                   \
-    gb->cpu.af.flag.n = gb->cpu.af.flag.h = 0
-
-#define SWAP_R(r)                               \
-    r = (r >> 4) | (r << 4);                    \
-    TOGGLE_ZNH(r, 0, 0);                    \
-    gb->cpu.af.flag.c = 0
-
-#define SWAP_INDIRECT_HL()                      \
-    val = bus_read(gb, gb->cpu.hl.val);         \
-    val = (val >> 4) | (val << 4);              \
-    bus_write(gb, gb->cpu.hl.val, val);         \
-    TOGGLE_ZNH(val, 0, 0);                  \
-    gb->cpu.af.flag.c = 0
-
-#define SRL_R(r)                    \
-    gb->cpu.af.flag.c = BIT(r, 0);  \
-    r >>= 1;                        \
-    gb->cpu.af.flag.z = !r;         \
-    gb->cpu.af.flag.n = gb->cpu.af.flag.h = 0
-
-#define SRL_INDIRECT_HL()                       \
-    val = bus_read(gb, gb->cpu.hl.val);         \
-    gb->cpu.af.flag.c = BIT(val, 0);            \
-    val >>= 1;                                  \
-    bus_write(gb, gb->cpu.hl.val, val);         \
-    gb->cpu.af.flag.z = !val;                   \
-    gb->cpu.af.flag.n = gb->cpu.af.flag.h = 0
+    res = (r << 1) | FLAG_C;                \
+    r = res;                                \
+    SET_FLAGS(res, 0, 0, res)
+
+#define RL_INDIRECT_HL()                                \
+    res = (bus_read(gb, cpu.hl.val) << 1) | FLAG_C;     \
+    bus_write(gb, cpu.hl.val, res);                     \
+    SET_FLAGS(res, 0, 0, res)
+
+#define RR_R(r)                             \
+    operand = BIT(r, 0) << 8;               \
+    r = (r >> 1) | (FLAG_C << 7);           \
+    SET_FLAGS(r, 0, 0, operand)
+
+#define RR_INDIRECT_HL()                                \
+    val = bus_read(gb, cpu.hl.val);                     \
+    operand = BIT(val, 0) << 8;                         \
+    val = (val >> 1) | (FLAG_C << 7);                   \
+    bus_write(gb, cpu.hl.val, val);                     \
+    SET_FLAGS(val, 0, 0, operand)
+
+#define SLA_R(r)                            \
+    res = r << 1;                           \
+    r = res;                                \
+    SET_FLAGS(res, 0, 0, res)
+
+#define SLA_INDIRECT_HL()                               \
+    res = bus_read(gb, cpu.hl.val) << 1;                \
+    bus_write(gb, cpu.hl.val, res);                     \
+    SET_FLAGS(res, 0, 0, res)
+
+#define SRA_R(r)                            \
+    operand = BIT(r, 0) << 8;               \
+    r = (r & 0x80) | (r >> 1);              \
+    SET_FLAGS(r, 0, 0, operand)
+
+#define SRA_INDIRECT_HL()                               \
+    val = bus_read(gb, cpu.hl.val);                     \
+    operand = BIT(val, 0) << 8;                         \
+    val = (val & 0x80) | (val >> 1);                    \
+    bus_write(gb, cpu.hl.val, val);                     \
+    SET_FLAGS(val, 0, 0, operand)
+
+#define SWAP_R(r)                           \
+    r = (r >> 4) | (r << 4);                \
+    SET_FLAGS(r, 0, 0, 0)
+
+#define SWAP_INDIRECT_HL()                              \
+    val = bus_read(gb, cpu.hl.val);                     \
+    val = (val >> 4) | (val << 4);                      \
+    bus_write(gb, cpu.hl.val, val);                     \
+    SET_FLAGS(val, 0, 0, 0)
+
+#define SRL_R(r)                            \
+    operand = BIT(r, 0) << 8;               \
+    r >>= 1;                                \
+    SET_FLAGS(r, 0, 0, operand)
+
+#define SRL_INDIRECT_HL()                               \
+    val = bus_read(gb, cpu.hl.val);                     \
+    operand = BIT(val, 0) << 8;                         \
+    val >>= 1;                                          \
+    bus_write(gb, cpu.hl.val, val);                     \
+    SET_FLAGS(val, 0, 0, operand)
 
 #define BIT_N_R(n, r)                   \
-    TOGGLE_ZNH(BIT(r, n), 0, 1)
+    SET_FLAGS_ZNH(BIT(r, n), 0, 0x10)
 
 #define BIT_N_INDIRECT_HL(n)                    \
-    val = bus_read(gb, gb->cpu.hl.val);         \
-    TOGGLE_ZNH(BIT(val, n), 0, 1)
+    val = bus_read(gb, cpu.hl.val);             \
+    SET_FLAGS_ZNH(BIT(val, n), 0, 0x10)
 
 #define RES_N_R(n, r)                           \
     RES(r, n)
 
 #define RES_N_INDIRECT_HL(n)                    \
-    val = bus_read(gb, gb->cpu.hl.val);         \
+    val = bus_read(gb, cpu.hl.val);             \
     RES(val, n);                                \
-    bus_write(gb, gb->cpu.hl.val, val)
+    bus_write(gb, cpu.hl.val, val)
 
 #define SET_N_R(n, r)                           \
     SET(r, n)
 
 #define SET_N_INDIRECT_HL(n)                    \
-    val = bus_read(gb, gb->cpu.hl.val);         \
+    val = bus_read(gb, cpu.hl.val);             \
     SET(val, n);                                \
-    bus_write(gb, gb->cpu.hl.val, val)
+    bus_write(gb, cpu.hl.val, val)
 
 #define JP(nn, offset, cond)                    \
     if (cond) {                                 \
-        gb->executedCycle += 1;                \
-        gb->cpu.pc = nn + (int8_t)offset;       \
+        executedCycle += 1;                     \
+        cpu.pc = nn + (int8_t)offset;           \
     }                                           
 
+/* conditional JR; a taken short jump back may close a polling loop */
+#define JR_CC(cond)                                                     \
+    operand = CPU_FETCH_BYTE();                                         \
+    if (cond) {                                                         \
+        JP(cpu.pc, operand, 1);                                         \
+        if (IN_RANGE((int8_t)operand, -6, -5) && gb->cart.idleLoopSkip) \
+            executedCycle += cpu_skip_idle_loop(gb, cycles + executedCycle, \
+                cpu.pc, opcode, -(int8_t)operand);                      \
+    }
+
 #define CALL(nn, cond)                          \
     if (cond) {                                 \
-        cpu_push_word(gb, gb->cpu.pc);         \
-        gb->cpu.pc = nn;                        \
-        gb->executedCycle += 3;                \
+        CPU_PUSH_WORD(cpu.pc);                  \
+        cpu.pc = nn;                            \
+        executedCycle += 3;                     \
     }
 
 #define RET(opcode, cond)                       \
     if (cond) {                                 \
-        uint16_t pc = cpu_pop_word(gb);        \
-        gb->cpu.pc = pc;                        \
-        gb->executedCycle += 3;                \
+        CPU_POP_WORD(cpu.pc);                   \
+        executedCycle += 3;                     \
     }
 
 #define RETI()                      \
     RET(0xc9, 1);                   \
-    gb->cpu.ime = true
+    cpu.ime = true;                 \
+    CPU_SCHEDULE_SYNC()
 
 #define RST_N(n)                    \
-    cpu_push_word(gb, gb->cpu.pc); \
-    gb->cpu.pc = n
+    CPU_PUSH_WORD(cpu.pc);         \
+    cpu.pc = n
 
+/* Nothing but a scheduled event can end HALT, so once halted jump straight
+ * to the next one instead of spinning one M-cycle at a time. */
 #define HALT()                                                          \
+    if (gb->mode != HALT) {                                             \
+        CPU_SCHEDULE_SYNC();                                            \
+    } else if (gb->sched.nextEvent != EVENT_NEVER &&                    \
+        gb->sched.nextEvent > cycles + executedCycle) {                 \
+        int skip = gb->sched.nextEvent - cycles - executedCycle;        \
+        executedCycle += skip;                                          \
+        gb->sched.haltSkipped += skip;                                  \
+    }                                                                   \
     gb->mode = HALT
 
 #define DI()                    \
-    gb->cpu.ime = false
+    cpu.ime = false;            \
+    CPU_SCHEDULE_SYNC()
 
 #define EI()                    \
-    gb->cpu.ime = true
-
-int execute_cb_instructions(struct gb *gb, uint8_t opcode)
-{
-    uint8_t operand, val;
-
-    switch (opcode) {
-    case 0x00: RLC_R(gb->cpu.bc.b);                              break;
-    case 0x01: RLC_R(gb->cpu.bc.c);                              break;
-    case 0x02: RLC_R(gb->cpu.de.d);                              break;
-    case 0x03: RLC_R(gb->cpu.de.e);                              break;
-    case 0x04: RLC_R(gb->cpu.hl.h);                              break;
-    case 0x05: RLC_R(gb->cpu.hl.l);                              break;
-    case 0x06: RLC_INDIRECT_HL();                                break;
-    case 0x07: RLC_R(gb->cpu.af.a);                              break;
-    case 0x08: RRC_R(gb->cpu.bc.b);                              break;
-    case 0x09: RRC_R(gb->cpu.bc.c);                              break;
-    case 0x0a: RRC_R(gb->cpu.de.d);                              break;
-    case 0x0b: RRC_R(gb->cpu.de.e);                              break;
-    case 0x0c: RRC_R(gb->cpu.hl.h);                              break;
-    case 0x0d: RRC_R(gb->cpu.hl.l);                              break;
-    case 0x0e: RRC_INDIRECT_HL();                                break;
-    case 0x0f: RRC_R(gb->cpu.af.a);                              break;
-    case 0x10: RL_R(gb->cpu.bc.b);                               break;
-    case 0x11: RL_R(gb->cpu.bc.c);                               break;
-    case 0x12: RL_R(gb->cpu.de.d);                               break;
-    case 0x13: RL_R(gb->cpu.de.e);                               break;
-    case 0x14: RL_R(gb->cpu.hl.h);                               break;
-    case 0x15: RL_R(gb->cpu.hl.l);                               break;
-    case 0x16: RL_INDIRECT_HL();                                 break;
-    case 0x17: RL_R(gb->cpu.af.a);                               break;
-    case 0x18: RR_R(gb->cpu.bc.b);                               break;
-    case 0x19: RR_R(gb->cpu.bc.c);                               break;
-    case 0x1a: RR_R(gb->cpu.de.d);                               break;
-    case 0x1b: RR_R(gb->cpu.de.e);                               break;
-    case 0x1c: RR_R(gb->cpu.hl.h);                               break;
-    case 0x1d: RR_R(gb->cpu.hl.l);                               break;
-    case 0x1e: RR_INDIRECT_HL();                                 break;
-    case 0x1f: RR_R(gb->cpu.af.a);                               break;
-    case 0x20: SLA_R(gb->cpu.bc.b);                              break;
-    case 0x21: SLA_R(gb->cpu.bc.c);                              break;
-    case 0x22: SLA_R(gb->cpu.de.d);                              break;
-    case 0x23: SLA_R(gb->cpu.de.e);                              break;
-    case 0x24: SLA_R(gb->cpu.hl.h);                              break;
-    case 0x25: SLA_R(gb->cpu.hl.l);                              break;
-    case 0x26: SLA_INDIRECT_HL();                                break;
-    case 0x27: SLA_R(gb->cpu.af.a);                              break;
-    case 0x28: SRA_R(gb->cpu.bc.b);                              break;
-    case 0x29: SRA_R(gb->cpu.bc.c);                              break;
-    case 0x2a: SRA_R(gb->cpu.de.d);                              break;
-    case 0x2b: SRA_R(gb->cpu.de.e);                              break;
-    case 0x2c: SRA_R(gb->cpu.hl.h);                              break;
-    case 0x2d: SRA_R(gb->cpu.hl.l);                              break;
-    case 0x2e: SRA_INDIRECT_HL();                                break;
-    case 0x2f: SRA_R(gb->cpu.af.a);                              break;
-    case 0x30: SWAP_R(gb->cpu.bc.b);                             break;
-    case 0x31: SWAP_R(gb->cpu.bc.c);                             break;
-    case 0x32: SWAP_R(gb->cpu.de.d);                             break;
-    case 0x33: SWAP_R(gb->cpu.de.e);                             break;
-    case 0x34: SWAP_R(gb->cpu.hl.h);                             break;
-    case 0x35: SWAP_R(gb->cpu.hl.l);                             break;
-    case 0x36: SWAP_INDIRECT_HL();                               break;
-    case 0x37: SWAP_R(gb->cpu.af.a);                             break;
-    case 0x38: SRL_R(gb->cpu.bc.b);                              break;
-    case 0x39: SRL_R(gb->cpu.bc.c);                              break;
-    case 0x3a: SRL_R(gb->cpu.de.d);                              break;
-    case 0x3b: SRL_R(gb->cpu.de.e);                              break;
-    case 0x3c: SRL_R(gb->cpu.hl.h);                              break;
-    case 0x3d: SRL_R(gb->cpu.hl.l);                              break;
-    case 0x3e: SRL_INDIRECT_HL();                                break;
-    case 0x3f: SRL_R(gb->cpu.af.a);                              break;
-    case 0x40: BIT_N_R(0, gb->cpu.bc.b);                         break;
-    case 0x41: BIT_N_R(0, gb->cpu.bc.c);                         break;
-    case 0x42: BIT_N_R(0, gb->cpu.de.d);                         break;
-    case 0x43: BIT_N_R(0, gb->cpu.de.e);                         break;
-    case 0x44: BIT_N_R(0, gb->cpu.hl.h);                         break;
-    case 0x45: BIT_N_R(0, gb->cpu.hl.l);                         break;
-    case 0x46: BIT_N_INDIRECT_HL(0);                             break;
-    case 0x47: BIT_N_R(0, gb->cpu.af.a);                         break;
-    case 0x48: BIT_N_R(1, gb->cpu.bc.b);                         break;
-    case 0x49: BIT_N_R(1, gb->cpu.bc.c);                         break;
-    case 0x4a: BIT_N_R(1, gb->cpu.de.d);                         break;
-    case 0x4b: BIT_N_R(1, gb->cpu.de.e);                         break;
-    case 0x4c: BIT_N_R(1, gb->cpu.hl.h);                         break;
-    case 0x4d: BIT_N_R(1, gb->cpu.hl.l);                         break;
-    case 0x4e: BIT_N_INDIRECT_HL(1);                             break;
-    case 0x4f: BIT_N_R(1, gb->cpu.af.a);                         break;
-    case 0x50: BIT_N_R(2, gb->cpu.bc.b);                         break;
-    case 0x51: BIT_N_R(2, gb->cpu.bc.c);                         break;
-    case 0x52: BIT_N_R(2, gb->cpu.de.d);                         break;
-    case 0x53: BIT_N_R(2, gb->cpu.de.e);                         break;
-    case 0x54: BIT_N_R(2, gb->cpu.hl.h);                         break;
-    case 0x55: BIT_N_R(2, gb->cpu.hl.l);                         break;
-    case 0x56: BIT_N_INDIRECT_HL(2);                             break;
-    case 0x57: BIT_N_R(2, gb->cpu.af.a);                         break;
-    case 0x58: BIT_N_R(3, gb->cpu.bc.b);                         break;
-    case 0x59: BIT_N_R(3, gb->cpu.bc.c);                         break;
-    case 0x5a: BIT_N_R(3, gb->cpu.de.d);                         break;
-    case 0x5b: BIT_N_R(3, gb->cpu.de.e);                         break;
-    case 0x5c: BIT_N_R(3, gb->cpu.hl.h);                         break;
-    case 0x5d: BIT_N_R(3, gb->cpu.hl.l);                         break;
-    case 0x5e: BIT_N_INDIRECT_HL(3);                             break;
-    case 0x5f: BIT_N_R(3, gb->cpu.af.a);                         break;
-    case 0x60: BIT_N_R(4, gb->cpu.bc.b);                         break;
-    case 0x61: BIT_N_R(4, gb->cpu.bc.c);                         break;
-    case 0x62: BIT_N_R(4, gb->cpu.de.d);                         break;
-    case 0x63: BIT_N_R(4, gb->cpu.de.e);                         break;
-    case 0x64: BIT_N_R(4, gb->cpu.hl.h);                         break;
-    case 0x65: BIT_N_R(4, gb->cpu.hl.l);                         break;
-    case 0x66: BIT_N_INDIRECT_HL(4);                             break;
-    case 0x67: BIT_N_R(4, gb->cpu.af.a);                         break;
-    case 0x68: BIT_N_R(5, gb->cpu.bc.b);                         break;
-    case 0x69: BIT_N_R(5, gb->cpu.bc.c);                         break;
-    case 0x6a: BIT_N_R(5, gb->cpu.de.d);                         break;
-    case 0x6b: BIT_N_R(5, gb->cpu.de.e);                         break;
-    case 0x6c: BIT_N_R(5, gb->cpu.hl.h);                         break;
-    case 0x6d: BIT_N_R(5, gb->cpu.hl.l);                         break;
-    case 0x6e: BIT_N_INDIRECT_HL(5);                             break;
-    case 0x6f: BIT_N_R(5, gb->cpu.af.a);                         break;
-    case 0x70: BIT_N_R(6, gb->cpu.bc.b);                         break;
-    case 0x71: BIT_N_R(6, gb->cpu.bc.c);                         break;
-    case 0x72: BIT_N_R(6, gb->cpu.de.d);                         break;
-    case 0x73: BIT_N_R(6, gb->cpu.de.e);                         break;
-    case 0x74: BIT_N_R(6, gb->cpu.hl.h);                         break;
-    case 0x75: BIT_N_R(6, gb->cpu.hl.l);                         break;
-    case 0x76: BIT_N_INDIRECT_HL(6);                             break;
-    case 0x77: BIT_N_R(6, gb->cpu.af.a);                         break;
-    case 0x78: BIT_N_R(7, gb->cpu.bc.b);                         break;
-    case 0x79: BIT_N_R(7, gb->cpu.bc.c);                         break;
-    case 0x7a: BIT_N_R(7, gb->cpu.de.d);                         break;
-    case 0x7b: BIT_N_R(7, gb->cpu.de.e);                         break;
-    case 0x7c: BIT_N_R(7, gb->cpu.hl.h);                         break;
-    case 0x7d: BIT_N_R(7, gb->cpu.hl.l);                         break;
-    case 0x7e: BIT_N_INDIRECT_HL(7);                             break;
-    case 0x7f: BIT_N_R(7, gb->cpu.af.a);                         break;
-    case 0x80: RES_N_R(0, gb->cpu.bc.b);                         break;
-    case 0x81: RES_N_R(0, gb->cpu.bc.c);                         break;
-    case 0x82: RES_N_R(0, gb->cpu.de.d);                         break;
-    case 0x83: RES_N_R(0, gb->cpu.de.e);                         break;
-    case 0x84: RES_N_R(0, gb->cpu.hl.h);                         break;
-    case 0x85: RES_N_R(0, gb->cpu.hl.l);                         break;
-    case 0x86: RES_N_INDIRECT_HL(0);                             break;
-    case 0x87: RES_N_R(0, gb->cpu.af.a);                         break;
-    case 0x88: RES_N_R(1, gb->cpu.bc.b);                         break;
-    case 0x89: RES_N_R(1, gb->cpu.bc.c);                         break;
-    case 0x8a: RES_N_R(1, gb->cpu.de.d);                         break;
-    case 0x8b: RES_N_R(1, gb->cpu.de.e);                         break;
-    case 0x8c: RES_N_R(1, gb->cpu.hl.h);                         break;
-    case 0x8d: RES_N_R(1, gb->cpu.hl.l);                         break;
-    case 0x8e: RES_N_INDIRECT_HL(1);                             break;
-    case 0x8f: RES_N_R(1, gb->cpu.af.a);                         break;
-    case 0x90: RES_N_R(2, gb->cpu.bc.b);                         break;
-    case 0x91: RES_N_R(2, gb->cpu.bc.c);                         break;
-    case 0x92: RES_N_R(2, gb->cpu.de.d);                         break;
-    case 0x93: RES_N_R(2, gb->cpu.de.e);                         break;
-    case 0x94: RES_N_R(2, gb->cpu.hl.h);                         break;
-    case 0x95: RES_N_R(2, gb->cpu.hl.l);                         break;
-    case 0x96: RES_N_INDIRECT_HL(2);                             break;
-    case 0x97: RES_N_R(2, gb->cpu.af.a);                         break;
-    case 0x98: RES_N_R(3, gb->cpu.bc.b);                         break;
-    case 0x99: RES_N_R(3, gb->cpu.bc.c);                         break;
-    case 0x9a: RES_N_R(3, gb->cpu.de.d);                         break;
-    case 0x9b: RES_N_R(3, gb->cpu.de.e);                         break;
-    case 0x9c: RES_N_R(3, gb->cpu.hl.h);                         break;
-    case 0x9d: RES_N_R(3, gb->cpu.hl.l);                         break;
-    case 0x9e: RES_N_INDIRECT_HL(3);                             break;
-    case 0x9f: RES_N_R(3, gb->cpu.af.a);                         break;
-    case 0xa0: RES_N_R(4, gb->cpu.bc.b);                         break;
-    case 0xa1: RES_N_R(4, gb->cpu.bc.c);                         break;
-    case 0xa2: RES_N_R(4, gb->cpu.de.d);                         break;
-    case 0xa3: RES_N_R(4, gb->cpu.de.e);                         break;
-    case 0xa4: RES_N_R(4, gb->cpu.hl.h);                         break;
-    case 0xa5: RES_N_R(4, gb->cpu.hl.l);                         break;
-    case 0xa6: RES_N_INDIRECT_HL(4);                             break;
-    case 0xa7: RES_N_R(4, gb->cpu.af.a);                         break;
-    case 0xa8: RES_N_R(5, gb->cpu.bc.b);                         break;
-    case 0xa9: RES_N_R(5, gb->cpu.bc.c);                         break;
-    case 0xaa: RES_N_R(5, gb->cpu.de.d);                         break;
-    case 0xab: RES_N_R(5, gb->cpu.de.e);                         break;
-    case 0xac: RES_N_R(5, gb->cpu.hl.h);                         break;
-    case 0xad: RES_N_R(5, gb->cpu.hl.l);                         break;
-    case 0xae: RES_N_INDIRECT_HL(5);                             break;
-    case 0xaf: RES_N_R(5, gb->cpu.af.a);                         break;
-    case 0xb0: RES_N_R(6, gb->cpu.bc.b);                         break;
-    case 0xb1: RES_N_R(6, gb->cpu.bc.c);                         break;
-    case 0xb2: RES_N_R(6, gb->cpu.de.d);                         break;
-    case 0xb3: RES_N_R(6, gb->cpu.de.e);                         break;
-    case 0xb4: RES_N_R(6, gb->cpu.hl.h);                         break;
-    case 0xb5: RES_N_R(6, gb->cpu.hl.l);                         break;
-    case 0xb6: RES_N_INDIRECT_HL(6);                             break;
-    case 0xb7: RES_N_R(6, gb->cpu.af.a);                         break;
-    case 0xb8: RES_N_R(7, gb->cpu.bc.b);                         break;
-    case 0xb9: RES_N_R(7, gb->cpu.bc.c);                         break;
-    case 0xba: RES_N_R(7, gb->cpu.de.d);                         break;
-    case 0xbb: RES_N_R(7, gb->cpu.de.e);                         break;
-    case 0xbc: RES_N_R(7, gb->cpu.hl.h);                         break;
-    case 0xbd: RES_N_R(7, gb->cpu.hl.l);                         break;
-    case 0xbe: RES_N_INDIRECT_HL(7);                             break;
-    case 0xbf: RES_N_R(7, gb->cpu.af.a);                         break;
-    case 0xc0: SET_N_R(0, gb->cpu.bc.b);                         break;
-    case 0xc1: SET_N_R(0, gb->cpu.bc.c);                         break;
-    case 0xc2: SET_N_R(0, gb->cpu.de.d);                         break;
-    case 0xc3: SET_N_R(0, gb->cpu.de.e);                         break;
-    case 0xc4: SET_N_R(0, gb->cpu.hl.h);                         break;
-    case 0xc5: SET_N_R(0, gb->cpu.hl.l);                         break;
-    case 0xc6: SET_N_INDIRECT_HL(0);                             break;
-    case 0xc7: SET_N_R(0, gb->cpu.af.a);                         break;
-    case 0xc8: SET_N_R(1, gb->cpu.bc.b);                         break;
-    case 0xc9: SET_N_R(1, gb->cpu.bc.c);                         break;
-    case 0xca: SET_N_R(1, gb->cpu.de.d);                         break;
-    case 0xcb: SET_N_R(1, gb->cpu.de.e);                         break;
-    case 0xcc: SET_N_R(1, gb->cpu.hl.h);                         break;
-    case 0xcd: SET_N_R(1, gb->cpu.hl.l);                         break;
-    case 0xce: SET_N_INDIRECT_HL(1);                             break;
-    case 0xcf: SET_N_R(1, gb->cpu.af.a);                         break;
-    case 0xd0: SET_N_R(2, gb->cpu.bc.b);                         break;
-    case 0xd1: SET_N_R(2, gb->cpu.bc.c);                         break;
-    case 0xd2: SET_N_R(2, gb->cpu.de.d);                         break;
-    case 0xd3: SET_N_R(2, gb->cpu.de.e);                         break;
-    case 0xd4: SET_N_R(2, gb->cpu.hl.h);                         break;
-    case 0xd5: SET_N_R(2, gb->cpu.hl.l);                         break;
-    case 0xd6: SET_N_INDIRECT_HL(2);                             break;
-    case 0xd7: SET_N_R(2, gb->cpu.af.a);                         break;
-    case 0xd8: SET_N_R(3, gb->cpu.bc.b);                         break;
-    case 0xd9: SET_N_R(3, gb->cpu.bc.c);                         break;
-    case 0xda: SET_N_R(3, gb->cpu.de.d);                         break;
-    case 0xdb: SET_N_R(3, gb->cpu.de.e);                         break;
-    case 0xdc: SET_N_R(3, gb->cpu.hl.h);                         break;
-    case 0xdd: SET_N_R(3, gb->cpu.hl.l);                         break;
-    case 0xde: SET_N_INDIRECT_HL(3);                             break;
-    case 0xdf: SET_N_R(3, gb->cpu.af.a);                         break;
-    case 0xe0: SET_N_R(4, gb->cpu.bc.b);                         break;
-    case 0xe1: SET_N_R(4, gb->cpu.bc.c);                         break;
-    case 0xe2: SET_N_R(4, gb->cpu.de.d);                         break;
-    case 0xe3: SET_N_R(4, gb->cpu.de.e);                         break;
-    case 0xe4: SET_N_R(4, gb->cpu.hl.h);                         break;
-    case 0xe5: SET_N_R(4, gb->cpu.hl.l);                         break;
-    case 0xe6: SET_N_INDIRECT_HL(4);                             break;
-    case 0xe7: SET_N_R(4, gb->cpu.af.a);                         break;
-    case 0xe8: SET_N_R(5, gb->cpu.bc.b);                         break;
-    case 0xe9: SET_N_R(5, gb->cpu.bc.c);                         break;
-    case 0xea: SET_N_R(5, gb->cpu.de.d);                         break;
-    case 0xeb: SET_N_R(5, gb->cpu.de.e);                         break;
-    case 0xec: SET_N_R(5, gb->cpu.hl.h);                         break;
-    case 0xed: SET_N_R(5, gb->cpu.hl.l);                         break;
-    case 0xee: SET_N_INDIRECT_HL(5);                             break;
-    case 0xef: SET_N_R(5, gb->cpu.af.a);                         break;
-    case 0xf0: SET_N_R(6, gb->cpu.bc.b);                         break;
-    case 0xf1: SET_N_R(6, gb->cpu.bc.c);                         break;
-    case 0xf2: SET_N_R(6, gb->cpu.de.d);                         break;
-    case 0xf3: SET_N_R(6, gb->cpu.de.e);                         break;
-    case 0xf4: SET_N_R(6, gb->cpu.hl.h);                         break;
-    case 0xf5: SET_N_R(6, gb->cpu.hl.l);                         break;
-    case 0xf6: SET_N_INDIRECT_HL(6);                             break;
-    case 0xf7: SET_N_R(6, gb->cpu.af.a);                         break;
-    case 0xf8: SET_N_R(7, gb->cpu.bc.b);                         break;
-    case 0xf9: SET_N_R(7, gb->cpu.bc.c);                         break;
-    case 0xfa: SET_N_R(7, gb->cpu.de.d);                         break;
-    case 0xfb: SET_N_R(7, gb->cpu.de.e);                         break;
-    case 0xfc: SET_N_R(7, gb->cpu.hl.h);                         break;
-    case 0xfd: SET_N_R(7, gb->cpu.hl.l);                         break;
-    case 0xfe: SET_N_INDIRECT_HL(7);                             break;
-    case 0xff: SET_N_R(7, gb->cpu.af.a);                         break;
+    cpu.ime = true;             \
+    CPU_SCHEDULE_SYNC()
+
+/* Opcode dispatch. With GCC/Clang every handler ends by jumping straight to
+ * the handler of the next opcode through a label table (threaded code), so
+ * each handler gets its own indirect branch to predict. Other compilers, or
+ * builds with GBDARM_NO_THREADED_DISPATCH, fall back to a plain switch. */
+#if defined(__GNUC__) && !defined(GBDARM_NO_THREADED_DISPATCH)
+#define GBDARM_THREADED_DISPATCH
+#endif
+
+/* Only an event can complete a frame or use up the budget, so the exit test
+ * lives on the slow path. The registers, F and the cycle count are written
+ * back first since the peripherals and interrupt dispatch work on gb. */
+#define CPU_TICK()                                                      \
+    do {                                                                \
+        STORE_FLAGS();                                                  \
+        gb->cpu = cpu;                                                  \
+        gb->sched.cycles = cycles;                                      \
+        cpu_tick(gb);                                                   \
+        if (gb->ppu.frameReady || cycles >= gb->sched.deadline[EVENT_HOST]) { \
+            gb->executedInstructions += executed;                       \
+            return cycles - start;                                      \
+        }                                                               \
+        cpu = gb->cpu;                                                  \
+    } while (0)
+
+#define FETCH_OPCODE()                                                          \
+    opcode = (gb->mode == HALT) ? 0x76 : CPU_FETCH_BYTE();                      \
+    executedCycle = instrCycle[opcode] + ((gb->interrupt.interruptHandled) ? 5 : 0)
+
+#ifdef GBDARM_THREADED_DISPATCH
+
+#define OPCODE(n)               op_##n:
+#define CB_OPCODE(n)            cb_##n:
+
+#define DISPATCH_START()        FETCH_OPCODE(); goto *opTable[opcode];
+#define DISPATCH_END()
+#define OPCODE_UNKNOWN()        op_unknown:
+#define CB_DISPATCH(op)         goto *cbOpTable[op]
+#define CB_DISPATCH_END()
+
+#define NEXT()                                                  \
+    do {                                                        \
+        executed++;                                             \
+        cycles += executedCycle;                                \
+        if (cycles >= gb->sched.nextEvent)                      \
+            CPU_TICK();                                         \
+        FETCH_OPCODE();                                         \
+        goto *opTable[opcode];                                  \
+    } while (0)
+
+#else
+
+#define OPCODE(n)               case n:
+#define CB_OPCODE(n)            case n:
+
+#define DISPATCH_START()        for (;;) { FETCH_OPCODE(); switch (opcode) {
+#define DISPATCH_END()                                          \
+        }                                                       \
+        executed++;                                             \
+        cycles += executedCycle;                                \
+        if (cycles >= gb->sched.nextEvent)                      \
+            CPU_TICK();                                         \
+    }
+#define OPCODE_UNKNOWN()        default:
+#define CB_DISPATCH(op)         switch (op) {
+#define CB_DISPATCH_END()       } break
+
+#define NEXT()                  break
+
+#endif
+
+/* bring the timer, OAM DMA and PPU up to the current cycle and service
+ * pending interrupts; only called once the next scheduled event is due */
+void cpu_tick(struct gb *gb)
+{
+    bool lcdOn;
+
+    gb->sched.lastSync = gb->sched.cycles;
+    timer_tick(gb);
+    dma_tick(gb);
+    lcdOn = ppu_tick(gb);
+    sched_update(gb);
+    if (!lcdOn)
+        return;
+    interrupt_process(gb);
+    // the next instruction pays for the dispatch, look again after it
+    if (gb->interrupt.interruptHandled)
+        SCHEDULE_SYNC();
+}
+
+/* registers a polling loop may read: they only change when a scheduled event
+ * runs, HRAM included since only interrupt handlers would write it */
+#define IS_IDLE_POLL_REG(addr)                                          \
+    ((addr) == PPU_REG_LY || (addr) == PPU_REG_STAT ||                  \
+    (addr) == TIMER_REG_TIMA || (addr) == INTERRUPT_REG_IF ||           \
+    (addr) >= 0xff80)
+
+/* Called after a JR jumped len bytes back, with end the cycle the JR ends
+ * on. A loop that is only "LDH A,(n); CP d8 / AND d8 / AND A / OR A; JR cc"
+ * reads the same value and takes the same branch on every pass until the
+ * next scheduled event, so charge all the whole passes that end before it at
+ * once; returns the cycles to add. The pass that just ended must have been a
+ * full one with no event in it, otherwise the value it branched on may
+ * already be stale. */
+int cpu_skip_idle_loop(struct gb *gb, uint64_t end, uint16_t pc, uint8_t jrOpcode, int len)
+{
+    uint8_t alu = bus_read(gb, pc + 2);
+    uint64_t start = gb->sched.idleLoopEnd;
+    bool again = gb->sched.idleLoopPc == pc;
+    int passCycles, passes;
+
+    gb->sched.idleLoopPc = pc;
+    gb->sched.idleLoopEnd = end;
+    if (bus_read(gb, pc) != 0xf0 || !IS_IDLE_POLL_REG(TO_U16(bus_read(gb, pc + 1), 0xff)))
+        return 0;
+    if (!(len == 6 && (alu == 0xfe || alu == 0xe6)) && !(len == 5 && (alu == 0xa7 || alu == 0xb7)))
+        return 0;
+    passCycles = instrCycle[0xf0] + instrCycle[alu] + instrCycle[jrOpcode] + 1;
+    if (!again || start + passCycles != end || gb->sched.lastSync > start)
+        return 0;
+    if (gb->sched.nextEvent == EVENT_NEVER || gb->sched.nextEvent <= end)
+        return 0;
+    passes = (gb->sched.nextEvent - end - 1) / passCycles;
+    gb->sched.idleSkipped += passes * passCycles;
+    gb->sched.idleLoopEnd += passes * passCycles;
+    return passes * passCycles;
+}
+
+/* bus_read and bus_write for the interpreter, which keeps the cycle count
+ * in a local: the slow paths bring the timer and PPU up to gb->sched.cycles,
+ * so it is written back before them. mbc_write, when the MBC is known at
+ * compile time, takes writes to the ROM area directly. */
+static inline uint8_t cpu_bus_read(struct gb *gb, uint16_t addr, uint64_t cycles)
+{
+    uint8_t *page = gb->page.read[addr >> 8];
+
+    if (page)
+        return page[addr & 0xff];
+    gb->sched.cycles = cycles;
+    return bus_read_slow(gb, addr);
+}
+
+static inline void cpu_bus_write(struct gb *gb, uint16_t addr, uint8_t val, uint64_t cycles,
+                                 void (*mbc_write)(struct gb *gb, uint16_t addr, uint8_t val))
+{
+    uint8_t *page = gb->page.write[addr >> 8];
+
+    if (page) {
+        page[addr & 0xff] = val;
+    } else if (mbc_write && addr < 0x8000) {
+        mbc_write(gb, addr, val);
+    } else {
+        gb->sched.cycles = cycles;
+        bus_write_slow(gb, addr, val);
+    }
+}
+
+#define CPU_RUN         cpu_run
+#include "gbdarm_cpu_run.h"
+
+#ifdef GBDARM_MBC_VARIANTS
+#define CPU_RUN         cpu_run_no_mbc
+#define MBC_WRITE       no_mbc_write
+#include "gbdarm_cpu_run.h"
+
+#define CPU_RUN         cpu_run_mbc1
+#define MBC_WRITE       mbc1_write
+#include "gbdarm_cpu_run.h"
+
+#define CPU_RUN         cpu_run_mbc3
+#define MBC_WRITE       mbc3_write
+#include "gbdarm_cpu_run.h"
+
+#define CPU_RUN         cpu_run_mbc5
+#define MBC_WRITE       mbc5_write
+#include "gbdarm_cpu_run.h"
+#endif
+
+/* the interpreter to run the loaded cartridge with: with GBDARM_MBC_VARIANTS
+ * the one built for its MBC family, otherwise (or for other MBCs) cpu_run */
+cpu_run_t cpu_run_select(struct gb *gb)
+{
+#ifdef GBDARM_MBC_VARIANTS
+    switch (gb->cart.rom.type) {
+    case NO_MBC:
+        return cpu_run_no_mbc;
+    case MBC1:
+    case MBC1_RAM:
+    case MBC1_RAM_BATTERY:
+        return cpu_run_mbc1;
+    case MBC3_TIMER_BATTERY:
+    case MBC3_TIMER_RAM_BATTERY:
+    case MBC3:
+    case MBC3_RAM:
+    case MBC3_RAM_BATTERY:
+        return cpu_run_mbc3;
+    case MBC5:
+    case MBC5_RAM:
+    case MBC5_RAM_BATTERY:
+    case MBC5_RUMBLE:
+    case MBC5_RUMBLE_RAM:
+    case MBC5_RUMBLE_RAM_BATTERY:
+        return cpu_run_mbc5;
     default:
         break;
     }
-    return cbInstrCycle[opcode];
+#endif
+    return cpu_run;
 }
 
 void cpu_step(struct gb *gb)
 {
-    uint8_t opcode, a, msb, lsb;
-    uint16_t operand, res, carryPerBit;
-    bool is_interrupt, statIntrLine;
-
-    gb->executedCycle = 0;
-    opcode = (gb->mode == HALT) ? 0x76 : CPU_FETCH_BYTE();
-    gb->executedCycle += instrCycle[opcode] + ((gb->interrupt.interruptHandled) ? 5 : 0);
-    switch (opcode) {
-    case 0x00:                                                          break;
-    case 0x01: gb->cpu.bc.val = sm83_fetch_word(gb);                    break;
-    case 0x02: bus_write(gb, gb->cpu.bc.val, gb->cpu.af.a);             break;
-    case 0x03: INC_RR(gb->cpu.bc.val);                                  break;
-    case 0x04: INC_R(gb->cpu.bc.b);                                     break;
-    case 0x05: DEC_R(gb->cpu.bc.b);                                     break;
-    case 0x06: gb->cpu.bc.b = CPU_FETCH_BYTE();                         break;
-    case 0x07: RLCA();                                                  break;
-    case 0x08: 
-        operand = sm83_fetch_word(gb);
-        LD_INDIRECT_NN_SP(operand);
-        break;
-    case 0x09: ADD_HL_RR(gb->cpu.bc.val);                               break;
-    case 0x0a: gb->cpu.af.a = bus_read(gb, gb->cpu.bc.val);             break;
-    case 0x0b: DEC_RR(gb->cpu.bc.val);                                  break;
-    case 0x0c: INC_R(gb->cpu.bc.c);                                     break;
-    case 0x0d: DEC_R(gb->cpu.bc.c);                                     break;
-    case 0x0e: gb->cpu.bc.c = CPU_FETCH_BYTE();                         break;
-    case 0x0f: RRCA();                                                  break;
-    case 0x10:                                                          break;
-    case 0x11: gb->cpu.de.val = sm83_fetch_word(gb);                    break;
-    case 0x12: bus_write(gb, gb->cpu.de.val, gb->cpu.af.a);             break;
-    case 0x13: INC_RR(gb->cpu.de.val);                                  break;
-    case 0x14: INC_R(gb->cpu.de.d);                                     break;
-    case 0x15: DEC_R(gb->cpu.de.d);                                     break;
-    case 0x16: gb->cpu.de.d = CPU_FETCH_BYTE();                         break;
-    case 0x17: RLA();                                                   break;
-    case 0x18: 
-        operand = CPU_FETCH_BYTE();
-        JP(gb->cpu.pc, operand, 1);
-        break;
-    case 0x19: ADD_HL_RR(gb->cpu.de.val);                               break;
-    case 0x1a: gb->cpu.af.a = bus_read(gb, gb->cpu.de.val);             break;
-    case 0x1b: DEC_RR(gb->cpu.de.val);                                  break;
-    case 0x1c: INC_R(gb->cpu.de.e);                                     break;
-    case 0x1d: DEC_R(gb->cpu.de.e);                                     break;
-    case 0x1e: gb->cpu.de.e = CPU_FETCH_BYTE();                        break;
-    case 0x1f: RRA();                                                   break;
-    case 0x20: 
-        operand = CPU_FETCH_BYTE();
-        JP(gb->cpu.pc, operand, !gb->cpu.af.flag.z);
-        break;
-    case 0x21: gb->cpu.hl.val = sm83_fetch_word(gb);                    break;
-    case 0x22: bus_write(gb, gb->cpu.hl.val++, gb->cpu.af.a);           break;
-    case 0x23: INC_RR(gb->cpu.hl.val);                                  break;
-    case 0x24: INC_R(gb->cpu.hl.h);                                     break;
-    case 0x25: DEC_R(gb->cpu.hl.h);                                     break;
-    case 0x26: gb->cpu.hl.h = CPU_FETCH_BYTE();                        break;
-    case 0x27: DAA();                                                   break;
-    case 0x28: 
-        operand = CPU_FETCH_BYTE();
-        JP(gb->cpu.pc, operand, gb->cpu.af.flag.z);
-        break;
-    case 0x29: ADD_HL_RR(gb->cpu.hl.val);                               break;
-    case 0x2a: gb->cpu.af.a = bus_read(gb, gb->cpu.hl.val++);           break;
-    case 0x2b: DEC_RR(gb->cpu.hl.val);                                  break;
-    case 0x2c: INC_R(gb->cpu.hl.l);                                     break;
-    case 0x2d: DEC_R(gb->cpu.hl.l);                                     break;
-    case 0x2e: gb->cpu.hl.l = CPU_FETCH_BYTE();                        break;
-    case 0x2f: CPL();                                                   break;
-    case 0x30:
-        operand = CPU_FETCH_BYTE();
-        JP(gb->cpu.pc, operand, !gb->cpu.af.flag.c);
-        break;
-    case 0x31: gb->cpu.sp = sm83_fetch_word(gb);                        break;
-    case 0x32: bus_write(gb, gb->cpu.hl.val--, gb->cpu.af.a);           break;
-    case 0x33: INC_RR(gb->cpu.sp);                                      break;
-    case 0x34: INC_INDIRECT_HL();                                       break;
-    case 0x35: DEC_INDIRECT_HL();                                       break;
-    case 0x36: 
-        operand = CPU_FETCH_BYTE();
-        LD_INDIRECT_HL_N(operand);
-        break;
-    case 0x37: SCF();                                                   break;
-    case 0x38:
-        operand = CPU_FETCH_BYTE();
-        JP(gb->cpu.pc, operand, gb->cpu.af.flag.c);
-        break;
-    case 0x39: ADD_HL_RR(gb->cpu.sp);                                   break;
-    case 0x3a: gb->cpu.af.a = bus_read(gb, gb->cpu.hl.val--);           break;
-    case 0x3b: DEC_RR(gb->cpu.sp);                                      break;
-    case 0x3c: INC_R(gb->cpu.af.a);                                     break;
-    case 0x3d: DEC_R(gb->cpu.af.a);                                     break;
-    case 0x3e: gb->cpu.af.a = CPU_FETCH_BYTE();                        break;
-    case 0x3f: CCF();                                                   break;
-    case 0x40: gb->cpu.bc.b = gb->cpu.bc.b;                             break;
-    case 0x41: gb->cpu.bc.b = gb->cpu.bc.c;                             break;
-    case 0x42: gb->cpu.bc.b = gb->cpu.de.d;                             break;
-    case 0x43: gb->cpu.bc.b = gb->cpu.de.e;                             break;
-    case 0x44: gb->cpu.bc.b = gb->cpu.hl.h;                             break;
-    case 0x45: gb->cpu.bc.b = gb->cpu.hl.l;                             break;
-    case 0x46: gb->cpu.bc.b = bus_read(gb, gb->cpu.hl.val);             break;
-    case 0x47: gb->cpu.bc.b = gb->cpu.af.a;                             break;
-    case 0x48: gb->cpu.bc.c = gb->cpu.bc.b;                             break;
-    case 0x49: gb->cpu.bc.c = gb->cpu.bc.c;                             break;
-    case 0x4a: gb->cpu.bc.c = gb->cpu.de.d;                             break;
-    case 0x4b: gb->cpu.bc.c = gb->cpu.de.e;                             break;
-    case 0x4c: gb->cpu.bc.c = gb->cpu.hl.h;                             break;
-    case 0x4d: gb->cpu.bc.c = gb->cpu.hl.l;                             break;
-    case 0x4e: gb->cpu.bc.c = bus_read(gb, gb->cpu.hl.val);             break;
-    case 0x4f: gb->cpu.bc.c = gb->cpu.af.a;                             break;
-    case 0x50: gb->cpu.de.d = gb->cpu.bc.b;                             break;
-    case 0x51: gb->cpu.de.d = gb->cpu.bc.c;                             break;
-    case 0x52: gb->cpu.de.d = gb->cpu.de.d;                             break;
-    case 0x53: gb->cpu.de.d = gb->cpu.de.e;                             break;
-    case 0x54: gb->cpu.de.d = gb->cpu.hl.h;                             break;
-    case 0x55: gb->cpu.de.d = gb->cpu.hl.l;                             break;
-    case 0x56: gb->cpu.de.d = bus_read(gb, gb->cpu.hl.val);             break;
-    case 0x57: gb->cpu.de.d = gb->cpu.af.a;                             break;
-    case 0x58: gb->cpu.de.e = gb->cpu.bc.b;                             break;
-    case 0x59: gb->cpu.de.e = gb->cpu.bc.c;                             break;
-    case 0x5a: gb->cpu.de.e = gb->cpu.de.d;                             break;
-    case 0x5b: gb->cpu.de.e = gb->cpu.de.e;                             break;
-    case 0x5c: gb->cpu.de.e = gb->cpu.hl.h;                             break;
-    case 0x5d: gb->cpu.de.e = gb->cpu.hl.l;                             break;
-    case 0x5e: gb->cpu.de.e = bus_read(gb, gb->cpu.hl.val);             break;
-    case 0x5f: gb->cpu.de.e = gb->cpu.af.a;                             break;
-    case 0x60: gb->cpu.hl.h = gb->cpu.bc.b;                             break;
-    case 0x61: gb->cpu.hl.h = gb->cpu.bc.c;                             break;
-    case 0x62: gb->cpu.hl.h = gb->cpu.de.d;                             break;
-    case 0x63: gb->cpu.hl.h = gb->cpu.de.e;                             break;
-    case 0x64: gb->cpu.hl.h = gb->cpu.hl.h;                             break;
-    case 0x65: gb->cpu.hl.h = gb->cpu.hl.l;                             break;
-    case 0x66: gb->cpu.hl.h = bus_read(gb, gb->cpu.hl.val);             break;
-    case 0x67: gb->cpu.hl.h = gb->cpu.af.a;                             break;
-    case 0x68: gb->cpu.hl.l = gb->cpu.bc.b;                             break;
-    case 0x69: gb->cpu.hl.l = gb->cpu.bc.c;                             break;
-    case 0x6a: gb->cpu.hl.l = gb->cpu.de.d;                             break;
-    case 0x6b: gb->cpu.hl.l = gb->cpu.de.e;                             break;
-    case 0x6c: gb->cpu.hl.l = gb->cpu.hl.h;                             break;
-    case 0x6d: gb->cpu.hl.l = gb->cpu.hl.l;                             break;
-    case 0x6e: gb->cpu.hl.l = bus_read(gb, gb->cpu.hl.val);             break;
-    case 0x6f: gb->cpu.hl.l = gb->cpu.af.a;                             break;
-    case 0x70: bus_write(gb, gb->cpu.hl.val, gb->cpu.bc.b);             break;
-    case 0x71: bus_write(gb, gb->cpu.hl.val, gb->cpu.bc.c);             break;
-    case 0x72: bus_write(gb, gb->cpu.hl.val, gb->cpu.de.d);             break;
-    case 0x73: bus_write(gb, gb->cpu.hl.val, gb->cpu.de.e);             break;
-    case 0x74: bus_write(gb, gb->cpu.hl.val, gb->cpu.hl.h);             break;
-    case 0x75: bus_write(gb, gb->cpu.hl.val, gb->cpu.hl.l);             break;
-    case 0x76: HALT();                                                  break;
-    case 0x77: bus_write(gb, gb->cpu.hl.val, gb->cpu.af.a);             break;
-    case 0x78: gb->cpu.af.a = gb->cpu.bc.b;                             break;
-    case 0x79: gb->cpu.af.a = gb->cpu.bc.c;                             break;
-    case 0x7a: gb->cpu.af.a = gb->cpu.de.d;                             break;
-    case 0x7b: gb->cpu.af.a = gb->cpu.de.e;                             break;
-    case 0x7c: gb->cpu.af.a = gb->cpu.hl.h;                             break;
-    case 0x7d: gb->cpu.af.a = gb->cpu.hl.l;                             break;
-    case 0x7e: gb->cpu.af.a = bus_read(gb, gb->cpu.hl.val);             break;
-    case 0x7f: gb->cpu.af.a = gb->cpu.af.a;                             break;
-    case 0x80: ADD(gb->cpu.bc.b, 0);                                    break;
-    case 0x81: ADD(gb->cpu.bc.c, 0);                                    break;
-    case 0x82: ADD(gb->cpu.de.d, 0);                                    break;
-    case 0x83: ADD(gb->cpu.de.e, 0);                                    break;
-    case 0x84: ADD(gb->cpu.hl.h, 0);                                    break;
-    case 0x85: ADD(gb->cpu.hl.l, 0);                                    break;
-    case 0x86: 
-        operand = bus_read(gb, gb->cpu.hl.val);
-        ADD(operand, 0);
-        break;
-    case 0x87: ADD(gb->cpu.af.a, 0);                                    break;
-    case 0x88: ADD(gb->cpu.bc.b, gb->cpu.af.flag.c);                    break;
-    case 0x89: ADD(gb->cpu.bc.c, gb->cpu.af.flag.c);                    break;
-    case 0x8a: ADD(gb->cpu.de.d, gb->cpu.af.flag.c);                    break;
-    case 0x8b: ADD(gb->cpu.de.e, gb->cpu.af.flag.c);                    break;
-    case 0x8c: ADD(gb->cpu.hl.h, gb->cpu.af.flag.c);                    break;
-    case 0x8d: ADD(gb->cpu.hl.l, gb->cpu.af.flag.c);                    break;
-    case 0x8e: 
-        operand = bus_read(gb, gb->cpu.hl.val);
-        ADD(operand, gb->cpu.af.flag.c);
-        break;
-    case 0x8f: ADD(gb->cpu.af.a, gb->cpu.af.flag.c);                    break;
-    case 0x90: SUB(gb->cpu.bc.b, 0);                                    break;
-    case 0x91: SUB(gb->cpu.bc.c, 0);                                    break;
-    case 0x92: SUB(gb->cpu.de.d, 0);                                    break;
-    case 0x93: SUB(gb->cpu.de.e, 0);                                    break;
-    case 0x94: SUB(gb->cpu.hl.h, 0);                                    break;
-    case 0x95: SUB(gb->cpu.hl.l, 0);                                    break;
-    case 0x96:
-        operand = bus_read(gb, gb->cpu.hl.val);
-        SUB(operand, 0);      
-        break;
-    case 0x97: SUB(gb->cpu.af.a, 0);                                    break;
-    case 0x98: SUB(gb->cpu.bc.b, gb->cpu.af.flag.c);                    break;
-    case 0x99: SUB(gb->cpu.bc.c, gb->cpu.af.flag.c);                    break;
-    case 0x9a: SUB(gb->cpu.de.d, gb->cpu.af.flag.c);                    break;
-    case 0x9b: SUB(gb->cpu.de.e, gb->cpu.af.flag.c);                    break;
-    case 0x9c: SUB(gb->cpu.hl.h, gb->cpu.af.flag.c);                    break;
-    case 0x9d: SUB(gb->cpu.hl.l, gb->cpu.af.flag.c);                    break;
-    case 0x9e:
-        operand = bus_read(gb, gb->cpu.hl.val);
-        SUB(operand, gb->cpu.af.flag.c);
-        break;
-    case 0x9f: SUB(gb->cpu.af.a, gb->cpu.af.flag.c);                    break;
-    case 0xa0: AND(gb->cpu.bc.b);                                       break;
-    case 0xa1: AND(gb->cpu.bc.c);                                       break;
-    case 0xa2: AND(gb->cpu.de.d);                                       break;
-    case 0xa3: AND(gb->cpu.de.e);                                       break;
-    case 0xa4: AND(gb->cpu.hl.h);                                       break;
-    case 0xa5: AND(gb->cpu.hl.l);                                       break;
-    case 0xa6: 
-        operand = bus_read(gb, gb->cpu.hl.val);
-        AND(operand);
-        break;
-    case 0xa7: AND(gb->cpu.af.a);                                       break;
-    case 0xa8: XOR(gb->cpu.bc.b);                                       break;
-    case 0xa9: XOR(gb->cpu.bc.c);                                       break;
-    case 0xaa: XOR(gb->cpu.de.d);                                       break;
-    case 0xab: XOR(gb->cpu.de.e);                                       break;
-    case 0xac: XOR(gb->cpu.hl.h);                                       break;
-    case 0xad: XOR(gb->cpu.hl.l);                                       break;
-    case 0xae: 
-        operand = bus_read(gb, gb->cpu.hl.val);
-        XOR(operand);
-        break;
-    case 0xaf: XOR(gb->cpu.af.a);                                       break;
-    case 0xb0: OR(gb->cpu.bc.b);                                        break;
-    case 0xb1: OR(gb->cpu.bc.c);                                        break;
-    case 0xb2: OR(gb->cpu.de.d);                                        break;
-    case 0xb3: OR(gb->cpu.de.e);                                        break;
-    case 0xb4: OR(gb->cpu.hl.h);                                        break;
-    case 0xb5: OR(gb->cpu.hl.l);                                        break;
-    case 0xb6: 
-        operand = bus_read(gb, gb->cpu.hl.val);
-        OR(operand);
-        break;
-    case 0xb7: OR(gb->cpu.af.a);                                        break;
-    case 0xb8: CP(gb->cpu.bc.b);                                        break;
-    case 0xb9: CP(gb->cpu.bc.c);                                        break;
-    case 0xba: CP(gb->cpu.de.d);                                        break;
-    case 0xbb: CP(gb->cpu.de.e);                                        break;
-    case 0xbc: CP(gb->cpu.hl.h);                                        break;
-    case 0xbd: CP(gb->cpu.hl.l);                                        break;
-    case 0xbe:
-        operand = bus_read(gb, gb->cpu.hl.val);
-        CP(operand);
-        break;
-    case 0xbf: CP(gb->cpu.af.a);                                        break;
-    case 0xc0: RET(opcode, !gb->cpu.af.flag.z);                         break;
-    case 0xc1: gb->cpu.bc.val = cpu_pop_word(gb);                      break;
-    case 0xc2: 
-        operand = sm83_fetch_word(gb);
-        JP(operand, 0, !gb->cpu.af.flag.z);
-        break;
-    case 0xc3: 
-        operand = sm83_fetch_word(gb);
-        JP(operand, 0, 1);
-        break; 
-    case 0xc4:
-        operand = sm83_fetch_word(gb);
-        CALL(operand, !gb->cpu.af.flag.z);
-        break;
-    case 0xc5: PUSH_RR(gb->cpu.bc.val);                                 break;
-    case 0xc6: 
-        operand = CPU_FETCH_BYTE();
-        ADD(operand, 0);
-        break;
-    case 0xc7: RST_N(0x00);                                             break;
-    case 0xc8: RET(opcode, gb->cpu.af.flag.z);                          break;
-    case 0xc9: RET(opcode, 1);                                          break;
-    case 0xca: 
-        operand = sm83_fetch_word(gb);
-        JP(operand, 0, gb->cpu.af.flag.z);
-        break;
-    case 0xcb:
-        operand = CPU_FETCH_BYTE();
-        gb->executedCycle += execute_cb_instructions(gb, operand);
-        break;
-    case 0xcc:
-        operand = sm83_fetch_word(gb);
-        CALL(operand, gb->cpu.af.flag.z);
-        break;
-    case 0xcd: 
-        operand = sm83_fetch_word(gb);
-        CALL(operand, 1);
-        break;
-    case 0xce: 
-        operand = CPU_FETCH_BYTE();
-        ADD(operand, gb->cpu.af.flag.c);
-        break;
-    case 0xcf: RST_N(0x08);                                             break;
-    case 0xd0: RET(opcode, !gb->cpu.af.flag.c);                         break;
-    case 0xd1: gb->cpu.de.val = cpu_pop_word(gb);                      break;
-    case 0xd2: 
-        operand = sm83_fetch_word(gb);
-        JP(operand, 0, !gb->cpu.af.flag.c);
-        break;
-    case 0xd4: 
-        operand = sm83_fetch_word(gb);
-        CALL(operand, !gb->cpu.af.flag.c);
-        break;
-    case 0xd5: PUSH_RR(gb->cpu.de.val);                                 break;
-    case 0xd6:
-        operand = CPU_FETCH_BYTE();
-        SUB(operand, 0);
-        break;
-    case 0xd7: RST_N(0x10);                                             break;
-    case 0xd8: RET(opcode, gb->cpu.af.flag.c);                          break;
-    case 0xd9: RETI();                                                  break;
-    case 0xda:
-        operand = sm83_fetch_word(gb);
-        JP(operand, 0, gb->cpu.af.flag.c);
-        break;
-    case 0xdc: 
-        operand = sm83_fetch_word(gb);
-        CALL(operand, gb->cpu.af.flag.c);
-        break;
-    case 0xde:
-        operand = CPU_FETCH_BYTE();
-        SUB(operand, gb->cpu.af.flag.c);
-        break;
-    case 0xdf: RST_N(0x18);                                             break;
-    case 0xe0: 
-        operand = CPU_FETCH_BYTE();
-        LDH_INDIRECT_N_A(operand);
-        break;
-    case 0xe1: gb->cpu.hl.val = cpu_pop_word(gb);                      break;
-    case 0xe2: LDH_INDIRECT_C_A();                                      break;
-    case 0xe5: PUSH_RR(gb->cpu.hl.val);                                 break;
-    case 0xe6: 
-        operand = CPU_FETCH_BYTE();
-        AND(operand);
-        break;
-    case 0xe7: RST_N(0x20);                                             break;
-    case 0xe8: 
-        operand = CPU_FETCH_BYTE();
-        ADD_SP_I8(operand);
-        break;
-    case 0xe9: gb->cpu.pc = gb->cpu.hl.val;                             break;
-    case 0xea:
-        operand = sm83_fetch_word(gb);
-        bus_write(gb, operand, gb->cpu.af.a);
-        break;
-    case 0xee: 
-        operand = CPU_FETCH_BYTE();
-        XOR(operand);
-        break;
-    case 0xef: RST_N(0x28);                                             break;
-    case 0xf0: 
-        operand = CPU_FETCH_BYTE();
-        LDH_A_INDIRECT_N(operand);
-        break;
-    case 0xf1: 
-        operand = cpu_pop_word(gb);
-        gb->cpu.af.val = (operand & 0xfff0) & ~0x000f;
-        break;
-    case 0xf2: LDH_A_INDIRECT_C();                                      break;
-    case 0xf3: DI();                                                    break;
-    case 0xf5: PUSH_RR(gb->cpu.af.val);                                 break;
-    case 0xf6:
-        operand = CPU_FETCH_BYTE();
-        OR(operand);
-        break;
-    case 0xf7: RST_N(0x30);                                             break;
-    case 0xf8: 
-        operand = CPU_FETCH_BYTE();
-        LD_HL_SP_PLUS_I8(operand);
-        break;
-    case 0xf9: gb->cpu.sp = gb->cpu.hl.val;                             break;
-    case 0xfa: 
-        operand = sm83_fetch_word(gb);
-        gb->cpu.af.a = bus_read(gb, operand);
-        break;
-    case 0xfb: EI();                                                    break;
-    case 0xfe: 
-        operand = CPU_FETCH_BYTE();
-        CP(operand);
-        break;
-    case 0xff: RST_N(0x38);                                             break;
-    default:
-        printf("Unknown opcode 0x%02x\n", opcode);
-        break;
+    cpu_run(gb, 1);
+}
+
+/* run the loaded cartridge for budget M-cycles, returning early once a frame
+ * is complete; returns the M-cycles run, the last instruction may overshoot */
+int gb_run_cycles(struct gb *gb, int budget)
+{
+    return cpu_run_select(gb)(gb, budget);
+}
+
+/* run until the next frame is complete, or for one frame's worth of cycles
+ * while the LCD is off so the host still gets to poll its inputs */
+int gb_run_frame(struct gb *gb)
+{
+    return gb_run_cycles(gb, FRAME_CYCLES);
+}
+
+/* Call once a frame is ready with how long it took the host, in
+ * microseconds, to decide whether the next one is drawn. The auto mode skips
+ * while the host is behind the 59.73 Hz deadline, FRAMESKIP_MAX frames in a
+ * row at most. Returns true if the next frame will be skipped. */
+bool gb_frame_skip_update(struct gb *gb, int frameUs)
+{
+    struct frame_skip *skip = &gb->frameSkip;
+
+    if (skip->ratio == FRAMESKIP_AUTO) {
+        skip->lag += frameUs - FRAME_US;
+        // do not bank more than a frame ahead or chase more than we can skip
+        if (skip->lag < -FRAME_US)
+            skip->lag = -FRAME_US;
+        else if (skip->lag > FRAMESKIP_MAX * FRAME_US)
+            skip->lag = FRAMESKIP_MAX * FRAME_US;
+        skip->skipping = skip->lag > 0 && skip->run < FRAMESKIP_MAX;
+    } else {
+        skip->skipping = skip->ratio == FRAMESKIP_HEADLESS || skip->run < skip->ratio;
+    }
+    skip->run = (skip->skipping) ? skip->run + 1 : 0;
+    return skip->skipping;
+}
+
+/* Draw the next frame after all, e.g. to capture one now and then while
+ * running headless. Call it once a frame is ready. */
+void gb_draw_next_frame(struct gb *gb)
+{
+    gb->frameSkip.skipping = false;
+    gb->frameSkip.run = 0;
+}
+
+// returns the buffer to draw the first frame into
+uint16_t *frame_buffers_init(struct frame_buffers *fb, uint16_t *buffers[FRAME_BUFFER_COUNT])
+{
+    for (int i = 0; i < FRAME_BUFFER_COUNT; i++) {
+        fb->buffers[i] = buffers[i];
+        fb->states[i] = (i == 0) ? BUFFER_RENDERING : BUFFER_FREE;
+    }
+    fb->dropped = fb->duplicated = 0;
+    return fb->buffers[0];
+}
+
+/* Call once a frame is ready, drawn as gb->frameSkip.drawn says. Queues it,
+ * replacing a frame still waiting, and returns the buffer to draw the next
+ * frame into. A skipped frame left the buffer alone and it is drawn again. */
+uint16_t *frame_buffers_done(struct frame_buffers *fb, bool drawn)
+{
+    int rendering = 0, next = -1;
+
+    for (int i = 0; i < FRAME_BUFFER_COUNT; i++) {
+        if (fb->states[i] == BUFFER_RENDERING)
+            rendering = i;
+    }
+    if (!drawn)
+        return fb->buffers[rendering];
+    for (int i = 0; i < FRAME_BUFFER_COUNT; i++) {
+        if (fb->states[i] == BUFFER_QUEUED) {
+            fb->states[i] = BUFFER_FREE;
+            fb->dropped++;
+        }
+        if (fb->states[i] == BUFFER_FREE && next < 0)
+            next = i;
+    }
+    fb->states[rendering] = BUFFER_QUEUED;
+    fb->states[next] = BUFFER_RENDERING;
+    return fb->buffers[next];
+}
+
+/* Call when the display is free: the queued frame, now the one being sent,
+ * or NULL if nothing new finished and the panel keeps its frame. */
+uint16_t *frame_buffers_scanout(struct frame_buffers *fb)
+{
+    int queued = -1;
+
+    for (int i = 0; i < FRAME_BUFFER_COUNT; i++) {
+        if (fb->states[i] == BUFFER_QUEUED)
+            queued = i;
+    }
+    if (queued < 0) {
+        fb->duplicated++;
+        return NULL;
+    }
+    for (int i = 0; i < FRAME_BUFFER_COUNT; i++) {
+        if (fb->states[i] == BUFFER_SCANOUT)
+            fb->states[i] = BUFFER_FREE;
+    }
+    fb->states[queued] = BUFFER_SCANOUT;
+    return fb->buffers[queued];
+}
+
+/**********************************************************************************************/
+/************************************* PPU related parts **************************************/
+/**********************************************************************************************/
+
+#define GET_COLOR(lo, hi)        \
+    ((lo) | ((hi) << 1))
+#define GET_COLOR_ID(which_pal, color_id)       \
+    (gb->ppu.pal[which_pal] >> ((color_id) * 2)) & 0x03
+#define READ_vRAM(addr)         \
+    gb->vRAM[addr - 0x8000]
+/* spread the 8 bits of a bitplane byte over 8 bytes, bit 7 going to byte 0:
+ * the multiply copies the byte into every lane, the mask keeps bit 7-k in
+ * lane k and the add carries it up to bit 7 of that lane (little-endian) */
+#define TILE_ROW_EXPAND(b)      \
+    (((((b) * 0x0101010101010101ULL) & 0x0102040810204080ULL) + 0x7f7f7f7f7f7f7f7fULL) >> 7 & 0x0101010101010101ULL)
+/* 8 bits of a line mask starting at bit x, and OR them back in; the masks
+ * are offset by 8 pixels so sprites hanging off the left edge fit */
+#define LINE_MASK_WORDS         ((SCREEN_WIDTH + 8) / 32 + 2)
+#define LINE_MASK_GET(mask, x)  \
+    ((uint8_t)((((uint64_t)(mask)[((x) >> 5) + 1] << 32) | (mask)[(x) >> 5]) >> ((x) & 31)))
+#define LINE_MASK_OR(mask, x, bits) do {                                 \
+        (mask)[(x) >> 5] |= (uint32_t)(bits) << ((x) & 31);              \
+        (mask)[((x) >> 5) + 1] |= ((uint64_t)(bits) << ((x) & 31)) >> 32;  \
+    } while (0)
+// tile cache index of a BG/window tile map entry
+#define BG_TILE(index)          \
+    ((gb->ppu.lcdc.bgWinTiles == 0x8000) ? (uint8_t)(index) : 256 + (int8_t)(index))
+// where line LY is drawn, the back buffer or the scaler (and line ring) input
+#define PPU_LINE(gb)                                                \
+    (((gb)->scaler.mode != SCALER_OFF || (gb)->lineRing) ?         \
+        (gb)->scaler.line : (gb)->backBufferPtr + (gb)->ppu.ly * SCREEN_WIDTH)
+#define PPU_LINE_DIRTY(gb, y)   ((gb)->ppu.dirtyLines[(y) / 32] & (1U << ((y) % 32)))
+
+/* mark the lines OAM entry sprite is on, or none if its X is 0 */
+void ppu_oam_bin(struct gb *gb, int sprite)
+{
+    uint64_t bit = 1ULL << sprite;
+    int top = gb->oam[sprite * 4] - 16;
+
+    for (int ly = 0; ly < SCREEN_HEIGHT; ly++)
+        gb->ppu.lineSprites[ly] &= ~bit;
+    if (!gb->oam[sprite * 4 + 1])
+        return;
+    for (int ly = (top < 0) ? 0 : top; ly < top + gb->ppu.lcdc.objSize && ly < SCREEN_HEIGHT; ly++)
+        gb->ppu.lineSprites[ly] |= bit;
+}
+
+// after OAM DMA or a sprite size change
+void ppu_oam_bin_all(struct gb *gb)
+{
+    for (int i = 0; i < 40; i++)
+        ppu_oam_bin(gb, i);
+}
+
+/* pick the first 10 sprites of the line in OAM order and insert each one
+ * after those with a smaller or equal X, so on equal X the lower OAM index
+ * comes first and is drawn on top */
+void ppu_oam_scan(struct gb *gb)
+{
+    uint64_t sprites = gb->ppu.lineSprites[gb->ppu.ly];
+    struct oam_entry *entry = gb->ppu.oamEntry;
+    int n = 0, i, j;
+
+    while (sprites && n < 10) {
+        i = __builtin_ctzll(sprites);
+        sprites &= sprites - 1;
+        for (j = n; j > 0 && entry[j - 1].x > gb->oam[i * 4 + 1]; j--)
+            entry[j] = entry[j - 1];
+        entry[j].y = gb->oam[i * 4];
+        entry[j].x = gb->oam[i * 4 + 1];
+        entry[j].tileIndex = gb->oam[i * 4 + 2];
+        entry[j].attributes.val = gb->oam[i * 4 + 3];
+        n++;
+    }
+    gb->ppu.oamEntryCounter = n;
+}
+
+/* the color IDs of one row of a tile, decoded again if VRAM changed it */
+const uint8_t *ppu_tile_row(struct gb *gb, int tile, int row)
+{
+    struct tile_cache *cache = &gb->tileCache;
+    uint8_t *pixels = cache->pixels[tile][row];
+    uint8_t lo, hi;
+    uint64_t expanded;
+
+    if (!(cache->dirty[tile] & (1 << row))) {
+        cache->hits++;
+        return pixels;
+    }
+    lo = gb->vRAM[tile * 16 + row * 2];
+    hi = gb->vRAM[tile * 16 + row * 2 + 1];
+    expanded = TILE_ROW_EXPAND(lo) | TILE_ROW_EXPAND(hi) << 1;
+    memcpy(pixels, &expanded, 8);
+    cache->dirty[tile] &= ~(1 << row);
+    cache->misses++;
+    return pixels;
+}
+
+/* resolve the 4 shades of a palette register to RGB565 of the selected set */
+void ppu_palette_update(struct gb *gb, palette_t which)
+{
+    const uint16_t *shades = paletteSets[gb->ppu.paletteSet];
+
+    for (int i = 0; i < 4; i++)
+        gb->ppu.palRGB[which][i] = shades[GET_COLOR_ID(which, i)];
+}
+
+void ppu_set_palette_set(struct gb *gb, palette_set_t set)
+{
+    gb->ppu.paletteSet = (set < PALETTE_SET_COUNT) ? set : PALETTE_SET_ILI9225;
+    ppu_palette_update(gb, BGP);
+    ppu_palette_update(gb, OBP0);
+    ppu_palette_update(gb, OBP1);
+}
+
+/* bit k set if the k-th pixel from the left of a decoded tile row is not
+ * color 0: fold each color ID onto bit 0 of its byte, then gather the 8
+ * bytes into one with a multiply (the other constant reverses the order) */
+uint8_t ppu_row_opaque(const uint8_t *row, bool xFlip)
+{
+    uint64_t pixels;
+
+    memcpy(&pixels, row, 8);
+    pixels = (pixels | pixels >> 1) & 0x0101010101010101ULL;
+    return (pixels * (xFlip ? 0x8040201008040201ULL : 0x0102040810204080ULL)) >> 56;
+}
+
+#ifdef GBDARM_BG_SURFACE
+// mark the cells showing a tile whose data was written since the last check
+void ppu_surface_check_tiles(struct gb *gb)
+{
+    struct bg_surface *surface = &gb->bgSurface;
+
+    for (int map = 0; map < 2; map++) {
+        for (int cell = 0; cell < 1024; cell++)
+            surface->dirty[map][cell] |= surface->pendingTiles[BG_TILE(gb->vRAM[0x1800 + map * 0x400 + cell])];
+    }
+    memset(surface->pendingTiles, 0, sizeof(surface->pendingTiles));
+    surface->tilesPending = false;
+}
+
+/* line y of a tile map, with the cells covering pixels x to x + n - 1
+ * (wrapping at 256) rendered first if they are dirty */
+const uint8_t *ppu_surface_row(struct gb *gb, uint16_t tileMap, uint8_t y, uint8_t x, int n)
+{
+    struct bg_surface *surface = &gb->bgSurface;
+    int map = (tileMap >> 10) & 1;
+    uint8_t *dirty = surface->dirty[map] + 32 * (y / 8);
+    uint8_t *ids = surface->ids[map][y];
+    uint8_t tileIndex;
+
+    if (surface->tilesPending)
+        ppu_surface_check_tiles(gb);
+    for (int cell = x / 8, last = x / 8 + (x % 8 + n + 7) / 8; cell < last; cell++) {
+        if (dirty[cell % 32] & (1 << (y % 8))) {
+            tileIndex = READ_vRAM(tileMap + 32 * (y / 8) + cell % 32);
+            memcpy(ids + 8 * (cell % 32), ppu_tile_row(gb, BG_TILE(tileIndex), y % 8), 8);
+            dirty[cell % 32] &= ~(1 << (y % 8));
+        }
+    }
+    return ids;
+}
+
+// n pixels of a map line from x on to the back buffer line from i on
+void ppu_surface_copy(struct gb *gb, const uint8_t *ids, uint8_t x, int i, int n, uint32_t *bgOpaque)
+{
+    uint16_t *line = PPU_LINE(gb) + i;
+    const uint16_t *bgRGB = gb->ppu.palRGB[BGP];
+    uint8_t buf[SCREEN_WIDTH + 8];
+    int first = (n < 256 - x) ? n : 256 - x;
+
+    memcpy(buf, ids + x, first);
+    memcpy(buf + first, ids, n - first);
+    for (int k = 0; k < n; k++)
+        line[k] = bgRGB[buf[k]];
+    for (int k = 0; k < n; k += 8)
+        LINE_MASK_OR(bgOpaque, i + k + 8, ppu_row_opaque(buf + k, false) & ((n - k < 8) ? (1 << (n - k)) - 1 : 0xff));
+}
+#endif
+
+void ppu_draw_scanline(struct gb *gb)
+{
+    uint8_t tileIndex, offsetY, yPos, nonWindowRange, opaque, draw;
+    uint16_t *line = PPU_LINE(gb);
+    const uint16_t *objRGB;
+    const uint8_t *row;
+#ifndef GBDARM_BG_SURFACE
+    uint8_t offsetX;
+    uint16_t mapRow;
+    const uint16_t *bgRGB = gb->ppu.palRGB[BGP];
+#endif
+    int k, start;
+    // bit X + 8 of the line: BG/window color is not 0, a sprite was drawn there
+    uint32_t bgOpaque[LINE_MASK_WORDS] = {0}, objDrawn[LINE_MASK_WORDS] = {0};
+
+    // if LCDC bit 0 is disabled, no rendering bg and window
+    if (!gb->ppu.lcdc.bgWinEnable)
+        goto sprite;
+
+    // we deal with window first, one tile row of 8 pixels at a time
+    gb->ppu.drawWindowThisLine = gb->ppu.lcdc.winEnable && gb->ppu.windowInFrame && (IN_RANGE(gb->ppu.wx - 7, -6, 159));
+#ifdef GBDARM_BG_SURFACE
+    if (gb->ppu.drawWindowThisLine) {
+        start = (gb->ppu.wx < 7) ? 0 : gb->ppu.wx - 7;
+        row = ppu_surface_row(gb, gb->ppu.lcdc.winTileMap, gb->ppu.windowLineCounter, 0, SCREEN_WIDTH - start);
+        ppu_surface_copy(gb, row, 0, start, SCREEN_WIDTH - start, bgOpaque);
+    }
+#else
+    if (gb->ppu.drawWindowThisLine) {
+        mapRow = 32 * (gb->ppu.windowLineCounter / 8);
+        for (int i = (gb->ppu.wx < 7) ? 0 : gb->ppu.wx - 7, tile = 0; i < SCREEN_WIDTH; tile++) {
+            tileIndex = READ_vRAM(gb->ppu.lcdc.winTileMap + ((mapRow + tile) & 0x3ff));
+            row = ppu_tile_row(gb, BG_TILE(tileIndex), gb->ppu.windowLineCounter % 8);
+            // the last tile is cut off at the right edge of the screen
+            start = i;
+            for (int x = 0; x < 8 && i < SCREEN_WIDTH; x++, i++)
+                line[i] = bgRGB[row[x]];
+            LINE_MASK_OR(bgOpaque, start + 8, ppu_row_opaque(row, false) & ((1 << (i - start)) - 1));
+        }
+    }
+#endif
+
+    // then come to background
+    if (gb->ppu.drawWindowThisLine) {
+        nonWindowRange = ((gb->ppu.wx - 7) < 0) ? 0 : gb->ppu.wx - 7;
+    } else {
+        nonWindowRange = SCREEN_WIDTH;
+    }
+    offsetY = (gb->ppu.ly + gb->ppu.scy) & 0xff;
+#ifdef GBDARM_BG_SURFACE
+    if (nonWindowRange) {
+        row = ppu_surface_row(gb, gb->ppu.lcdc.bgTileMap, offsetY, gb->ppu.scx, nonWindowRange);
+        ppu_surface_copy(gb, row, gb->ppu.scx, 0, nonWindowRange, bgOpaque);
+    }
+#else
+    mapRow = 32 * (offsetY / 8);
+    offsetX = gb->ppu.scx;
+    for (int i = 0; i < nonWindowRange; ) {
+        tileIndex = READ_vRAM(gb->ppu.lcdc.bgTileMap + ((mapRow + offsetX / 8) & 0x3ff));
+        row = ppu_tile_row(gb, BG_TILE(tileIndex), offsetY % 8);
+        // the first tile starts SCX % 8 pixels in, the last one stops at the window
+        start = i;
+        for (int x = offsetX % 8; x < 8 && i < nonWindowRange; x++, i++)
+            line[i] = bgRGB[row[x]];
+        LINE_MASK_OR(bgOpaque, start + 8, (ppu_row_opaque(row, false) >> (offsetX % 8)) & ((1 << (i - start)) - 1));
+        offsetX = (offsetX & ~7) + 8;  // wraps around the 256 pixel map
+    }
+#endif
+
+sprite:
+    // finally, sprite, from the lowest priority up so later ones overwrite
+    if (!gb->ppu.lcdc.objEnable || !gb->ppu.oamEntryCounter)
+        return;
+    for (int i = gb->ppu.oamEntryCounter - 1; i >= 0; i--) {
+        struct oam_entry *entry = &gb->ppu.oamEntry[i];
+
+        if (entry->x >= SCREEN_WIDTH + 8)
+            continue;
+        tileIndex = entry->tileIndex;
+        yPos = (gb->ppu.ly - (entry->y - 16)) % 16;
+        if (gb->ppu.lcdc.objSize == 16 && yPos >= 8)  // bottom
+            tileIndex = (entry->attributes.yFlip) ?  tileIndex & 0xfe : tileIndex | 0x01;
+        else if (gb->ppu.lcdc.objSize == 16 && yPos <= 7) // top
+            tileIndex = (entry->attributes.yFlip) ?  tileIndex | 0x01 : tileIndex & 0xfe;
+        row = ppu_tile_row(gb, tileIndex, (!entry->attributes.yFlip) ? (yPos % 8) : 7 - (yPos % 8));
+
+        // bit k of opaque is the k-th pixel from the left, sprite X - 8 + k
+        opaque = ppu_row_opaque(row, entry->attributes.xFlip);
+        if (entry->x < 8)
+            opaque &= 0xff << (8 - entry->x);
+        else if (entry->x > SCREEN_WIDTH)
+            opaque &= 0xff >> (entry->x - SCREEN_WIDTH);
+
+        // a sprite behind BG/window only shows over color 0, or over a sprite
+        draw = opaque;
+        if (entry->attributes.priority)
+            draw &= ~LINE_MASK_GET(bgOpaque, entry->x) | LINE_MASK_GET(objDrawn, entry->x);
+        LINE_MASK_OR(objDrawn, entry->x, draw);
+
+        objRGB = gb->ppu.palRGB[entry->attributes.dmgPalette];
+        while (draw) {
+            k = __builtin_ctz(draw);
+            draw &= draw - 1;
+            line[entry->x - 8 + k] = objRGB[row[(entry->attributes.xFlip) ? 7 - k : k]];
+        }
+    }
+}
+
+/* hash the line just drawn and mark it dirty if it differs from the last
+ * frame, so the host only has to send the lines that changed */
+void ppu_line_check_dirty(struct gb *gb)
+{
+    const uint16_t *line = PPU_LINE(gb);
+    uint32_t hash = 2166136261U;
+
+    for (int i = 0; i < SCREEN_WIDTH; i += 2)
+        hash = (hash ^ (line[i] | (uint32_t)line[i + 1] << 16)) * 16777619U;
+    if (hash != gb->ppu.lineHash[gb->ppu.ly]) {
+        gb->ppu.lineHash[gb->ppu.ly] = hash;
+        gb->ppu.dirtyLines[gb->ppu.ly / 32] |= 1U << (gb->ppu.ly % 32);
+    }
+}
+
+/* the lines set in DIRTY_LINE_WORDS of bits as up to max runs, the last one
+ * stretched over whatever did not fit; it is cleared afterwards */
+int ppu_line_spans(uint32_t *lines, struct line_span *spans, int max)
+{
+    int n = 0;
+
+    for (int ly = 0; ly < SCREEN_HEIGHT; ly++) {
+        if (!(lines[ly / 32] & (1U << (ly % 32))))
+            continue;
+        if (n > 0 && (spans[n - 1].first + spans[n - 1].count == ly || n == max)) {
+            spans[n - 1].count = ly + 1 - spans[n - 1].first;
+        } else {
+            spans[n].first = ly;
+            spans[n].count = 1;
+            n++;
+        }
+    }
+    memset(lines, 0, DIRTY_LINE_WORDS * sizeof(uint32_t));
+    return n;
+}
+
+// the dirty lines as runs, they are clean again afterwards
+int ppu_take_dirty_spans(struct gb *gb, struct line_span *spans, int max)
+{
+    return ppu_line_spans(gb->ppu.dirtyLines, spans, max);
+}
+
+/* output pixel i of n over m source pixels, in 1/32 pixel; the left tap is
+ * kept inside so the right one is too */
+static void scaler_map(int i, int n, int m, uint8_t *src, uint8_t *weight)
+{
+    int pos = (2 * i + 1) * m * 16 / n - 16;
+
+    if (pos < 0)
+        pos = 0;
+    if (pos > (m - 1) * 32)
+        pos = (m - 1) * 32;
+    *src = (pos < (m - 1) * 32) ? pos / 32 : m - 2;
+    *weight = pos - *src * 32;
+}
+
+// build the row and column maps for gb->scaler.mode
+void scaler_init(struct gb *gb)
+{
+    struct scaler *scaler = &gb->scaler;
+    int y;
+
+    for (int i = 0; i < SCALED_LINE_LENGTH; i++) {
+        if (scaler->mode == SCALER_BLEND) {
+            scaler_map(i, SCALED_LINE_LENGTH, SCREEN_WIDTH, &scaler->srcX[i], &scaler->weightX[i]);
+        } else {
+            scaler->srcX[i] = (2 * i + 1) * SCREEN_WIDTH / (2 * SCALED_LINE_LENGTH);
+            scaler->weightX[i] = 0;
+        }
+    }
+    memset(scaler->outFirst, 0xff, sizeof(scaler->outFirst));
+    memset(scaler->outLast, 0, sizeof(scaler->outLast));
+    for (int i = 0; i < SCALED_LINES; i++) {
+        if (scaler->mode == SCALER_BLEND) {
+            scaler_map(i, SCALED_LINES, SCREEN_HEIGHT, &scaler->srcY[i], &scaler->weightY[i]);
+        } else {
+            scaler->srcY[i] = (2 * i + 1) * SCREEN_HEIGHT / (2 * SCALED_LINES);
+            scaler->weightY[i] = 0;
+        }
+        scaler->readyY[i] = scaler->srcY[i] + (scaler->weightY[i] > 0);
+        // the source lines with a non-zero weight in output line i
+        for (y = scaler->srcY[i] + (scaler->weightY[i] == 32); y <= scaler->readyY[i]; y++) {
+            if (scaler->outFirst[y] > i)
+                scaler->outFirst[y] = i;
+            scaler->outLast[y] = i;
+        }
+    }
+    scaler->next = 0;
+}
+
+/* take line LY from the PPU and make the output lines it completes */
+void scaler_line(struct gb *gb)
+{
+    struct scaler *scaler = &gb->scaler;
+    const uint16_t *line = scaler->line;
+    const uint32_t *upper, *lower;
+    uint32_t *row;
+    uint16_t *out;
+    int ly = gb->ppu.ly, w;
+
+    if (ly == 0)
+        scaler->next = 0;
+    if (scaler->mode == SCALER_BLEND) {
+        row = scaler->rows[ly & 1];
+        for (int i = 0; i < SCALED_LINE_LENGTH; i++) {
+            w = scaler->weightX[i];
+            row[i] = RGB565_BLEND(RGB565_EXPAND(line[scaler->srcX[i]]), RGB565_EXPAND(line[scaler->srcX[i] + 1]), w);
+        }
+    }
+    for (; scaler->next < SCALED_LINES && scaler->readyY[scaler->next] <= ly; scaler->next++) {
+        if (gb->lineRing) {
+            // only lines made from a changed source line are sent
+            if (!PPU_LINE_DIRTY(gb, scaler->srcY[scaler->next] + (scaler->weightY[scaler->next] == 32)) &&
+                !PPU_LINE_DIRTY(gb, scaler->readyY[scaler->next]))
+                continue;
+            out = line_ring_slot(gb->lineRing, scaler->next);
+        } else {
+            out = gb->backBufferPtr + scaler->next * SCALED_LINE_LENGTH;
+        }
+        if (scaler->mode == SCALER_NEAREST) {
+            for (int i = 0; i < SCALED_LINE_LENGTH; i++)
+                out[i] = line[scaler->srcX[i]];
+        } else {
+            upper = scaler->rows[scaler->srcY[scaler->next] & 1];
+            lower = scaler->rows[(scaler->srcY[scaler->next] + 1) & 1];
+            w = scaler->weightY[scaler->next];
+            for (int i = 0; i < SCALED_LINE_LENGTH; i++)
+                out[i] = RGB565_PACK(RGB565_BLEND(upper[i], lower[i], w));
+        }
+        if (gb->lineRing)
+            line_ring_commit(gb->lineRing);
     }
+}
 
-    /* timer handling */
-    gb->timer.div += gb->executedCycle;
-    if ((gb->timer.div >= timerClockFrequency[gb->timer.tac.freq]) && (gb->timer.tac.enable)) {
-        gb->timer.div -= timerClockFrequency[gb->timer.tac.freq];
-        if (gb->timer.tima == 0xff) {
-            INTERRUPT_REQUEST(INTERRUPT_SRC_TIMER);
-        }
-        gb->timer.tima = (gb->timer.tima == 0xff) ? gb->timer.tma : gb->timer.tima + 1;
+/* the slot for the next line to push, once the consumer has freed one */
+uint16_t *line_ring_slot(struct line_ring *ring, uint8_t lineNumber)
+{
+    uint32_t head = ring->head;
+
+    while (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LINE_RING_SLOTS) {
+        if (ring->wait)
+            ring->wait(ring);
     }
+    ring->lineNumbers[head % LINE_RING_SLOTS] = lineNumber;
+    return ring->pixels + head % LINE_RING_SLOTS * ring->lineLength;
+}
 
-    /* oam dma handling */
-    if (gb->dma.mode != OFF) {
-        gb->dma.tick += gb->executedCycle;
-        if (gb->dma.tick >= 1 && gb->dma.mode == WAITING) {
-            gb->dma.tick -= 1;
-            gb->dma.mode = TRANSFERING;
-        } else if (gb->dma.tick >= 160 && gb->dma.mode == TRANSFERING) {
-            for (int i = 0; i < 160; i++) {
-                uint8_t transfer_val = bus_read(gb, gb->dma.startAddr + i);
-                gb->oam[i] = transfer_val;
-            }
-            gb->dma.mode = OFF;
+// publish the slot filled in, and have it sent once a block is waiting
+void line_ring_commit(struct line_ring *ring)
+{
+    uint32_t head = ring->head + 1;
+
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LINE_RING_BLOCK && ring->kick)
+        ring->kick(ring);
+}
+
+// have whatever is waiting sent, at the end of a frame
+void line_ring_flush(struct line_ring *ring)
+{
+    if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != ring->tail && ring->kick)
+        ring->kick(ring);
+}
+
+/* consumer side: the oldest run of up to LINE_RING_BLOCK pushed lines that
+ * are consecutive both on the display and in the ring; they stay put until
+ * line_ring_release() */
+int line_ring_peek(struct line_ring *ring, uint16_t **pixels, uint8_t *first)
+{
+    uint32_t tail = ring->tail, head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    int slot = tail % LINE_RING_SLOTS, n = 0;
+
+    while (tail + n != head && n < LINE_RING_BLOCK && slot + n < LINE_RING_SLOTS &&
+           ring->lineNumbers[slot + n] == ring->lineNumbers[slot] + n)
+        n++;
+    *pixels = ring->pixels + slot * ring->lineLength;
+    *first = ring->lineNumbers[slot];
+    return n;
+}
+
+// the oldest count lines are sent, their slots can be reused
+void line_ring_release(struct line_ring *ring, int count)
+{
+    __atomic_store_n(&ring->tail, ring->tail + count, __ATOMIC_RELEASE);
+}
+
+// push the line just drawn to the line ring if it changed
+void ppu_line_push(struct gb *gb)
+{
+    if (!PPU_LINE_DIRTY(gb, gb->ppu.ly))
+        return;
+    memcpy(line_ring_slot(gb->lineRing, gb->ppu.ly), gb->scaler.line, sizeof(gb->scaler.line));
+    line_ring_commit(gb->lineRing);
+}
+
+/* turn spans of source lines into spans of the output lines made from them,
+ * in place; neighbouring spans can share an output line and are merged */
+int scaler_map_spans(struct gb *gb, struct line_span *spans, int count)
+{
+    int n = 0, first, last;
+
+    if (gb->scaler.mode == SCALER_OFF)
+        return count;
+    for (int i = 0; i < count; i++) {
+        first = gb->scaler.outFirst[spans[i].first];
+        last = gb->scaler.outLast[spans[i].first + spans[i].count - 1];
+        if (n > 0 && spans[n - 1].first + spans[n - 1].count >= first) {
+            spans[n - 1].count = last + 1 - spans[n - 1].first;
+        } else {
+            spans[n].first = first;
+            spans[n].count = last + 1 - first;
+            n++;
         }
     }
+    return n;
+}
+
+void ppu_check_stat_intr(struct gb *gb)
+{
+    bool statIntrLine = 0;
+
+    statIntrLine = ((gb->ppu.stat.mode0IntrSelect && gb->ppu.stat.ppuMode == HBLANK) ||
+        (gb->ppu.stat.mode1IntrSelect && gb->ppu.stat.ppuMode == VBLANK) ||
+        (gb->ppu.stat.mode2IntrSelect && gb->ppu.stat.ppuMode == OAM_SCAN) || 
+        (gb->ppu.stat.lycIntrSelect && gb->ppu.stat.lycEqualLy));
+    if (!gb->ppu.statIntrLine && statIntrLine) {
+        INTERRUPT_REQUEST(INTERRUPT_SRC_LCD);
+    }
+    gb->ppu.statIntrLine = statIntrLine;
+}
+
+/* M-cycles until ticks passes the next mode boundary or the end of the line */
+int ppu_cycles_to_event(struct gb *gb)
+{
+    int boundary;
+
+    if (gb->ppu.ly > 143 || gb->ppu.ticks > 252)
+        boundary = 456;
+    else if (gb->ppu.ticks > 80)
+        boundary = 252;
+    else
+        boundary = 80;
+    return (boundary - gb->ppu.ticks) / 4 + 1;
+}
+
+/* returns false while the LCD is off */
+bool ppu_tick(struct gb *gb)
+{
+    ppu_mode_t mode;
+    int elapsed = sched_elapsed(gb, EVENT_PPU);
 
-    /* ppu handling */
     if (!gb->ppu.lcdc.ppuEnable) {
-        return;
+        gb->sched.deadline[EVENT_PPU] = EVENT_NEVER;
+        return false;
     }
-    gb->ppu.ticks += gb->executedCycle * 4;
+    gb->ppu.ticks += elapsed * 4;
     if (gb->ppu.ly <= 143) {
-        if (gb->ppu.ticks <= 80 && gb->ppu.mode != OAM_SCAN) {
-            SET_MODE(OAM_SCAN);
-        } else if (gb->ppu.ticks <= 252 && gb->ppu.mode != DRAWING) {
-            SET_MODE(DRAWING);
-        } else if (gb->ppu.ticks <= 456 && gb->ppu.mode != HBLANK) {
-            SET_MODE(HBLANK);
+        mode = (gb->ppu.ticks <= 80) ? OAM_SCAN : (gb->ppu.ticks <= 252) ? DRAWING : HBLANK;
+        if (gb->ppu.mode != mode) {
+            SET_MODE(mode);
         }
     }
     if (gb->ppu.ticks > 456) {
         gb->ppu.scanLineReady = true;
         gb->ppu.ticks -= 456;
         if (gb->ppu.ly <= 143) {
-            // ppu_oam_scan
-            if (gb->ppu.lcdc.objEnable) {
-                for (int i = 0; i < 40; i++) {
-                    if (gb->oam[i * 4 + 1] > 0 && gb->ppu.oamEntryCounter < 10 &&
-                        IN_RANGE(gb->ppu.ly, gb->oam[i * 4] - 16, gb->oam[i * 4] - 17 + gb->ppu.lcdc.objSize)) {
-                        gb->ppu.oamEntry[gb->ppu.oamEntryCounter].y = gb->oam[i * 4];
-                        gb->ppu.oamEntry[gb->ppu.oamEntryCounter].x = gb->oam[i * 4 + 1];
-                        gb->ppu.oamEntry[gb->ppu.oamEntryCounter].tileIndex = gb->oam[i * 4 + 2];
-                        gb->ppu.oamEntry[gb->ppu.oamEntryCounter].attributes.val = gb->oam[i * 4 + 3];
-                        gb->ppu.oamEntryCounter++;
-                    }
-                    if (gb->ppu.oamEntryCounter == 10)
-                        break;
-                }
+            // draw the scanline, unless the frame is skipped
+            if (!gb->frameSkip.skipping) {
+                if (gb->ppu.lcdc.objEnable)
+                    ppu_oam_scan(gb);
+                ppu_draw_scanline(gb);
+                ppu_line_check_dirty(gb);
+                if (gb->scaler.mode != SCALER_OFF)
+                    scaler_line(gb);
+                else if (gb->lineRing)
+                    ppu_line_push(gb);
             }
-            qsort(gb->ppu.oamEntry, gb->ppu.oamEntryCounter, sizeof(struct oam_entry), cmpfunc);
-
-            // draw the scanline
-            ppu_draw_scanline(gb);
             SET_MODE(HBLANK);
         }
 
@@ -1641,6 +2159,21 @@ void cpu_step(struct gb *gb)
                     INTERRUPT_REQUEST(INTERRUPT_SRC_VBLANK);
                 }
                 gb->ppu.frameReady = true;
+                // the ring took the changed lines as they were drawn
+                if (gb->lineRing && !gb->frameSkip.skipping) {
+                    line_ring_flush(gb->lineRing);
+                    memset(gb->ppu.dirtyLines, 0, sizeof(gb->ppu.dirtyLines));
+                }
+                gb->frameSkip.drawn = !gb->frameSkip.skipping;
+                if (gb->frameSkip.skipping)
+                    gb->frameSkip.skipped++;
+                // headless, each drawn frame has to be asked for again
+                if (gb->frameSkip.ratio == FRAMESKIP_HEADLESS)
+                    gb->frameSkip.skipping = true;
+                gb->sched.frameHaltSkipped = gb->sched.haltSkipped;
+                gb->sched.haltSkipped = 0;
+                gb->sched.frameIdleSkipped = gb->sched.idleSkipped;
+                gb->sched.idleSkipped = 0;
                 gb->ppu.windowLineCounter = 0;
                 gb->ppu.drawWindowThisLine = false;
                 gb->ppu.windowInFrame = false;
@@ -1670,137 +2203,10 @@ void cpu_step(struct gb *gb)
         }
         gb->ppu.scanLineReady = true;
     }
-    if (gb->interrupt.ie & INTERRUPT_SRC_LCD) {
-        statIntrLine = ((gb->ppu.stat.mode0IntrSelect && gb->ppu.stat.ppuMode == HBLANK) ||
-        (gb->ppu.stat.mode1IntrSelect && gb->ppu.stat.ppuMode == VBLANK) ||
-        (gb->ppu.stat.mode2IntrSelect && gb->ppu.stat.ppuMode == OAM_SCAN) || 
-        (gb->ppu.stat.lycIntrSelect && gb->ppu.stat.lycEqualLy));
-        if (!gb->ppu.statIntrLine && statIntrLine)
-            INTERRUPT_REQUEST(INTERRUPT_SRC_LCD);
-        gb->ppu.statIntrLine = statIntrLine;
-    }
-
-    interrupt_process(gb);
-}
-
-/**********************************************************************************************/
-/************************************* PPU related parts **************************************/
-/**********************************************************************************************/
-
-#define GET_COLOR(lo, hi)        \
-    ((lo) | ((hi) << 1))
-#define GET_COLOR_ID(which_pal, color_id)       \
-    (gb->ppu.pal[which_pal] >> ((color_id) * 2)) & 0x03
-#define READ_vRAM(addr)         \
-    gb->vRAM[addr - 0x8000]
-
-int cmpfunc(const void *a, const void *b)
-{
-    struct oam_entry *sa = (struct oam_entry *)a;
-    struct oam_entry *sb = (struct oam_entry *)b;
-
-    return (sa->x - sb->x);
-}
-
-void ppu_draw_scanline(struct gb *gb)
-{
-    uint8_t tileIndex, colorIDLow, colorIDHigh, offsetX, offsetY, xPos, yPos, 
-            windowOffset, nonWindowRange, colorID[SCREEN_WIDTH], color[SCREEN_WIDTH] = {0};
-    uint16_t tile_map_addr, tile_addr;
-    bool pixel_type[SCREEN_WIDTH] = {0};
-
-    // if LCDC bit 0 is disabled, no rendering bg and window
-    if (!gb->ppu.lcdc.bgWinEnable)
-        goto sprite;
-
-    // we deal with window first
-    windowOffset = 0;
-    gb->ppu.drawWindowThisLine = gb->ppu.lcdc.winEnable && gb->ppu.windowInFrame && (IN_RANGE(gb->ppu.wx - 7, -6, 159));
-    if (gb->ppu.drawWindowThisLine) {
-        for (int i = gb->ppu.wx - 7; i < SCREEN_WIDTH; i++) {
-            if (i < 0)
-                continue;
-            if ((windowOffset % 8) == 0) {
-                tileIndex = bus_read(gb, gb->ppu.lcdc.winTileMap + ((windowOffset / 8 + 32 * (gb->ppu.windowLineCounter / 8)) & 0x3ff));
-                tile_addr = (gb->ppu.lcdc.bgWinTiles == 0x8000) ? 0x8000 + 16 * (uint8_t)tileIndex : 0x8800 + 16 * ((tileIndex + 0x80) % 0x100);
-            }
-            colorIDLow = (bus_read(gb, tile_addr + (gb->ppu.windowLineCounter % 8) * 2) >> (7 - (windowOffset % 8))) & 0x01;
-            colorIDHigh = (bus_read(gb, tile_addr + (gb->ppu.windowLineCounter % 8) * 2 + 1) >> (7 - (windowOffset % 8))) & 0x01;
-            colorID[i] = colorIDLow | (colorIDHigh << 1);
-            color[i] = GET_COLOR_ID(BGP, colorIDLow | (colorIDHigh << 1));
-            // gb->backBufferPtr[i + gb->ppu.ly * LCD_HEIGHT] = ili9225Palette[GET_COLOR_ID(BGP, colorID[i])];
-            gb->backBufferPtr[i + gb->ppu.ly * SCREEN_WIDTH] = ili9225Palette[GET_COLOR_ID(BGP, colorID[i])];
-            windowOffset++;
-        }
-        windowOffset = 0;
-    }
-
-    // then come to background
-    nonWindowRange = (gb->ppu.drawWindowThisLine) ? gb->ppu.wx - 7 : SCREEN_WIDTH;
-    if (gb->ppu.drawWindowThisLine) {
-        nonWindowRange = ((gb->ppu.wx - 7) < 0) ? 0 : gb->ppu.wx - 7;
-    } else {
-        nonWindowRange = SCREEN_WIDTH;
-    }
-    offsetY = (gb->ppu.ly + gb->ppu.scy) & 0xff;
-    for (int i = 0; i < nonWindowRange; i++) {
-        offsetX = (i + gb->ppu.scx) & 0xff;
-        tileIndex = bus_read(gb, gb->ppu.lcdc.bgTileMap + ((offsetX / 8 + 32 * (offsetY / 8)) & 0x3ff));
-        tile_addr = (gb->ppu.lcdc.bgWinTiles == 0x8000)
-                        ? 0x8000 + 16 * (uint8_t)tileIndex : 0x8800 + 16 * ((tileIndex + 0x80) % 0x100);
-        colorIDLow = (bus_read(gb, tile_addr + (offsetY % 8) * 2) >> (7 - (offsetX % 8))) & 0x01;
-        colorIDHigh = (bus_read(gb, tile_addr + (offsetY % 8) * 2 + 1) >> (7 - (offsetX % 8))) & 0x01;
-        colorID[i] = colorIDLow | (colorIDHigh << 1);
-        color[i] = GET_COLOR_ID(BGP, colorID[i]);
-        // gb->backBufferPtr[i + gb->ppu.ly * LCD_HEIGHT] = ili9225Palette[GET_COLOR_ID(BGP, colorID[i])];
-        gb->backBufferPtr[i + gb->ppu.ly * SCREEN_WIDTH] = ili9225Palette[GET_COLOR_ID(BGP, colorID[i])];
-    }
-
-sprite:
-    // finally, sprite
-    if (!gb->ppu.lcdc.objEnable || !gb->ppu.oamEntryCounter)
-        return;
-    for (int i = gb->ppu.oamEntryCounter - 1; i >= 0; i--) {
-        tileIndex = gb->ppu.oamEntry[i].tileIndex;
-        yPos = (gb->ppu.ly - (gb->ppu.oamEntry[i].y - 16)) % 16;
-        offsetY = (!gb->ppu.oamEntry[i].attributes.yFlip) ? yPos : gb->ppu.lcdc.objSize - 1 - (yPos);
-        if (gb->ppu.lcdc.objSize == 16 && yPos >= 8)  // bottom
-            tileIndex = (gb->ppu.oamEntry[i].attributes.yFlip) ?  tileIndex & 0xfe : tileIndex | 0x01;
-        else if (gb->ppu.lcdc.objSize == 16 && yPos <= 7) // top
-            tileIndex = (gb->ppu.oamEntry[i].attributes.yFlip) ?  tileIndex | 0x01 : tileIndex & 0xfe;
-        tile_addr = 0x8000 + 16 * (uint8_t)tileIndex;
-        uint8_t test = (!gb->ppu.oamEntry[i].attributes.yFlip) ? (yPos % 8) : 7 - (yPos % 8);
-        for (int j = gb->ppu.oamEntry[i].x - 8; j <= gb->ppu.oamEntry[i].x; j++) {
-            if (j > 159 || j < 0)
-                continue;
-            offsetX = (gb->ppu.oamEntry[i].attributes.xFlip) ? (j - (gb->ppu.oamEntry[i].x - 8)) : 7 - (j - (gb->ppu.oamEntry[i].x - 8));
-            colorIDLow = (READ_vRAM(tile_addr + (test) * 2) >> (offsetX)) & 0x01;
-            colorIDHigh = (READ_vRAM(tile_addr + (test) * 2 + 1) >> (offsetX)) & 0x01;
-            if (((pixel_type[j] == BG_WIN) && (!GET_COLOR(colorIDLow, colorIDHigh) || (GET_COLOR(colorIDLow, colorIDHigh) > 0 && 
-                gb->ppu.oamEntry[i].attributes.priority && colorID[j] > 0))) ||
-                ((pixel_type[j] == SPRITE) && (colorID[j] > 0 && !GET_COLOR(colorIDLow, colorIDHigh))))
-                continue;
-            color[j] = GET_COLOR_ID(gb->ppu.oamEntry[i].attributes.dmgPalette, GET_COLOR(colorIDLow, colorIDHigh));
-            // gb->backBufferPtr[j + gb->ppu.ly * LCD_HEIGHT] = ili9225Palette[GET_COLOR_ID(gb->ppu.oamEntry[i].attributes.dmgPalette, GET_COLOR(colorIDLow, colorIDHigh))];
-            gb->backBufferPtr[j + gb->ppu.ly * SCREEN_WIDTH] = ili9225Palette[GET_COLOR_ID(gb->ppu.oamEntry[i].attributes.dmgPalette, GET_COLOR(colorIDLow, colorIDHigh))];
-            colorID[j] = GET_COLOR(colorIDLow, colorIDHigh);
-            pixel_type[j] = SPRITE;
-        }
-    }
-}
-
-void ppu_check_stat_intr(struct gb *gb)
-{
-    bool statIntrLine = 0;
-
-    statIntrLine = ((gb->ppu.stat.mode0IntrSelect && gb->ppu.stat.ppuMode == HBLANK) ||
-        (gb->ppu.stat.mode1IntrSelect && gb->ppu.stat.ppuMode == VBLANK) ||
-        (gb->ppu.stat.mode2IntrSelect && gb->ppu.stat.ppuMode == OAM_SCAN) || 
-        (gb->ppu.stat.lycIntrSelect && gb->ppu.stat.lycEqualLy));
-    if (!gb->ppu.statIntrLine && statIntrLine) {
-        INTERRUPT_REQUEST(INTERRUPT_SRC_LCD);
-    }
-    gb->ppu.statIntrLine = statIntrLine;
+    if (gb->interrupt.ie & INTERRUPT_SRC_LCD)
+        ppu_check_stat_intr(gb);
+    SCHEDULE_EVENT(EVENT_PPU, ppu_cycles_to_event(gb));
+    return true;
 }
 
 void interrupt_process(struct gb *gb)
@@ -1841,10 +2247,58 @@ void interrupt_process(struct gb *gb)
 }
 
 
+/**********************************************************************************************/
+/*********************************** scheduler related parts **********************************/
+/**********************************************************************************************/
+
+/* everything is due at the first instruction, which sets the real deadlines */
+void sched_init(struct gb *gb)
+{
+    memset(&gb->sched, 0, sizeof(gb->sched));
+}
+
+/* cycles since the peripheral was last brought up to date */
+int sched_elapsed(struct gb *gb, event_t event)
+{
+    int elapsed = gb->sched.cycles - gb->sched.synced[event];
+
+    gb->sched.synced[event] = gb->sched.cycles;
+    return elapsed;
+}
+
+void sched_update(struct gb *gb)
+{
+    gb->sched.nextEvent = gb->sched.deadline[0];
+    for (int i = 1; i < EVENT_COUNT; i++) {
+        if (gb->sched.deadline[i] < gb->sched.nextEvent)
+            gb->sched.nextEvent = gb->sched.deadline[i];
+    }
+}
+
 /**********************************************************************************************/
 /************************************* timer related parts ************************************/
 /**********************************************************************************************/
 
+void timer_tick(struct gb *gb)
+{
+    int freq = timerClockFrequency[gb->timer.tac.freq];
+
+    gb->timer.div += sched_elapsed(gb, EVENT_TIMER);
+    if ((gb->timer.div >= freq) && (gb->timer.tac.enable)) {
+        gb->timer.div -= freq;
+        if (gb->timer.tima == 0xff) {
+            INTERRUPT_REQUEST(INTERRUPT_SRC_TIMER);
+        }
+        gb->timer.tima = (gb->timer.tima == 0xff) ? gb->timer.tma : gb->timer.tima + 1;
+    }
+
+    // next TIMA increment; at most one per instruction, like before
+    if (!gb->timer.tac.enable)
+        gb->sched.deadline[EVENT_TIMER] = EVENT_NEVER;
+    else
+        SCHEDULE_EVENT(EVENT_TIMER, (gb->timer.div >= freq) ? 0 : freq - gb->timer.div);
+}
+
 /**********************************************************************************************/
 /********************************** cartridge related parts ***********************************/
 /**********************************************************************************************/
@@ -1909,19 +2363,121 @@ static int SRAMSizeInNumber[] = {
     0, 0, 8 * KiB, 32 * KiB, 128 * KiB, 64 * KiB
 };
 
-uint8_t mbc1_read(struct gb *gb, uint16_t addr)
+void rom_cache_init(struct rom_cache *cache, uint8_t *slots, int slotCount,
+                    bool (*fill)(struct rom_cache *cache, int bank, uint8_t *dst))
 {
+    cache->slots = slots;
+    cache->slotCount = (slotCount < ROM_CACHE_MAX_SLOTS) ? slotCount : ROM_CACHE_MAX_SLOTS;
+    memset(cache->slotBank, 0xff, sizeof(cache->slotBank));
+    memset(cache->slotUsed, 0, sizeof(cache->slotUsed));
+    memset(cache->slotPinned, 0, sizeof(cache->slotPinned));
+    memset(cache->bankSlot, 0xff, sizeof(cache->bankSlot));
+    cache->clock = 0;
+    cache->hits = cache->misses = cache->errors = 0;
+    cache->fill = fill;
+}
+
+/* the slot holding bank, filled first on a miss; NULL if it could not be
+ * read in ROM_CACHE_FILL_RETRIES tries */
+uint8_t *rom_cache_get(struct rom_cache *cache, int bank)
+{
+    int slot = cache->bankSlot[bank];
+    uint8_t *dst;
+
+    cache->clock++;
+    if (slot >= 0) {
+        cache->hits++;
+        cache->slotUsed[slot] = cache->clock;
+        return cache->slots + slot * ROM_BANK_SIZE;
+    }
+    cache->misses++;
+    // empty slots were never used, so they go first
+    for (int i = 0; i < cache->slotCount; i++) {
+        if (!cache->slotPinned[i] && (slot < 0 || cache->slotUsed[i] < cache->slotUsed[slot]))
+            slot = i;
+    }
+    if (cache->slotBank[slot] >= 0)
+        cache->bankSlot[cache->slotBank[slot]] = -1;
+    dst = cache->slots + slot * ROM_BANK_SIZE;
+    for (int i = 0; i < ROM_CACHE_FILL_RETRIES; i++) {
+        if (cache->fill(cache, bank, dst)) {
+            cache->slotUsed[slot] = cache->clock;
+            cache->slotBank[slot] = bank;
+            cache->bankSlot[bank] = slot;
+            return dst;
+        }
+        cache->errors++;
+    }
+    // empty again, and the next to go
+    cache->slotUsed[slot] = 0;
+    cache->slotBank[slot] = -1;
+    return NULL;
+}
+
+/* keep a hot bank in its slot for good; two slots always stay unpinned, so
+ * this fails once the others are */
+bool rom_cache_pin(struct rom_cache *cache, int bank)
+{
+    int pinned = 0;
+
+    for (int i = 0; i < cache->slotCount; i++)
+        pinned += cache->slotPinned[i];
+    if (pinned >= cache->slotCount - 2 || !rom_cache_get(cache, bank))
+        return false;
+    cache->slotPinned[(int)cache->bankSlot[bank]] = true;
+    return true;
+}
+
+/* base of a ROM bank for romx, through the bank cache if there is one;
+ * banks past the end of the ROM wrap like on the cartridge. A bank the cache
+ * cannot read leaves the one mapped now in place, and cache->errors tells the
+ * host. A bank still streaming in is NULL, mbc_read() waits for it. */
+uint8_t *mbc_rom_bank(struct gb *gb, int bank)
+{
+    struct rom_stream *stream = gb->cart.romStream;
+    uint8_t *base;
+
+    bank %= gb->cart.rom.bankNumber;
+    gb->mbc.romxBank = bank;
+    if (gb->cart.romCache && bank > 0) {
+        base = rom_cache_get(gb->cart.romCache, bank);
+        return (base) ? base : gb->mbc.romx;
+    }
+    if (stream && bank >= __atomic_load_n(&stream->loaded, __ATOMIC_ACQUIRE))
+        return NULL;
+    return gb->cart.rom.data + ROM_BANK_SIZE * bank;
+}
+
+/* ROM and SRAM reads that miss the page table; the bank bases are kept up to
+ * date by the map functions. The first read of a bank that was still
+ * streaming in when it was mapped waits for it and maps it. */
+uint8_t mbc_read(struct gb *gb, uint16_t addr)
+{
+    struct rom_stream *stream = gb->cart.romStream;
+
     if (IN_RANGE(addr, 0x0000, 0x3fff))
-        return gb->cart.rom.data[addr];
-    else if (IN_RANGE(addr, 0x4000, 0x7fff))
-        return gb->cart.rom.data[addr - 0x4000 + 0x4000 * (gb->mbc.mbc1.romBank & mbc1BitMask[gb->cart.rom.bankNumber])];
-    else if (IN_RANGE(addr, 0xa000, 0xbfff)) {
-        if (gb->mbc.mbc1.ramEnable)
-            return gb->cart.ram.data[addr - 0xa000 + 0x2000 * gb->mbc.mbc1.ramBank];    
+        return gb->mbc.rom0[addr];
+    if (IN_RANGE(addr, 0x4000, 0x7fff)) {
+        if (!gb->mbc.romx) {
+            if (gb->mbc.romxBank >= __atomic_load_n(&stream->loaded, __ATOMIC_ACQUIRE))
+                stream->wait(stream, gb->mbc.romxBank);
+            gb->mbc.romx = gb->cart.rom.data + ROM_BANK_SIZE * gb->mbc.romxBank;
+            mbc_map_banks(gb);
+        }
+        return gb->mbc.romx[addr - 0x4000];
     }
+    if (IN_RANGE(addr, 0xa000, 0xbfff) && gb->mbc.sram)
+        return gb->mbc.sram[addr - 0xa000];
     return 0xff;
 }
 
+/* point the switchable ROM bank and the SRAM window at the current bases */
+void mbc_map_banks(struct gb *gb)
+{
+    bus_map_pages(gb, 0x4000, 0x7fff, gb->mbc.romx, NULL);
+    bus_map_pages(gb, 0xa000, 0xbfff, gb->mbc.sram, gb->mbc.sram);
+}
+
 void mbc1_write(struct gb *gb, uint16_t addr, uint8_t val)
 {
     if (IN_RANGE(addr, 0x0000, 0x1fff))
@@ -1933,15 +2489,20 @@ void mbc1_write(struct gb *gb, uint16_t addr, uint8_t val)
     else if (IN_RANGE(addr, 0x6000, 0x7fff))
         gb->mbc.mbc1.bankingMode = BIT(val, 0);
     else if (IN_RANGE(addr, 0xa000, 0xbfff)) {
-        if (!gb->mbc.mbc1.ramEnable)
-            return;
-        gb->cart.ram.data[addr - 0xa000 + 0x2000 * gb->mbc.mbc1.ramBank] = val;
+        if (gb->mbc.sram)
+            gb->mbc.sram[addr - 0xa000] = val;
+        return;
     }
+    mbc1_map(gb);
 }
 
-uint8_t no_mbc_read(struct gb *gb, uint16_t addr)
+void mbc1_map(struct gb *gb)
 {
-    return gb->cart.rom.data[addr];
+    gb->mbc.romx = mbc_rom_bank(gb, gb->mbc.mbc1.romBank & mbc1BitMask[gb->cart.rom.bankNumber]);
+    gb->mbc.sram = NULL;
+    if (gb->cart.ram.size > 0 && gb->mbc.mbc1.ramEnable)
+        gb->mbc.sram = gb->cart.ram.data + 0x2000 * gb->mbc.mbc1.ramBank;
+    mbc_map_banks(gb);
 }
 
 void no_mbc_write(struct gb *gb, uint16_t addr, uint8_t val)
@@ -1949,22 +2510,11 @@ void no_mbc_write(struct gb *gb, uint16_t addr, uint8_t val)
 
 }
 
-uint8_t mbc3_read(struct gb *gb, uint16_t addr)
+void no_mbc_map(struct gb *gb)
 {
-    if (IN_RANGE(addr, 0x0000, 0x3fff))
-        return gb->cart.rom.data[addr];
-    else if (IN_RANGE(addr, 0x4000, 0x7fff))
-        return gb->cart.rom.data[addr - 0x4000 + 0x4000 * gb->mbc.mbc3.romBank];
-    else if (IN_RANGE(addr, 0xa000, 0xbfff)) {
-        if (gb->mbc.mbc3.ramEnable) {
-            // printf("RAM read. Addr - 0x%04x, bank: 0x%02x\n", addr, gb->mbc.mbc3.ramBank);
-            if (!gb->mbc.mbc3.ramBank)
-                return gb->cart.ram.data[addr - 0xa000];
-            else
-                return gb->cart.ram.data[addr - 0xa000 + 0x2000 * gb->mbc.mbc3.ramBank];
-        }
-    }
-    return 0xff;
+    gb->mbc.romx = mbc_rom_bank(gb, 1);
+    gb->mbc.sram = NULL;
+    mbc_map_banks(gb);
 }
 
 void mbc3_write(struct gb *gb, uint16_t addr, uint8_t val)
@@ -1976,30 +2526,85 @@ void mbc3_write(struct gb *gb, uint16_t addr, uint8_t val)
     } else if (IN_RANGE(addr, 0x4000, 0x5fff)) {
         gb->mbc.mbc3.ramBank = val;
     } else if (IN_RANGE(addr, 0xa000, 0xbfff)) {
-        if (gb->mbc.mbc3.ramEnable) {
-			// printf("RAM write. Addr - 0x%04x, val - 0x%02x, bank - %d\n", addr, val, gb->mbc.mbc3.ramBank);
-            if (!gb->mbc.mbc3.ramBank)
-                gb->cart.ram.data[addr - 0xa000] = val;
-            else
-                gb->cart.ram.data[addr - 0xa000 + 0x2000 * gb->mbc.mbc3.ramBank] = val;
-        }
+        if (gb->mbc.sram)
+            gb->mbc.sram[addr - 0xa000] = val;
+        return;
     }
+    mbc3_map(gb);
 }
 
-uint8_t (*read_func[])(struct gb *gb, uint16_t addr) = {
-    [NO_MBC] = no_mbc_read,
-    [MBC1] = mbc1_read,
-    [MBC1_RAM] = mbc1_read,
-    [MBC1_RAM_BATTERY] = mbc1_read,
-    [MBC3_RAM_BATTERY] = mbc3_read,
-};
+void mbc3_map(struct gb *gb)
+{
+    gb->mbc.romx = mbc_rom_bank(gb, gb->mbc.mbc3.romBank);
+    gb->mbc.sram = NULL;
+    if (gb->cart.ram.size > 0 && gb->mbc.mbc3.ramEnable)
+        gb->mbc.sram = gb->cart.ram.data + 0x2000 * gb->mbc.mbc3.ramBank;
+    mbc_map_banks(gb);
+}
+
+void mbc5_write(struct gb *gb, uint16_t addr, uint8_t val)
+{
+    if (IN_RANGE(addr, 0x0000, 0x1fff)) {
+        gb->mbc.mbc5.ramEnable = ((val & 0x0f) == 0x0a);
+    } else if (IN_RANGE(addr, 0x2000, 0x2fff)) {
+        gb->mbc.mbc5.romBank = (gb->mbc.mbc5.romBank & 0x100) | val;
+    } else if (IN_RANGE(addr, 0x3000, 0x3fff)) {
+        gb->mbc.mbc5.romBank = (gb->mbc.mbc5.romBank & 0xff) | (BIT(val, 0) << 8);
+    } else if (IN_RANGE(addr, 0x4000, 0x5fff)) {
+        gb->mbc.mbc5.ramBank = val & 0x0f;
+    } else if (IN_RANGE(addr, 0xa000, 0xbfff)) {
+        if (gb->mbc.sram)
+            gb->mbc.sram[addr - 0xa000] = val;
+        return;
+    }
+    mbc5_map(gb);
+}
+
+void mbc5_map(struct gb *gb)
+{
+    // bank 0 is selectable here
+    gb->mbc.romx = mbc_rom_bank(gb, gb->mbc.mbc5.romBank);
+    gb->mbc.sram = NULL;
+    // cart.ram only holds four 8 KiB banks
+    if (gb->cart.ram.size > 0 && gb->mbc.mbc5.ramEnable)
+        gb->mbc.sram = gb->cart.ram.data + 0x2000 * (gb->mbc.mbc5.ramBank & 0x03);
+    mbc_map_banks(gb);
+}
 
 void (*write_func[])(struct gb *gb, uint16_t addr, uint8_t val) = {
     [NO_MBC] = no_mbc_write,
     [MBC1] = mbc1_write,
     [MBC1_RAM] = mbc1_write,
     [MBC1_RAM_BATTERY] = mbc1_write,
+    [MBC3_TIMER_BATTERY] = mbc3_write,
+    [MBC3_TIMER_RAM_BATTERY] = mbc3_write,
+    [MBC3] = mbc3_write,
+    [MBC3_RAM] = mbc3_write,
     [MBC3_RAM_BATTERY] = mbc3_write,
+    [MBC5] = mbc5_write,
+    [MBC5_RAM] = mbc5_write,
+    [MBC5_RAM_BATTERY] = mbc5_write,
+    [MBC5_RUMBLE] = mbc5_write,
+    [MBC5_RUMBLE_RAM] = mbc5_write,
+    [MBC5_RUMBLE_RAM_BATTERY] = mbc5_write,
+};
+
+void (*map_func[])(struct gb *gb) = {
+    [NO_MBC] = no_mbc_map,
+    [MBC1] = mbc1_map,
+    [MBC1_RAM] = mbc1_map,
+    [MBC1_RAM_BATTERY] = mbc1_map,
+    [MBC3_TIMER_BATTERY] = mbc3_map,
+    [MBC3_TIMER_RAM_BATTERY] = mbc3_map,
+    [MBC3] = mbc3_map,
+    [MBC3_RAM] = mbc3_map,
+    [MBC3_RAM_BATTERY] = mbc3_map,
+    [MBC5] = mbc5_map,
+    [MBC5_RAM] = mbc5_map,
+    [MBC5_RAM_BATTERY] = mbc5_map,
+    [MBC5_RUMBLE] = mbc5_map,
+    [MBC5_RUMBLE_RAM] = mbc5_map,
+    [MBC5_RUMBLE_RAM_BATTERY] = mbc5_map,
 };
 
 void mbc_init(struct gb *gb)
@@ -2015,6 +2620,10 @@ void mbc_init(struct gb *gb)
     case MBC3_TIMER_RAM_BATTERY:
         gb->mbc.mbc3.hasBattery = true;
         break;
+    case MBC5_RAM_BATTERY:
+    case MBC5_RUMBLE_RAM_BATTERY:
+        gb->mbc.mbc5.hasBattery = true;
+        break;
     default:
         break;
     }
@@ -2048,6 +2657,7 @@ void cartridge_print_info(struct gb *gb)
 void cartridge_load(struct gb *gb, uint8_t *rom)
 {
     gb->cart.rom.data = rom;
+    gb->cart.idleLoopSkip = true;
     cartridge_get_infos(gb);
     cartridge_print_info(gb);
     mbc_init(gb);
@@ -2107,6 +2717,7 @@ void load_state_after_booting(struct gb *gb)
     ppu->ly = 0x00;
     ppu->lyc = 0x00;
     ppu->pal[BGP] = 0xfc;
+    ppu_set_palette_set(gb, ppu->paletteSet);
     ppu->wy = 0x00;
     ppu->wx = 0x00;
     ppu->ticks = 0;
@@ -2119,6 +2730,25 @@ void load_state_after_booting(struct gb *gb)
     ppu->windowInFrame = false;
     ppu->windowLineCounter = 0;
     ppu->drawWindowThisLine = false;
+    memset(ppu->dirtyLines, 0xff, sizeof(ppu->dirtyLines));
+    memset(gb->tileCache.dirty, 0xff, sizeof(gb->tileCache.dirty));
+    gb->tileCache.hits = gb->tileCache.misses = 0;
+    ppu_oam_bin_all(gb);
+    scaler_init(gb);
+    if (gb->lineRing)
+        gb->lineRing->lineLength = (gb->scaler.mode == SCALER_OFF) ? SCREEN_WIDTH : SCALED_LINE_LENGTH;
+#ifdef GBDARM_BG_SURFACE
+    memset(gb->bgSurface.dirty, 0xff, sizeof(gb->bgSurface.dirty));
+    memset(gb->bgSurface.pendingTiles, 0, sizeof(gb->bgSurface.pendingTiles));
+    gb->bgSurface.tilesPending = false;
+#endif
+
+    // frame skip, the ratio stays what the host set
+    gb->frameSkip.skipping = gb->frameSkip.ratio == FRAMESKIP_HEADLESS;
+    gb->frameSkip.run = 0;
+    gb->frameSkip.lag = 0;
+    gb->frameSkip.skipped = 0;
+    gb->frameSkip.drawn = false;
 
     // dma
     dma->mode = OFF;
@@ -2140,7 +2770,15 @@ void load_state_after_booting(struct gb *gb)
     mbc->mbc3.romBank = 0;
     mbc->mbc3.ramBank = 0;
 
+    // mbc5
+    mbc->mbc5.ramEnable = false;
+    mbc->mbc5.romBank = 1;
+    mbc->mbc5.ramBank = 0;
 
+    bus_map_init(gb);
+
+    // scheduler
+    sched_init(gb);
 
     // // TODO: update each channel after booting status 
     // //       when implementing them. 
@@ -2249,18 +2887,104 @@ void load_state_after_booting(struct gb *gb)
 
 
 
+void dma_tick(struct gb *gb)
+{
+    int elapsed = sched_elapsed(gb, EVENT_DMA);
+
+    if (gb->dma.mode != OFF) {
+        gb->dma.tick += elapsed;
+        if (gb->dma.tick >= 1 && gb->dma.mode == WAITING) {
+            gb->dma.tick -= 1;
+            gb->dma.mode = TRANSFERING;
+        } else if (gb->dma.tick >= 160 && gb->dma.mode == TRANSFERING) {
+            for (int i = 0; i < 160; i++) {
+                uint8_t transfer_val = bus_read(gb, gb->dma.startAddr + i);
+                gb->oam[i] = transfer_val;
+            }
+            ppu_oam_bin_all(gb);
+            gb->dma.mode = OFF;
+        }
+    }
+
+    if (gb->dma.mode == WAITING)
+        SCHEDULE_EVENT(EVENT_DMA, 0);
+    else if (gb->dma.mode == TRANSFERING)
+        SCHEDULE_EVENT(EVENT_DMA, (gb->dma.tick >= 160) ? 0 : 160 - gb->dma.tick);
+    else
+        gb->sched.deadline[EVENT_DMA] = EVENT_NEVER;
+}
+
+void bus_map_pages(struct gb *gb, uint16_t start, uint16_t end, uint8_t *read, uint8_t *write)
+{
+    for (int page = start >> 8; page <= end >> 8; page++) {
+        gb->page.read[page] = (read) ? read + ((page - (start >> 8)) << 8) : NULL;
+        gb->page.write[page] = (write) ? write + ((page - (start >> 8)) << 8) : NULL;
+    }
+}
+
+/* Build the page table for the fixed regions and the cartridge's current
+ * banks. OAM, IO/HRAM and anything the MBC intercepts stay on the slow path. */
+void bus_map_init(struct gb *gb)
+{
+    uint8_t romType = gb->cart.rom.type;
+
+    memset(&gb->page, 0, sizeof(gb->page));
+    gb->mbc.rom0 = gb->cart.rom.data;
+    // stays bank 0 if the bank cache cannot read bank 1
+    gb->mbc.romx = gb->mbc.rom0;
+    gb->mbc.romx = mbc_rom_bank(gb, 1);
+    gb->mbc.sram = NULL;
+    bus_map_pages(gb, 0x0000, 0x3fff, gb->mbc.rom0, NULL);
+    // tile data writes take the slow path so they can invalidate the tile cache
+    bus_map_pages(gb, 0x8000, 0x97ff, gb->vRAM, NULL);
+#ifdef GBDARM_BG_SURFACE
+    // and so do tile map writes, to mark their cell of the BG surface
+    bus_map_pages(gb, 0x9800, 0x9fff, gb->vRAM + 0x1800, NULL);
+#else
+    bus_map_pages(gb, 0x9800, 0x9fff, gb->vRAM + 0x1800, gb->vRAM + 0x1800);
+#endif
+    bus_map_pages(gb, 0xc000, 0xdfff, gb->workRAM, gb->workRAM);
+    for (int page = 0xe0; page <= 0xfd; page++) {
+        uint8_t *echo = gb->workRAM + (((page << 8) & 0xddff) - 0xc000);
+
+        gb->page.read[page] = gb->page.write[page] = echo;
+    }
+    if (romType < sizeof(map_func) / sizeof(map_func[0]) && map_func[romType])
+        map_func[romType](gb);
+}
+
 uint8_t bus_read(struct gb *gb, uint16_t addr)
 {
-    uint8_t ret = 0xff, romBank;
+    uint8_t *page = gb->page.read[addr >> 8];
+
+    if (page)
+        return page[addr & 0xff];
+    return bus_read_slow(gb, addr);
+}
+
+void bus_write(struct gb *gb, uint16_t addr, uint8_t val)
+{
+    uint8_t *page = gb->page.write[addr >> 8];
+
+    if (page)
+        page[addr & 0xff] = val;
+    else
+        bus_write_slow(gb, addr, val);
+}
+
+uint8_t bus_read_slow(struct gb *gb, uint16_t addr)
+{
+    if (IN_RANGE(addr, 0xff80, 0xfffe))
+        return gb->highRAM[addr - 0xff80];
 
     switch (GET_MEM_REGION(addr)) {
     case ROM:
-        return read_func[gb->cart.rom.type](gb, addr);
+        return mbc_read(gb, addr);
     case vRAM:
         return gb->vRAM[addr - 0x8000];
     case externalRAM:
         if (gb->cart.ram.size > 0)
-            return read_func[gb->cart.rom.type](gb, addr);
+            return mbc_read(gb, addr);
         break;
     case WRAM:
         return gb->workRAM[addr - 0xc000];
@@ -2285,6 +3009,7 @@ uint8_t bus_read(struct gb *gb, uint16_t addr)
         case TIMER:
             switch (addr) {
             case TIMER_REG_DIV:
+                gb->timer.div += sched_elapsed(gb, EVENT_TIMER);
                 return (gb->timer.div >> 6) & 0x00ff;
             case TIMER_REG_TAC:
                 return gb->timer.tac.val;
@@ -2345,14 +3070,31 @@ uint8_t bus_read(struct gb *gb, uint16_t addr)
     return 0xff;
 }
 
-void bus_write(struct gb *gb, uint16_t addr, uint8_t val)
+void bus_write_slow(struct gb *gb, uint16_t addr, uint8_t val)
 {
+    int elapsed;
+
+    if (IN_RANGE(addr, 0xff80, 0xfffe)) {
+        gb->highRAM[addr - 0xff80] = val;
+        return;
+    }
+
     switch (GET_MEM_REGION(addr)) {
     case ROM:
         write_func[gb->cart.rom.type](gb, addr, val);
         break;
     case vRAM:
         gb->vRAM[addr - 0x8000] = val;
+        if (addr < 0x9800)
+            gb->tileCache.dirty[(addr - 0x8000) >> 4] |= 1 << ((addr >> 1) & 7);
+#ifdef GBDARM_BG_SURFACE
+        if (addr < 0x9800) {
+            gb->bgSurface.pendingTiles[(addr - 0x8000) >> 4] |= 1 << ((addr >> 1) & 7);
+            gb->bgSurface.tilesPending = true;
+        } else {
+            gb->bgSurface.dirty[(addr >> 10) & 1][addr & 0x3ff] = 0xff;
+        }
+#endif
         break;
     case externalRAM:
         if (gb->cart.ram.size > 0)
@@ -2366,6 +3108,9 @@ void bus_write(struct gb *gb, uint16_t addr, uint8_t val)
         break;
     case OAM:
         gb->oam[addr - 0xfe00] = val;
+        // only Y and X decide which lines a sprite is on
+        if ((addr & 0x03) < 2)
+            ppu_oam_bin(gb, (addr - 0xfe00) >> 2);
         break;
     case UNUSED:
         gb->unused[addr - 0xfea0] = val;
@@ -2384,14 +3129,19 @@ void bus_write(struct gb *gb, uint16_t addr, uint8_t val)
                 gb->interrupt.flag = val;
                 break;
             }
+            SCHEDULE_SYNC();
             break;
         case TIMER:
             switch (addr) {
             case TIMER_REG_DIV:
+                sched_elapsed(gb, EVENT_TIMER);
                 gb->timer.div = 0;
+                SCHEDULE_SYNC();
                 break;
             case TIMER_REG_TAC:
+                gb->timer.div += sched_elapsed(gb, EVENT_TIMER);
                 gb->timer.tac.val = val;
+                SCHEDULE_SYNC();
                 break;
             case TIMER_REG_TIMA:
                 gb->timer.tima = val;
@@ -2406,14 +3156,25 @@ void bus_write(struct gb *gb, uint16_t addr, uint8_t val)
         case PPU:
             switch (addr) {
                 case PPU_REG_LCDC:
+                    // catch the PPU up before it may be switched on or off
+                    elapsed = sched_elapsed(gb, EVENT_PPU);
+                    if (gb->ppu.lcdc.ppuEnable)
+                        gb->ppu.ticks += elapsed * 4;
                     gb->ppu.lcdc.val = val;
                     // extract informations from LCDC
                     gb->ppu.lcdc.ppuEnable = BIT(val, 7);
                     gb->ppu.lcdc.winTileMap = 0x9800 | (BIT(val, 6) << 10);
                     gb->ppu.lcdc.winEnable = BIT(val, 5);
+#ifdef GBDARM_BG_SURFACE
+                    if (gb->ppu.lcdc.bgWinTiles != 0x8800 - (0x800 * BIT(val, 4)))
+                        memset(gb->bgSurface.dirty, 0xff, sizeof(gb->bgSurface.dirty));
+#endif
                     gb->ppu.lcdc.bgWinTiles = 0x8800 - (0x800 * BIT(val, 4));
                     gb->ppu.lcdc.bgTileMap = 0x9800 | (BIT(val, 3) << 10);
-                    gb->ppu.lcdc.objSize = 0x08 << BIT(val, 2);
+                    if (gb->ppu.lcdc.objSize != (0x08 << BIT(val, 2))) {
+                        gb->ppu.lcdc.objSize = 0x08 << BIT(val, 2);
+                        ppu_oam_bin_all(gb);
+                    }
                     gb->ppu.lcdc.objEnable = BIT(val, 1);
                     gb->ppu.lcdc.bgWinEnable = BIT(val, 0);
                     if (!gb->ppu.lcdc.ppuEnable) {
@@ -2421,9 +3182,11 @@ void bus_write(struct gb *gb, uint16_t addr, uint8_t val)
                         gb->ppu.ly = 0;
                         gb->ppu.ticks = 0;
                     }
+                    SCHEDULE_SYNC();
                     break;
                 case PPU_REG_STAT:
                     gb->ppu.stat.val = (val & 0xf8) | (gb->ppu.stat.val & 0x87);
+                    SCHEDULE_SYNC();
                     break;
                 case PPU_REG_SCY:
                     gb->ppu.scy = val;
@@ -2434,15 +3197,19 @@ void bus_write(struct gb *gb, uint16_t addr, uint8_t val)
                 case PPU_REG_LYC:
                     gb->ppu.lyc = val;
                     gb->ppu.stat.lycEqualLy = gb->ppu.lyc == gb->ppu.ly;
+                    SCHEDULE_SYNC();
                     break; 
                 case PPU_REG_BGP:
                     gb->ppu.pal[BGP] = val;
+                    ppu_palette_update(gb, BGP);
                     break;
                 case PPU_REG_OBP0:
                     gb->ppu.pal[OBP0] = val;
+                    ppu_palette_update(gb, OBP0);
                     break;
                 case PPU_REG_OBP1:
                     gb->ppu.pal[OBP1] = val;
+                    ppu_palette_update(gb, OBP1);
                     break;
                 case PPU_REG_WY:
                     gb->ppu.wy = val;
@@ -2456,6 +3223,8 @@ void bus_write(struct gb *gb, uint16_t addr, uint8_t val)
                     gb->dma.mode = WAITING;
                     gb->dma.startAddr = TO_U16(0x00, val);
                     gb->dma.tick = 0;
+                    sched_elapsed(gb, EVENT_DMA);
+                    SCHEDULE_SYNC();
                     break;
                 default:
                     break;
@@ -2476,4 +3245,6 @@ void bus_write(struct gb *gb, uint16_t addr, uint8_t val)
 void interrupt_request(struct gb *gb, uint8_t intr_src)
 {
     gb->interrupt.flag |= intr_src;
-}
\ No newline at end of file
+}
+
+#endif /* GBDARM_DECLARATIONS_ONLY */
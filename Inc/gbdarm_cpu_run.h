@@ -0,0 +1,735 @@
+/* Opcode interpreter. gbdarm.h includes this once for cpu_run and, with
+ * GBDARM_MBC_VARIANTS, once more per MBC family. CPU_RUN names the function;
+ * when MBC_WRITE names an MBC write handler, writes to the ROM area call it
+ * directly instead of going through bus_write_slow and write_func.
+ * No include guard on purpose. */
+
+#define bus_read(gb, addr)              cpu_bus_read(gb, addr, cycles)
+#ifdef MBC_WRITE
+#define bus_write(gb, addr, val)        cpu_bus_write(gb, addr, val, cycles, MBC_WRITE)
+#else
+#define bus_write(gb, addr, val)        cpu_bus_write(gb, addr, val, cycles, NULL)
+#endif
+
+/* run for budget M-cycles, stopping early once a frame is complete; returns
+ * the number of M-cycles run. The registers stay in cpu and the cycle count
+ * in cycles until the next cpu_tick() or the return, see CPU_TICK(); cycles
+ * also goes back to gb before a slow bus access. executedCycle is what the
+ * current instruction takes. */
+int CPU_RUN(struct gb *gb, int budget)
+{
+    struct cpu cpu = gb->cpu;
+    uint8_t opcode, a, val, lsb, msb;
+    uint16_t operand, res, carryPerBit;
+    uint64_t start = gb->sched.cycles, cycles = start;
+    int executed = 0, executedCycle;
+#ifdef GBDARM_LAZY_FLAGS
+    uint8_t flagZ;
+    bool flagN;
+    uint16_t flagH, flagC;
+#endif
+
+    SCHEDULE_EVENT(EVENT_HOST, budget);
+    // the host may have raised interrupts since the last call
+    SCHEDULE_SYNC();
+    LOAD_FLAGS();
+
+#ifdef GBDARM_THREADED_DISPATCH
+    static const void *const opTable[256] = {
+        &&op_0x00, &&op_0x01, &&op_0x02, &&op_0x03, &&op_0x04, &&op_0x05, &&op_0x06, &&op_0x07,
+        &&op_0x08, &&op_0x09, &&op_0x0a, &&op_0x0b, &&op_0x0c, &&op_0x0d, &&op_0x0e, &&op_0x0f,
+        &&op_0x10, &&op_0x11, &&op_0x12, &&op_0x13, &&op_0x14, &&op_0x15, &&op_0x16, &&op_0x17,
+        &&op_0x18, &&op_0x19, &&op_0x1a, &&op_0x1b, &&op_0x1c, &&op_0x1d, &&op_0x1e, &&op_0x1f,
+        &&op_0x20, &&op_0x21, &&op_0x22, &&op_0x23, &&op_0x24, &&op_0x25, &&op_0x26, &&op_0x27,
+        &&op_0x28, &&op_0x29, &&op_0x2a, &&op_0x2b, &&op_0x2c, &&op_0x2d, &&op_0x2e, &&op_0x2f,
+        &&op_0x30, &&op_0x31, &&op_0x32, &&op_0x33, &&op_0x34, &&op_0x35, &&op_0x36, &&op_0x37,
+        &&op_0x38, &&op_0x39, &&op_0x3a, &&op_0x3b, &&op_0x3c, &&op_0x3d, &&op_0x3e, &&op_0x3f,
+        &&op_0x40, &&op_0x41, &&op_0x42, &&op_0x43, &&op_0x44, &&op_0x45, &&op_0x46, &&op_0x47,
+        &&op_0x48, &&op_0x49, &&op_0x4a, &&op_0x4b, &&op_0x4c, &&op_0x4d, &&op_0x4e, &&op_0x4f,
+        &&op_0x50, &&op_0x51, &&op_0x52, &&op_0x53, &&op_0x54, &&op_0x55, &&op_0x56, &&op_0x57,
+        &&op_0x58, &&op_0x59, &&op_0x5a, &&op_0x5b, &&op_0x5c, &&op_0x5d, &&op_0x5e, &&op_0x5f,
+        &&op_0x60, &&op_0x61, &&op_0x62, &&op_0x63, &&op_0x64, &&op_0x65, &&op_0x66, &&op_0x67,
+        &&op_0x68, &&op_0x69, &&op_0x6a, &&op_0x6b, &&op_0x6c, &&op_0x6d, &&op_0x6e, &&op_0x6f,
+        &&op_0x70, &&op_0x71, &&op_0x72, &&op_0x73, &&op_0x74, &&op_0x75, &&op_0x76, &&op_0x77,
+        &&op_0x78, &&op_0x79, &&op_0x7a, &&op_0x7b, &&op_0x7c, &&op_0x7d, &&op_0x7e, &&op_0x7f,
+        &&op_0x80, &&op_0x81, &&op_0x82, &&op_0x83, &&op_0x84, &&op_0x85, &&op_0x86, &&op_0x87,
+        &&op_0x88, &&op_0x89, &&op_0x8a, &&op_0x8b, &&op_0x8c, &&op_0x8d, &&op_0x8e, &&op_0x8f,
+        &&op_0x90, &&op_0x91, &&op_0x92, &&op_0x93, &&op_0x94, &&op_0x95, &&op_0x96, &&op_0x97,
+        &&op_0x98, &&op_0x99, &&op_0x9a, &&op_0x9b, &&op_0x9c, &&op_0x9d, &&op_0x9e, &&op_0x9f,
+        &&op_0xa0, &&op_0xa1, &&op_0xa2, &&op_0xa3, &&op_0xa4, &&op_0xa5, &&op_0xa6, &&op_0xa7,
+        &&op_0xa8, &&op_0xa9, &&op_0xaa, &&op_0xab, &&op_0xac, &&op_0xad, &&op_0xae, &&op_0xaf,
+        &&op_0xb0, &&op_0xb1, &&op_0xb2, &&op_0xb3, &&op_0xb4, &&op_0xb5, &&op_0xb6, &&op_0xb7,
+        &&op_0xb8, &&op_0xb9, &&op_0xba, &&op_0xbb, &&op_0xbc, &&op_0xbd, &&op_0xbe, &&op_0xbf,
+        &&op_0xc0, &&op_0xc1, &&op_0xc2, &&op_0xc3, &&op_0xc4, &&op_0xc5, &&op_0xc6, &&op_0xc7,
+        &&op_0xc8, &&op_0xc9, &&op_0xca, &&op_0xcb, &&op_0xcc, &&op_0xcd, &&op_0xce, &&op_0xcf,
+        &&op_0xd0, &&op_0xd1, &&op_0xd2, &&op_unknown, &&op_0xd4, &&op_0xd5, &&op_0xd6, &&op_0xd7,
+        &&op_0xd8, &&op_0xd9, &&op_0xda, &&op_unknown, &&op_0xdc, &&op_unknown, &&op_0xde, &&op_0xdf,
+        &&op_0xe0, &&op_0xe1, &&op_0xe2, &&op_unknown, &&op_unknown, &&op_0xe5, &&op_0xe6, &&op_0xe7,
+        &&op_0xe8, &&op_0xe9, &&op_0xea, &&op_unknown, &&op_unknown, &&op_unknown, &&op_0xee, &&op_0xef,
+        &&op_0xf0, &&op_0xf1, &&op_0xf2, &&op_0xf3, &&op_unknown, &&op_0xf5, &&op_0xf6, &&op_0xf7,
+        &&op_0xf8, &&op_0xf9, &&op_0xfa, &&op_0xfb, &&op_unknown, &&op_unknown, &&op_0xfe, &&op_0xff,
+    };
+    static const void *const cbOpTable[256] = {
+        &&cb_0x00, &&cb_0x01, &&cb_0x02, &&cb_0x03, &&cb_0x04, &&cb_0x05, &&cb_0x06, &&cb_0x07,
+        &&cb_0x08, &&cb_0x09, &&cb_0x0a, &&cb_0x0b, &&cb_0x0c, &&cb_0x0d, &&cb_0x0e, &&cb_0x0f,
+        &&cb_0x10, &&cb_0x11, &&cb_0x12, &&cb_0x13, &&cb_0x14, &&cb_0x15, &&cb_0x16, &&cb_0x17,
+        &&cb_0x18, &&cb_0x19, &&cb_0x1a, &&cb_0x1b, &&cb_0x1c, &&cb_0x1d, &&cb_0x1e, &&cb_0x1f,
+        &&cb_0x20, &&cb_0x21, &&cb_0x22, &&cb_0x23, &&cb_0x24, &&cb_0x25, &&cb_0x26, &&cb_0x27,
+        &&cb_0x28, &&cb_0x29, &&cb_0x2a, &&cb_0x2b, &&cb_0x2c, &&cb_0x2d, &&cb_0x2e, &&cb_0x2f,
+        &&cb_0x30, &&cb_0x31, &&cb_0x32, &&cb_0x33, &&cb_0x34, &&cb_0x35, &&cb_0x36, &&cb_0x37,
+        &&cb_0x38, &&cb_0x39, &&cb_0x3a, &&cb_0x3b, &&cb_0x3c, &&cb_0x3d, &&cb_0x3e, &&cb_0x3f,
+        &&cb_0x40, &&cb_0x41, &&cb_0x42, &&cb_0x43, &&cb_0x44, &&cb_0x45, &&cb_0x46, &&cb_0x47,
+        &&cb_0x48, &&cb_0x49, &&cb_0x4a, &&cb_0x4b, &&cb_0x4c, &&cb_0x4d, &&cb_0x4e, &&cb_0x4f,
+        &&cb_0x50, &&cb_0x51, &&cb_0x52, &&cb_0x53, &&cb_0x54, &&cb_0x55, &&cb_0x56, &&cb_0x57,
+        &&cb_0x58, &&cb_0x59, &&cb_0x5a, &&cb_0x5b, &&cb_0x5c, &&cb_0x5d, &&cb_0x5e, &&cb_0x5f,
+        &&cb_0x60, &&cb_0x61, &&cb_0x62, &&cb_0x63, &&cb_0x64, &&cb_0x65, &&cb_0x66, &&cb_0x67,
+        &&cb_0x68, &&cb_0x69, &&cb_0x6a, &&cb_0x6b, &&cb_0x6c, &&cb_0x6d, &&cb_0x6e, &&cb_0x6f,
+        &&cb_0x70, &&cb_0x71, &&cb_0x72, &&cb_0x73, &&cb_0x74, &&cb_0x75, &&cb_0x76, &&cb_0x77,
+        &&cb_0x78, &&cb_0x79, &&cb_0x7a, &&cb_0x7b, &&cb_0x7c, &&cb_0x7d, &&cb_0x7e, &&cb_0x7f,
+        &&cb_0x80, &&cb_0x81, &&cb_0x82, &&cb_0x83, &&cb_0x84, &&cb_0x85, &&cb_0x86, &&cb_0x87,
+        &&cb_0x88, &&cb_0x89, &&cb_0x8a, &&cb_0x8b, &&cb_0x8c, &&cb_0x8d, &&cb_0x8e, &&cb_0x8f,
+        &&cb_0x90, &&cb_0x91, &&cb_0x92, &&cb_0x93, &&cb_0x94, &&cb_0x95, &&cb_0x96, &&cb_0x97,
+        &&cb_0x98, &&cb_0x99, &&cb_0x9a, &&cb_0x9b, &&cb_0x9c, &&cb_0x9d, &&cb_0x9e, &&cb_0x9f,
+        &&cb_0xa0, &&cb_0xa1, &&cb_0xa2, &&cb_0xa3, &&cb_0xa4, &&cb_0xa5, &&cb_0xa6, &&cb_0xa7,
+        &&cb_0xa8, &&cb_0xa9, &&cb_0xaa, &&cb_0xab, &&cb_0xac, &&cb_0xad, &&cb_0xae, &&cb_0xaf,
+        &&cb_0xb0, &&cb_0xb1, &&cb_0xb2, &&cb_0xb3, &&cb_0xb4, &&cb_0xb5, &&cb_0xb6, &&cb_0xb7,
+        &&cb_0xb8, &&cb_0xb9, &&cb_0xba, &&cb_0xbb, &&cb_0xbc, &&cb_0xbd, &&cb_0xbe, &&cb_0xbf,
+        &&cb_0xc0, &&cb_0xc1, &&cb_0xc2, &&cb_0xc3, &&cb_0xc4, &&cb_0xc5, &&cb_0xc6, &&cb_0xc7,
+        &&cb_0xc8, &&cb_0xc9, &&cb_0xca, &&cb_0xcb, &&cb_0xcc, &&cb_0xcd, &&cb_0xce, &&cb_0xcf,
+        &&cb_0xd0, &&cb_0xd1, &&cb_0xd2, &&cb_0xd3, &&cb_0xd4, &&cb_0xd5, &&cb_0xd6, &&cb_0xd7,
+        &&cb_0xd8, &&cb_0xd9, &&cb_0xda, &&cb_0xdb, &&cb_0xdc, &&cb_0xdd, &&cb_0xde, &&cb_0xdf,
+        &&cb_0xe0, &&cb_0xe1, &&cb_0xe2, &&cb_0xe3, &&cb_0xe4, &&cb_0xe5, &&cb_0xe6, &&cb_0xe7,
+        &&cb_0xe8, &&cb_0xe9, &&cb_0xea, &&cb_0xeb, &&cb_0xec, &&cb_0xed, &&cb_0xee, &&cb_0xef,
+        &&cb_0xf0, &&cb_0xf1, &&cb_0xf2, &&cb_0xf3, &&cb_0xf4, &&cb_0xf5, &&cb_0xf6, &&cb_0xf7,
+        &&cb_0xf8, &&cb_0xf9, &&cb_0xfa, &&cb_0xfb, &&cb_0xfc, &&cb_0xfd, &&cb_0xfe, &&cb_0xff,
+    };
+#endif
+
+    DISPATCH_START()
+    OPCODE(0x00)                                                    NEXT();
+    OPCODE(0x01) CPU_FETCH_WORD(cpu.bc.val);                        NEXT();
+    OPCODE(0x02) bus_write(gb, cpu.bc.val, cpu.af.a);               NEXT();
+    OPCODE(0x03) INC_RR(cpu.bc.val);                                NEXT();
+    OPCODE(0x04) INC_R(cpu.bc.b);                                   NEXT();
+    OPCODE(0x05) DEC_R(cpu.bc.b);                                   NEXT();
+    OPCODE(0x06) cpu.bc.b = CPU_FETCH_BYTE();                       NEXT();
+    OPCODE(0x07) RLCA();                                            NEXT();
+    OPCODE(0x08)
+        CPU_FETCH_WORD(operand);
+        LD_INDIRECT_NN_SP(operand);
+        NEXT();
+    OPCODE(0x09) ADD_HL_RR(cpu.bc.val);                             NEXT();
+    OPCODE(0x0a) cpu.af.a = bus_read(gb, cpu.bc.val);               NEXT();
+    OPCODE(0x0b) DEC_RR(cpu.bc.val);                                NEXT();
+    OPCODE(0x0c) INC_R(cpu.bc.c);                                   NEXT();
+    OPCODE(0x0d) DEC_R(cpu.bc.c);                                   NEXT();
+    OPCODE(0x0e) cpu.bc.c = CPU_FETCH_BYTE();                       NEXT();
+    OPCODE(0x0f) RRCA();                                            NEXT();
+    OPCODE(0x10)                                                    NEXT();
+    OPCODE(0x11) CPU_FETCH_WORD(cpu.de.val);                        NEXT();
+    OPCODE(0x12) bus_write(gb, cpu.de.val, cpu.af.a);               NEXT();
+    OPCODE(0x13) INC_RR(cpu.de.val);                                NEXT();
+    OPCODE(0x14) INC_R(cpu.de.d);                                   NEXT();
+    OPCODE(0x15) DEC_R(cpu.de.d);                                   NEXT();
+    OPCODE(0x16) cpu.de.d = CPU_FETCH_BYTE();                       NEXT();
+    OPCODE(0x17) RLA();                                             NEXT();
+    OPCODE(0x18)
+        operand = CPU_FETCH_BYTE();
+        JP(cpu.pc, operand, 1);
+        NEXT();
+    OPCODE(0x19) ADD_HL_RR(cpu.de.val);                             NEXT();
+    OPCODE(0x1a) cpu.af.a = bus_read(gb, cpu.de.val);               NEXT();
+    OPCODE(0x1b) DEC_RR(cpu.de.val);                                NEXT();
+    OPCODE(0x1c) INC_R(cpu.de.e);                                   NEXT();
+    OPCODE(0x1d) DEC_R(cpu.de.e);                                   NEXT();
+    OPCODE(0x1e) cpu.de.e = CPU_FETCH_BYTE();                       NEXT();
+    OPCODE(0x1f) RRA();                                             NEXT();
+    OPCODE(0x20) JR_CC(!FLAG_Z);                                    NEXT();
+    OPCODE(0x21) CPU_FETCH_WORD(cpu.hl.val);                        NEXT();
+    OPCODE(0x22) bus_write(gb, cpu.hl.val++, cpu.af.a);             NEXT();
+    OPCODE(0x23) INC_RR(cpu.hl.val);                                NEXT();
+    OPCODE(0x24) INC_R(cpu.hl.h);                                   NEXT();
+    OPCODE(0x25) DEC_R(cpu.hl.h);                                   NEXT();
+    OPCODE(0x26) cpu.hl.h = CPU_FETCH_BYTE();                       NEXT();
+    OPCODE(0x27) DAA();                                             NEXT();
+    OPCODE(0x28) JR_CC(FLAG_Z);                                     NEXT();
+    OPCODE(0x29) ADD_HL_RR(cpu.hl.val);                             NEXT();
+    OPCODE(0x2a) cpu.af.a = bus_read(gb, cpu.hl.val++);             NEXT();
+    OPCODE(0x2b) DEC_RR(cpu.hl.val);                                NEXT();
+    OPCODE(0x2c) INC_R(cpu.hl.l);                                   NEXT();
+    OPCODE(0x2d) DEC_R(cpu.hl.l);                                   NEXT();
+    OPCODE(0x2e) cpu.hl.l = CPU_FETCH_BYTE();                       NEXT();
+    OPCODE(0x2f) CPL();                                             NEXT();
+    OPCODE(0x30) JR_CC(!FLAG_C);                                    NEXT();
+    OPCODE(0x31) CPU_FETCH_WORD(cpu.sp);                            NEXT();
+    OPCODE(0x32) bus_write(gb, cpu.hl.val--, cpu.af.a);             NEXT();
+    OPCODE(0x33) INC_RR(cpu.sp);                                    NEXT();
+    OPCODE(0x34) INC_INDIRECT_HL();                                 NEXT();
+    OPCODE(0x35) DEC_INDIRECT_HL();                                 NEXT();
+    OPCODE(0x36)
+        operand = CPU_FETCH_BYTE();
+        LD_INDIRECT_HL_N(operand);
+        NEXT();
+    OPCODE(0x37) SCF();                                             NEXT();
+    OPCODE(0x38) JR_CC(FLAG_C);                                     NEXT();
+    OPCODE(0x39) ADD_HL_RR(cpu.sp);                                 NEXT();
+    OPCODE(0x3a) cpu.af.a = bus_read(gb, cpu.hl.val--);             NEXT();
+    OPCODE(0x3b) DEC_RR(cpu.sp);                                    NEXT();
+    OPCODE(0x3c) INC_R(cpu.af.a);                                   NEXT();
+    OPCODE(0x3d) DEC_R(cpu.af.a);                                   NEXT();
+    OPCODE(0x3e) cpu.af.a = CPU_FETCH_BYTE();                       NEXT();
+    OPCODE(0x3f) CCF();                                             NEXT();
+    OPCODE(0x40) cpu.bc.b = cpu.bc.b;                               NEXT();
+    OPCODE(0x41) cpu.bc.b = cpu.bc.c;                               NEXT();
+    OPCODE(0x42) cpu.bc.b = cpu.de.d;                               NEXT();
+    OPCODE(0x43) cpu.bc.b = cpu.de.e;                               NEXT();
+    OPCODE(0x44) cpu.bc.b = cpu.hl.h;                               NEXT();
+    OPCODE(0x45) cpu.bc.b = cpu.hl.l;                               NEXT();
+    OPCODE(0x46) cpu.bc.b = bus_read(gb, cpu.hl.val);               NEXT();
+    OPCODE(0x47) cpu.bc.b = cpu.af.a;                               NEXT();
+    OPCODE(0x48) cpu.bc.c = cpu.bc.b;                               NEXT();
+    OPCODE(0x49) cpu.bc.c = cpu.bc.c;                               NEXT();
+    OPCODE(0x4a) cpu.bc.c = cpu.de.d;                               NEXT();
+    OPCODE(0x4b) cpu.bc.c = cpu.de.e;                               NEXT();
+    OPCODE(0x4c) cpu.bc.c = cpu.hl.h;                               NEXT();
+    OPCODE(0x4d) cpu.bc.c = cpu.hl.l;                               NEXT();
+    OPCODE(0x4e) cpu.bc.c = bus_read(gb, cpu.hl.val);               NEXT();
+    OPCODE(0x4f) cpu.bc.c = cpu.af.a;                               NEXT();
+    OPCODE(0x50) cpu.de.d = cpu.bc.b;                               NEXT();
+    OPCODE(0x51) cpu.de.d = cpu.bc.c;                               NEXT();
+    OPCODE(0x52) cpu.de.d = cpu.de.d;                               NEXT();
+    OPCODE(0x53) cpu.de.d = cpu.de.e;                               NEXT();
+    OPCODE(0x54) cpu.de.d = cpu.hl.h;                               NEXT();
+    OPCODE(0x55) cpu.de.d = cpu.hl.l;                               NEXT();
+    OPCODE(0x56) cpu.de.d = bus_read(gb, cpu.hl.val);               NEXT();
+    OPCODE(0x57) cpu.de.d = cpu.af.a;                               NEXT();
+    OPCODE(0x58) cpu.de.e = cpu.bc.b;                               NEXT();
+    OPCODE(0x59) cpu.de.e = cpu.bc.c;                               NEXT();
+    OPCODE(0x5a) cpu.de.e = cpu.de.d;                               NEXT();
+    OPCODE(0x5b) cpu.de.e = cpu.de.e;                               NEXT();
+    OPCODE(0x5c) cpu.de.e = cpu.hl.h;                               NEXT();
+    OPCODE(0x5d) cpu.de.e = cpu.hl.l;                               NEXT();
+    OPCODE(0x5e) cpu.de.e = bus_read(gb, cpu.hl.val);               NEXT();
+    OPCODE(0x5f) cpu.de.e = cpu.af.a;                               NEXT();
+    OPCODE(0x60) cpu.hl.h = cpu.bc.b;                               NEXT();
+    OPCODE(0x61) cpu.hl.h = cpu.bc.c;                               NEXT();
+    OPCODE(0x62) cpu.hl.h = cpu.de.d;                               NEXT();
+    OPCODE(0x63) cpu.hl.h = cpu.de.e;                               NEXT();
+    OPCODE(0x64) cpu.hl.h = cpu.hl.h;                               NEXT();
+    OPCODE(0x65) cpu.hl.h = cpu.hl.l;                               NEXT();
+    OPCODE(0x66) cpu.hl.h = bus_read(gb, cpu.hl.val);               NEXT();
+    OPCODE(0x67) cpu.hl.h = cpu.af.a;                               NEXT();
+    OPCODE(0x68) cpu.hl.l = cpu.bc.b;                               NEXT();
+    OPCODE(0x69) cpu.hl.l = cpu.bc.c;                               NEXT();
+    OPCODE(0x6a) cpu.hl.l = cpu.de.d;                               NEXT();
+    OPCODE(0x6b) cpu.hl.l = cpu.de.e;                               NEXT();
+    OPCODE(0x6c) cpu.hl.l = cpu.hl.h;                               NEXT();
+    OPCODE(0x6d) cpu.hl.l = cpu.hl.l;                               NEXT();
+    OPCODE(0x6e) cpu.hl.l = bus_read(gb, cpu.hl.val);               NEXT();
+    OPCODE(0x6f) cpu.hl.l = cpu.af.a;                               NEXT();
+    OPCODE(0x70) bus_write(gb, cpu.hl.val, cpu.bc.b);               NEXT();
+    OPCODE(0x71) bus_write(gb, cpu.hl.val, cpu.bc.c);               NEXT();
+    OPCODE(0x72) bus_write(gb, cpu.hl.val, cpu.de.d);               NEXT();
+    OPCODE(0x73) bus_write(gb, cpu.hl.val, cpu.de.e);               NEXT();
+    OPCODE(0x74) bus_write(gb, cpu.hl.val, cpu.hl.h);               NEXT();
+    OPCODE(0x75) bus_write(gb, cpu.hl.val, cpu.hl.l);               NEXT();
+    OPCODE(0x76) HALT();                                            NEXT();
+    OPCODE(0x77) bus_write(gb, cpu.hl.val, cpu.af.a);               NEXT();
+    OPCODE(0x78) cpu.af.a = cpu.bc.b;                               NEXT();
+    OPCODE(0x79) cpu.af.a = cpu.bc.c;                               NEXT();
+    OPCODE(0x7a) cpu.af.a = cpu.de.d;                               NEXT();
+    OPCODE(0x7b) cpu.af.a = cpu.de.e;                               NEXT();
+    OPCODE(0x7c) cpu.af.a = cpu.hl.h;                               NEXT();
+    OPCODE(0x7d) cpu.af.a = cpu.hl.l;                               NEXT();
+    OPCODE(0x7e) cpu.af.a = bus_read(gb, cpu.hl.val);               NEXT();
+    OPCODE(0x7f) cpu.af.a = cpu.af.a;                               NEXT();
+    OPCODE(0x80) ADD(cpu.bc.b, 0);                                  NEXT();
+    OPCODE(0x81) ADD(cpu.bc.c, 0);                                  NEXT();
+    OPCODE(0x82) ADD(cpu.de.d, 0);                                  NEXT();
+    OPCODE(0x83) ADD(cpu.de.e, 0);                                  NEXT();
+    OPCODE(0x84) ADD(cpu.hl.h, 0);                                  NEXT();
+    OPCODE(0x85) ADD(cpu.hl.l, 0);                                  NEXT();
+    OPCODE(0x86)
+        operand = bus_read(gb, cpu.hl.val);
+        ADD(operand, 0);
+        NEXT();
+    OPCODE(0x87) ADD(cpu.af.a, 0);                                  NEXT();
+    OPCODE(0x88) ADD(cpu.bc.b, FLAG_C);                             NEXT();
+    OPCODE(0x89) ADD(cpu.bc.c, FLAG_C);                             NEXT();
+    OPCODE(0x8a) ADD(cpu.de.d, FLAG_C);                             NEXT();
+    OPCODE(0x8b) ADD(cpu.de.e, FLAG_C);                             NEXT();
+    OPCODE(0x8c) ADD(cpu.hl.h, FLAG_C);                             NEXT();
+    OPCODE(0x8d) ADD(cpu.hl.l, FLAG_C);                             NEXT();
+    OPCODE(0x8e)
+        operand = bus_read(gb, cpu.hl.val);
+        ADD(operand, FLAG_C);
+        NEXT();
+    OPCODE(0x8f) ADD(cpu.af.a, FLAG_C);                             NEXT();
+    OPCODE(0x90) SUB(cpu.bc.b, 0);                                  NEXT();
+    OPCODE(0x91) SUB(cpu.bc.c, 0);                                  NEXT();
+    OPCODE(0x92) SUB(cpu.de.d, 0);                                  NEXT();
+    OPCODE(0x93) SUB(cpu.de.e, 0);                                  NEXT();
+    OPCODE(0x94) SUB(cpu.hl.h, 0);                                  NEXT();
+    OPCODE(0x95) SUB(cpu.hl.l, 0);                                  NEXT();
+    OPCODE(0x96)
+        operand = bus_read(gb, cpu.hl.val);
+        SUB(operand, 0);
+        NEXT();
+    OPCODE(0x97) SUB(cpu.af.a, 0);                                  NEXT();
+    OPCODE(0x98) SUB(cpu.bc.b, FLAG_C);                             NEXT();
+    OPCODE(0x99) SUB(cpu.bc.c, FLAG_C);                             NEXT();
+    OPCODE(0x9a) SUB(cpu.de.d, FLAG_C);                             NEXT();
+    OPCODE(0x9b) SUB(cpu.de.e, FLAG_C);                             NEXT();
+    OPCODE(0x9c) SUB(cpu.hl.h, FLAG_C);                             NEXT();
+    OPCODE(0x9d) SUB(cpu.hl.l, FLAG_C);                             NEXT();
+    OPCODE(0x9e)
+        operand = bus_read(gb, cpu.hl.val);
+        SUB(operand, FLAG_C);
+        NEXT();
+    OPCODE(0x9f) SUB(cpu.af.a, FLAG_C);                             NEXT();
+    OPCODE(0xa0) AND(cpu.bc.b);                                     NEXT();
+    OPCODE(0xa1) AND(cpu.bc.c);                                     NEXT();
+    OPCODE(0xa2) AND(cpu.de.d);                                     NEXT();
+    OPCODE(0xa3) AND(cpu.de.e);                                     NEXT();
+    OPCODE(0xa4) AND(cpu.hl.h);                                     NEXT();
+    OPCODE(0xa5) AND(cpu.hl.l);                                     NEXT();
+    OPCODE(0xa6)
+        operand = bus_read(gb, cpu.hl.val);
+        AND(operand);
+        NEXT();
+    OPCODE(0xa7) AND(cpu.af.a);                                     NEXT();
+    OPCODE(0xa8) XOR(cpu.bc.b);                                     NEXT();
+    OPCODE(0xa9) XOR(cpu.bc.c);                                     NEXT();
+    OPCODE(0xaa) XOR(cpu.de.d);                                     NEXT();
+    OPCODE(0xab) XOR(cpu.de.e);                                     NEXT();
+    OPCODE(0xac) XOR(cpu.hl.h);                                     NEXT();
+    OPCODE(0xad) XOR(cpu.hl.l);                                     NEXT();
+    OPCODE(0xae)
+        operand = bus_read(gb, cpu.hl.val);
+        XOR(operand);
+        NEXT();
+    OPCODE(0xaf) XOR(cpu.af.a);                                     NEXT();
+    OPCODE(0xb0) OR(cpu.bc.b);                                      NEXT();
+    OPCODE(0xb1) OR(cpu.bc.c);                                      NEXT();
+    OPCODE(0xb2) OR(cpu.de.d);                                      NEXT();
+    OPCODE(0xb3) OR(cpu.de.e);                                      NEXT();
+    OPCODE(0xb4) OR(cpu.hl.h);                                      NEXT();
+    OPCODE(0xb5) OR(cpu.hl.l);                                      NEXT();
+    OPCODE(0xb6)
+        operand = bus_read(gb, cpu.hl.val);
+        OR(operand);
+        NEXT();
+    OPCODE(0xb7) OR(cpu.af.a);                                      NEXT();
+    OPCODE(0xb8) CP(cpu.bc.b);                                      NEXT();
+    OPCODE(0xb9) CP(cpu.bc.c);                                      NEXT();
+    OPCODE(0xba) CP(cpu.de.d);                                      NEXT();
+    OPCODE(0xbb) CP(cpu.de.e);                                      NEXT();
+    OPCODE(0xbc) CP(cpu.hl.h);                                      NEXT();
+    OPCODE(0xbd) CP(cpu.hl.l);                                      NEXT();
+    OPCODE(0xbe)
+        operand = bus_read(gb, cpu.hl.val);
+        CP(operand);
+        NEXT();
+    OPCODE(0xbf) CP(cpu.af.a);                                      NEXT();
+    OPCODE(0xc0) RET(opcode, !FLAG_Z);                              NEXT();
+    OPCODE(0xc1) CPU_POP_WORD(cpu.bc.val);                          NEXT();
+    OPCODE(0xc2)
+        CPU_FETCH_WORD(operand);
+        JP(operand, 0, !FLAG_Z);
+        NEXT();
+    OPCODE(0xc3)
+        CPU_FETCH_WORD(operand);
+        JP(operand, 0, 1);
+        NEXT();
+    OPCODE(0xc4)
+        CPU_FETCH_WORD(operand);
+        CALL(operand, !FLAG_Z);
+        NEXT();
+    OPCODE(0xc5) PUSH_RR(cpu.bc.val);                               NEXT();
+    OPCODE(0xc6)
+        operand = CPU_FETCH_BYTE();
+        ADD(operand, 0);
+        NEXT();
+    OPCODE(0xc7) RST_N(0x00);                                       NEXT();
+    OPCODE(0xc8) RET(opcode, FLAG_Z);                               NEXT();
+    OPCODE(0xc9) RET(opcode, 1);                                    NEXT();
+    OPCODE(0xca)
+        CPU_FETCH_WORD(operand);
+        JP(operand, 0, FLAG_Z);
+        NEXT();
+    OPCODE(0xcb)
+        opcode = CPU_FETCH_BYTE();
+        executedCycle += cbInstrCycle[opcode];
+        CB_DISPATCH(opcode);
+    CB_OPCODE(0x00) RLC_R(cpu.bc.b);                             NEXT();
+    CB_OPCODE(0x01) RLC_R(cpu.bc.c);                             NEXT();
+    CB_OPCODE(0x02) RLC_R(cpu.de.d);                             NEXT();
+    CB_OPCODE(0x03) RLC_R(cpu.de.e);                             NEXT();
+    CB_OPCODE(0x04) RLC_R(cpu.hl.h);                             NEXT();
+    CB_OPCODE(0x05) RLC_R(cpu.hl.l);                             NEXT();
+    CB_OPCODE(0x06) RLC_INDIRECT_HL();                           NEXT();
+    CB_OPCODE(0x07) RLC_R(cpu.af.a);                             NEXT();
+    CB_OPCODE(0x08) RRC_R(cpu.bc.b);                             NEXT();
+    CB_OPCODE(0x09) RRC_R(cpu.bc.c);                             NEXT();
+    CB_OPCODE(0x0a) RRC_R(cpu.de.d);                             NEXT();
+    CB_OPCODE(0x0b) RRC_R(cpu.de.e);                             NEXT();
+    CB_OPCODE(0x0c) RRC_R(cpu.hl.h);                             NEXT();
+    CB_OPCODE(0x0d) RRC_R(cpu.hl.l);                             NEXT();
+    CB_OPCODE(0x0e) RRC_INDIRECT_HL();                           NEXT();
+    CB_OPCODE(0x0f) RRC_R(cpu.af.a);                             NEXT();
+    CB_OPCODE(0x10) RL_R(cpu.bc.b);                              NEXT();
+    CB_OPCODE(0x11) RL_R(cpu.bc.c);                              NEXT();
+    CB_OPCODE(0x12) RL_R(cpu.de.d);                              NEXT();
+    CB_OPCODE(0x13) RL_R(cpu.de.e);                              NEXT();
+    CB_OPCODE(0x14) RL_R(cpu.hl.h);                              NEXT();
+    CB_OPCODE(0x15) RL_R(cpu.hl.l);                              NEXT();
+    CB_OPCODE(0x16) RL_INDIRECT_HL();                            NEXT();
+    CB_OPCODE(0x17) RL_R(cpu.af.a);                              NEXT();
+    CB_OPCODE(0x18) RR_R(cpu.bc.b);                              NEXT();
+    CB_OPCODE(0x19) RR_R(cpu.bc.c);                              NEXT();
+    CB_OPCODE(0x1a) RR_R(cpu.de.d);                              NEXT();
+    CB_OPCODE(0x1b) RR_R(cpu.de.e);                              NEXT();
+    CB_OPCODE(0x1c) RR_R(cpu.hl.h);                              NEXT();
+    CB_OPCODE(0x1d) RR_R(cpu.hl.l);                              NEXT();
+    CB_OPCODE(0x1e) RR_INDIRECT_HL();                            NEXT();
+    CB_OPCODE(0x1f) RR_R(cpu.af.a);                              NEXT();
+    CB_OPCODE(0x20) SLA_R(cpu.bc.b);                             NEXT();
+    CB_OPCODE(0x21) SLA_R(cpu.bc.c);                             NEXT();
+    CB_OPCODE(0x22) SLA_R(cpu.de.d);                             NEXT();
+    CB_OPCODE(0x23) SLA_R(cpu.de.e);                             NEXT();
+    CB_OPCODE(0x24) SLA_R(cpu.hl.h);                             NEXT();
+    CB_OPCODE(0x25) SLA_R(cpu.hl.l);                             NEXT();
+    CB_OPCODE(0x26) SLA_INDIRECT_HL();                           NEXT();
+    CB_OPCODE(0x27) SLA_R(cpu.af.a);                             NEXT();
+    CB_OPCODE(0x28) SRA_R(cpu.bc.b);                             NEXT();
+    CB_OPCODE(0x29) SRA_R(cpu.bc.c);                             NEXT();
+    CB_OPCODE(0x2a) SRA_R(cpu.de.d);                             NEXT();
+    CB_OPCODE(0x2b) SRA_R(cpu.de.e);                             NEXT();
+    CB_OPCODE(0x2c) SRA_R(cpu.hl.h);                             NEXT();
+    CB_OPCODE(0x2d) SRA_R(cpu.hl.l);                             NEXT();
+    CB_OPCODE(0x2e) SRA_INDIRECT_HL();                           NEXT();
+    CB_OPCODE(0x2f) SRA_R(cpu.af.a);                             NEXT();
+    CB_OPCODE(0x30) SWAP_R(cpu.bc.b);                            NEXT();
+    CB_OPCODE(0x31) SWAP_R(cpu.bc.c);                            NEXT();
+    CB_OPCODE(0x32) SWAP_R(cpu.de.d);                            NEXT();
+    CB_OPCODE(0x33) SWAP_R(cpu.de.e);                            NEXT();
+    CB_OPCODE(0x34) SWAP_R(cpu.hl.h);                            NEXT();
+    CB_OPCODE(0x35) SWAP_R(cpu.hl.l);                            NEXT();
+    CB_OPCODE(0x36) SWAP_INDIRECT_HL();                          NEXT();
+    CB_OPCODE(0x37) SWAP_R(cpu.af.a);                            NEXT();
+    CB_OPCODE(0x38) SRL_R(cpu.bc.b);                             NEXT();
+    CB_OPCODE(0x39) SRL_R(cpu.bc.c);                             NEXT();
+    CB_OPCODE(0x3a) SRL_R(cpu.de.d);                             NEXT();
+    CB_OPCODE(0x3b) SRL_R(cpu.de.e);                             NEXT();
+    CB_OPCODE(0x3c) SRL_R(cpu.hl.h);                             NEXT();
+    CB_OPCODE(0x3d) SRL_R(cpu.hl.l);                             NEXT();
+    CB_OPCODE(0x3e) SRL_INDIRECT_HL();                           NEXT();
+    CB_OPCODE(0x3f) SRL_R(cpu.af.a);                             NEXT();
+    CB_OPCODE(0x40) BIT_N_R(0, cpu.bc.b);                        NEXT();
+    CB_OPCODE(0x41) BIT_N_R(0, cpu.bc.c);                        NEXT();
+    CB_OPCODE(0x42) BIT_N_R(0, cpu.de.d);                        NEXT();
+    CB_OPCODE(0x43) BIT_N_R(0, cpu.de.e);                        NEXT();
+    CB_OPCODE(0x44) BIT_N_R(0, cpu.hl.h);                        NEXT();
+    CB_OPCODE(0x45) BIT_N_R(0, cpu.hl.l);                        NEXT();
+    CB_OPCODE(0x46) BIT_N_INDIRECT_HL(0);                        NEXT();
+    CB_OPCODE(0x47) BIT_N_R(0, cpu.af.a);                        NEXT();
+    CB_OPCODE(0x48) BIT_N_R(1, cpu.bc.b);                        NEXT();
+    CB_OPCODE(0x49) BIT_N_R(1, cpu.bc.c);                        NEXT();
+    CB_OPCODE(0x4a) BIT_N_R(1, cpu.de.d);                        NEXT();
+    CB_OPCODE(0x4b) BIT_N_R(1, cpu.de.e);                        NEXT();
+    CB_OPCODE(0x4c) BIT_N_R(1, cpu.hl.h);                        NEXT();
+    CB_OPCODE(0x4d) BIT_N_R(1, cpu.hl.l);                        NEXT();
+    CB_OPCODE(0x4e) BIT_N_INDIRECT_HL(1);                        NEXT();
+    CB_OPCODE(0x4f) BIT_N_R(1, cpu.af.a);                        NEXT();
+    CB_OPCODE(0x50) BIT_N_R(2, cpu.bc.b);                        NEXT();
+    CB_OPCODE(0x51) BIT_N_R(2, cpu.bc.c);                        NEXT();
+    CB_OPCODE(0x52) BIT_N_R(2, cpu.de.d);                        NEXT();
+    CB_OPCODE(0x53) BIT_N_R(2, cpu.de.e);                        NEXT();
+    CB_OPCODE(0x54) BIT_N_R(2, cpu.hl.h);                        NEXT();
+    CB_OPCODE(0x55) BIT_N_R(2, cpu.hl.l);                        NEXT();
+    CB_OPCODE(0x56) BIT_N_INDIRECT_HL(2);                        NEXT();
+    CB_OPCODE(0x57) BIT_N_R(2, cpu.af.a);                        NEXT();
+    CB_OPCODE(0x58) BIT_N_R(3, cpu.bc.b);                        NEXT();
+    CB_OPCODE(0x59) BIT_N_R(3, cpu.bc.c);                        NEXT();
+    CB_OPCODE(0x5a) BIT_N_R(3, cpu.de.d);                        NEXT();
+    CB_OPCODE(0x5b) BIT_N_R(3, cpu.de.e);                        NEXT();
+    CB_OPCODE(0x5c) BIT_N_R(3, cpu.hl.h);                        NEXT();
+    CB_OPCODE(0x5d) BIT_N_R(3, cpu.hl.l);                        NEXT();
+    CB_OPCODE(0x5e) BIT_N_INDIRECT_HL(3);                        NEXT();
+    CB_OPCODE(0x5f) BIT_N_R(3, cpu.af.a);                        NEXT();
+    CB_OPCODE(0x60) BIT_N_R(4, cpu.bc.b);                        NEXT();
+    CB_OPCODE(0x61) BIT_N_R(4, cpu.bc.c);                        NEXT();
+    CB_OPCODE(0x62) BIT_N_R(4, cpu.de.d);                        NEXT();
+    CB_OPCODE(0x63) BIT_N_R(4, cpu.de.e);                        NEXT();
+    CB_OPCODE(0x64) BIT_N_R(4, cpu.hl.h);                        NEXT();
+    CB_OPCODE(0x65) BIT_N_R(4, cpu.hl.l);                        NEXT();
+    CB_OPCODE(0x66) BIT_N_INDIRECT_HL(4);                        NEXT();
+    CB_OPCODE(0x67) BIT_N_R(4, cpu.af.a);                        NEXT();
+    CB_OPCODE(0x68) BIT_N_R(5, cpu.bc.b);                        NEXT();
+    CB_OPCODE(0x69) BIT_N_R(5, cpu.bc.c);                        NEXT();
+    CB_OPCODE(0x6a) BIT_N_R(5, cpu.de.d);                        NEXT();
+    CB_OPCODE(0x6b) BIT_N_R(5, cpu.de.e);                        NEXT();
+    CB_OPCODE(0x6c) BIT_N_R(5, cpu.hl.h);                        NEXT();
+    CB_OPCODE(0x6d) BIT_N_R(5, cpu.hl.l);                        NEXT();
+    CB_OPCODE(0x6e) BIT_N_INDIRECT_HL(5);                        NEXT();
+    CB_OPCODE(0x6f) BIT_N_R(5, cpu.af.a);                        NEXT();
+    CB_OPCODE(0x70) BIT_N_R(6, cpu.bc.b);                        NEXT();
+    CB_OPCODE(0x71) BIT_N_R(6, cpu.bc.c);                        NEXT();
+    CB_OPCODE(0x72) BIT_N_R(6, cpu.de.d);                        NEXT();
+    CB_OPCODE(0x73) BIT_N_R(6, cpu.de.e);                        NEXT();
+    CB_OPCODE(0x74) BIT_N_R(6, cpu.hl.h);                        NEXT();
+    CB_OPCODE(0x75) BIT_N_R(6, cpu.hl.l);                        NEXT();
+    CB_OPCODE(0x76) BIT_N_INDIRECT_HL(6);                        NEXT();
+    CB_OPCODE(0x77) BIT_N_R(6, cpu.af.a);                        NEXT();
+    CB_OPCODE(0x78) BIT_N_R(7, cpu.bc.b);                        NEXT();
+    CB_OPCODE(0x79) BIT_N_R(7, cpu.bc.c);                        NEXT();
+    CB_OPCODE(0x7a) BIT_N_R(7, cpu.de.d);                        NEXT();
+    CB_OPCODE(0x7b) BIT_N_R(7, cpu.de.e);                        NEXT();
+    CB_OPCODE(0x7c) BIT_N_R(7, cpu.hl.h);                        NEXT();
+    CB_OPCODE(0x7d) BIT_N_R(7, cpu.hl.l);                        NEXT();
+    CB_OPCODE(0x7e) BIT_N_INDIRECT_HL(7);                        NEXT();
+    CB_OPCODE(0x7f) BIT_N_R(7, cpu.af.a);                        NEXT();
+    CB_OPCODE(0x80) RES_N_R(0, cpu.bc.b);                        NEXT();
+    CB_OPCODE(0x81) RES_N_R(0, cpu.bc.c);                        NEXT();
+    CB_OPCODE(0x82) RES_N_R(0, cpu.de.d);                        NEXT();
+    CB_OPCODE(0x83) RES_N_R(0, cpu.de.e);                        NEXT();
+    CB_OPCODE(0x84) RES_N_R(0, cpu.hl.h);                        NEXT();
+    CB_OPCODE(0x85) RES_N_R(0, cpu.hl.l);                        NEXT();
+    CB_OPCODE(0x86) RES_N_INDIRECT_HL(0);                        NEXT();
+    CB_OPCODE(0x87) RES_N_R(0, cpu.af.a);                        NEXT();
+    CB_OPCODE(0x88) RES_N_R(1, cpu.bc.b);                        NEXT();
+    CB_OPCODE(0x89) RES_N_R(1, cpu.bc.c);                        NEXT();
+    CB_OPCODE(0x8a) RES_N_R(1, cpu.de.d);                        NEXT();
+    CB_OPCODE(0x8b) RES_N_R(1, cpu.de.e);                        NEXT();
+    CB_OPCODE(0x8c) RES_N_R(1, cpu.hl.h);                        NEXT();
+    CB_OPCODE(0x8d) RES_N_R(1, cpu.hl.l);                        NEXT();
+    CB_OPCODE(0x8e) RES_N_INDIRECT_HL(1);                        NEXT();
+    CB_OPCODE(0x8f) RES_N_R(1, cpu.af.a);                        NEXT();
+    CB_OPCODE(0x90) RES_N_R(2, cpu.bc.b);                        NEXT();
+    CB_OPCODE(0x91) RES_N_R(2, cpu.bc.c);                        NEXT();
+    CB_OPCODE(0x92) RES_N_R(2, cpu.de.d);                        NEXT();
+    CB_OPCODE(0x93) RES_N_R(2, cpu.de.e);                        NEXT();
+    CB_OPCODE(0x94) RES_N_R(2, cpu.hl.h);                        NEXT();
+    CB_OPCODE(0x95) RES_N_R(2, cpu.hl.l);                        NEXT();
+    CB_OPCODE(0x96) RES_N_INDIRECT_HL(2);                        NEXT();
+    CB_OPCODE(0x97) RES_N_R(2, cpu.af.a);                        NEXT();
+    CB_OPCODE(0x98) RES_N_R(3, cpu.bc.b);                        NEXT();
+    CB_OPCODE(0x99) RES_N_R(3, cpu.bc.c);                        NEXT();
+    CB_OPCODE(0x9a) RES_N_R(3, cpu.de.d);                        NEXT();
+    CB_OPCODE(0x9b) RES_N_R(3, cpu.de.e);                        NEXT();
+    CB_OPCODE(0x9c) RES_N_R(3, cpu.hl.h);                        NEXT();
+    CB_OPCODE(0x9d) RES_N_R(3, cpu.hl.l);                        NEXT();
+    CB_OPCODE(0x9e) RES_N_INDIRECT_HL(3);                        NEXT();
+    CB_OPCODE(0x9f) RES_N_R(3, cpu.af.a);                        NEXT();
+    CB_OPCODE(0xa0) RES_N_R(4, cpu.bc.b);                        NEXT();
+    CB_OPCODE(0xa1) RES_N_R(4, cpu.bc.c);                        NEXT();
+    CB_OPCODE(0xa2) RES_N_R(4, cpu.de.d);                        NEXT();
+    CB_OPCODE(0xa3) RES_N_R(4, cpu.de.e);                        NEXT();
+    CB_OPCODE(0xa4) RES_N_R(4, cpu.hl.h);                        NEXT();
+    CB_OPCODE(0xa5) RES_N_R(4, cpu.hl.l);                        NEXT();
+    CB_OPCODE(0xa6) RES_N_INDIRECT_HL(4);                        NEXT();
+    CB_OPCODE(0xa7) RES_N_R(4, cpu.af.a);                        NEXT();
+    CB_OPCODE(0xa8) RES_N_R(5, cpu.bc.b);                        NEXT();
+    CB_OPCODE(0xa9) RES_N_R(5, cpu.bc.c);                        NEXT();
+    CB_OPCODE(0xaa) RES_N_R(5, cpu.de.d);                        NEXT();
+    CB_OPCODE(0xab) RES_N_R(5, cpu.de.e);                        NEXT();
+    CB_OPCODE(0xac) RES_N_R(5, cpu.hl.h);                        NEXT();
+    CB_OPCODE(0xad) RES_N_R(5, cpu.hl.l);                        NEXT();
+    CB_OPCODE(0xae) RES_N_INDIRECT_HL(5);                        NEXT();
+    CB_OPCODE(0xaf) RES_N_R(5, cpu.af.a);                        NEXT();
+    CB_OPCODE(0xb0) RES_N_R(6, cpu.bc.b);                        NEXT();
+    CB_OPCODE(0xb1) RES_N_R(6, cpu.bc.c);                        NEXT();
+    CB_OPCODE(0xb2) RES_N_R(6, cpu.de.d);                        NEXT();
+    CB_OPCODE(0xb3) RES_N_R(6, cpu.de.e);                        NEXT();
+    CB_OPCODE(0xb4) RES_N_R(6, cpu.hl.h);                        NEXT();
+    CB_OPCODE(0xb5) RES_N_R(6, cpu.hl.l);                        NEXT();
+    CB_OPCODE(0xb6) RES_N_INDIRECT_HL(6);                        NEXT();
+    CB_OPCODE(0xb7) RES_N_R(6, cpu.af.a);                        NEXT();
+    CB_OPCODE(0xb8) RES_N_R(7, cpu.bc.b);                        NEXT();
+    CB_OPCODE(0xb9) RES_N_R(7, cpu.bc.c);                        NEXT();
+    CB_OPCODE(0xba) RES_N_R(7, cpu.de.d);                        NEXT();
+    CB_OPCODE(0xbb) RES_N_R(7, cpu.de.e);                        NEXT();
+    CB_OPCODE(0xbc) RES_N_R(7, cpu.hl.h);                        NEXT();
+    CB_OPCODE(0xbd) RES_N_R(7, cpu.hl.l);                        NEXT();
+    CB_OPCODE(0xbe) RES_N_INDIRECT_HL(7);                        NEXT();
+    CB_OPCODE(0xbf) RES_N_R(7, cpu.af.a);                        NEXT();
+    CB_OPCODE(0xc0) SET_N_R(0, cpu.bc.b);                        NEXT();
+    CB_OPCODE(0xc1) SET_N_R(0, cpu.bc.c);                        NEXT();
+    CB_OPCODE(0xc2) SET_N_R(0, cpu.de.d);                        NEXT();
+    CB_OPCODE(0xc3) SET_N_R(0, cpu.de.e);                        NEXT();
+    CB_OPCODE(0xc4) SET_N_R(0, cpu.hl.h);                        NEXT();
+    CB_OPCODE(0xc5) SET_N_R(0, cpu.hl.l);                        NEXT();
+    CB_OPCODE(0xc6) SET_N_INDIRECT_HL(0);                        NEXT();
+    CB_OPCODE(0xc7) SET_N_R(0, cpu.af.a);                        NEXT();
+    CB_OPCODE(0xc8) SET_N_R(1, cpu.bc.b);                        NEXT();
+    CB_OPCODE(0xc9) SET_N_R(1, cpu.bc.c);                        NEXT();
+    CB_OPCODE(0xca) SET_N_R(1, cpu.de.d);                        NEXT();
+    CB_OPCODE(0xcb) SET_N_R(1, cpu.de.e);                        NEXT();
+    CB_OPCODE(0xcc) SET_N_R(1, cpu.hl.h);                        NEXT();
+    CB_OPCODE(0xcd) SET_N_R(1, cpu.hl.l);                        NEXT();
+    CB_OPCODE(0xce) SET_N_INDIRECT_HL(1);                        NEXT();
+    CB_OPCODE(0xcf) SET_N_R(1, cpu.af.a);                        NEXT();
+    CB_OPCODE(0xd0) SET_N_R(2, cpu.bc.b);                        NEXT();
+    CB_OPCODE(0xd1) SET_N_R(2, cpu.bc.c);                        NEXT();
+    CB_OPCODE(0xd2) SET_N_R(2, cpu.de.d);                        NEXT();
+    CB_OPCODE(0xd3) SET_N_R(2, cpu.de.e);                        NEXT();
+    CB_OPCODE(0xd4) SET_N_R(2, cpu.hl.h);                        NEXT();
+    CB_OPCODE(0xd5) SET_N_R(2, cpu.hl.l);                        NEXT();
+    CB_OPCODE(0xd6) SET_N_INDIRECT_HL(2);                        NEXT();
+    CB_OPCODE(0xd7) SET_N_R(2, cpu.af.a);                        NEXT();
+    CB_OPCODE(0xd8) SET_N_R(3, cpu.bc.b);                        NEXT();
+    CB_OPCODE(0xd9) SET_N_R(3, cpu.bc.c);                        NEXT();
+    CB_OPCODE(0xda) SET_N_R(3, cpu.de.d);                        NEXT();
+    CB_OPCODE(0xdb) SET_N_R(3, cpu.de.e);                        NEXT();
+    CB_OPCODE(0xdc) SET_N_R(3, cpu.hl.h);                        NEXT();
+    CB_OPCODE(0xdd) SET_N_R(3, cpu.hl.l);                        NEXT();
+    CB_OPCODE(0xde) SET_N_INDIRECT_HL(3);                        NEXT();
+    CB_OPCODE(0xdf) SET_N_R(3, cpu.af.a);                        NEXT();
+    CB_OPCODE(0xe0) SET_N_R(4, cpu.bc.b);                        NEXT();
+    CB_OPCODE(0xe1) SET_N_R(4, cpu.bc.c);                        NEXT();
+    CB_OPCODE(0xe2) SET_N_R(4, cpu.de.d);                        NEXT();
+    CB_OPCODE(0xe3) SET_N_R(4, cpu.de.e);                        NEXT();
+    CB_OPCODE(0xe4) SET_N_R(4, cpu.hl.h);                        NEXT();
+    CB_OPCODE(0xe5) SET_N_R(4, cpu.hl.l);                        NEXT();
+    CB_OPCODE(0xe6) SET_N_INDIRECT_HL(4);                        NEXT();
+    CB_OPCODE(0xe7) SET_N_R(4, cpu.af.a);                        NEXT();
+    CB_OPCODE(0xe8) SET_N_R(5, cpu.bc.b);                        NEXT();
+    CB_OPCODE(0xe9) SET_N_R(5, cpu.bc.c);                        NEXT();
+    CB_OPCODE(0xea) SET_N_R(5, cpu.de.d);                        NEXT();
+    CB_OPCODE(0xeb) SET_N_R(5, cpu.de.e);                        NEXT();
+    CB_OPCODE(0xec) SET_N_R(5, cpu.hl.h);                        NEXT();
+    CB_OPCODE(0xed) SET_N_R(5, cpu.hl.l);                        NEXT();
+    CB_OPCODE(0xee) SET_N_INDIRECT_HL(5);                        NEXT();
+    CB_OPCODE(0xef) SET_N_R(5, cpu.af.a);                        NEXT();
+    CB_OPCODE(0xf0) SET_N_R(6, cpu.bc.b);                        NEXT();
+    CB_OPCODE(0xf1) SET_N_R(6, cpu.bc.c);                        NEXT();
+    CB_OPCODE(0xf2) SET_N_R(6, cpu.de.d);                        NEXT();
+    CB_OPCODE(0xf3) SET_N_R(6, cpu.de.e);                        NEXT();
+    CB_OPCODE(0xf4) SET_N_R(6, cpu.hl.h);                        NEXT();
+    CB_OPCODE(0xf5) SET_N_R(6, cpu.hl.l);                        NEXT();
+    CB_OPCODE(0xf6) SET_N_INDIRECT_HL(6);                        NEXT();
+    CB_OPCODE(0xf7) SET_N_R(6, cpu.af.a);                        NEXT();
+    CB_OPCODE(0xf8) SET_N_R(7, cpu.bc.b);                        NEXT();
+    CB_OPCODE(0xf9) SET_N_R(7, cpu.bc.c);                        NEXT();
+    CB_OPCODE(0xfa) SET_N_R(7, cpu.de.d);                        NEXT();
+    CB_OPCODE(0xfb) SET_N_R(7, cpu.de.e);                        NEXT();
+    CB_OPCODE(0xfc) SET_N_R(7, cpu.hl.h);                        NEXT();
+    CB_OPCODE(0xfd) SET_N_R(7, cpu.hl.l);                        NEXT();
+    CB_OPCODE(0xfe) SET_N_INDIRECT_HL(7);                        NEXT();
+    CB_OPCODE(0xff) SET_N_R(7, cpu.af.a);                        NEXT();
+        CB_DISPATCH_END();
+    OPCODE(0xcc)
+        CPU_FETCH_WORD(operand);
+        CALL(operand, FLAG_Z);
+        NEXT();
+    OPCODE(0xcd)
+        CPU_FETCH_WORD(operand);
+        CALL(operand, 1);
+        NEXT();
+    OPCODE(0xce)
+        operand = CPU_FETCH_BYTE();
+        ADD(operand, FLAG_C);
+        NEXT();
+    OPCODE(0xcf) RST_N(0x08);                                       NEXT();
+    OPCODE(0xd0) RET(opcode, !FLAG_C);                              NEXT();
+    OPCODE(0xd1) CPU_POP_WORD(cpu.de.val);                          NEXT();
+    OPCODE(0xd2)
+        CPU_FETCH_WORD(operand);
+        JP(operand, 0, !FLAG_C);
+        NEXT();
+    OPCODE(0xd4)
+        CPU_FETCH_WORD(operand);
+        CALL(operand, !FLAG_C);
+        NEXT();
+    OPCODE(0xd5) PUSH_RR(cpu.de.val);                               NEXT();
+    OPCODE(0xd6)
+        operand = CPU_FETCH_BYTE();
+        SUB(operand, 0);
+        NEXT();
+    OPCODE(0xd7) RST_N(0x10);                                       NEXT();
+    OPCODE(0xd8) RET(opcode, FLAG_C);                               NEXT();
+    OPCODE(0xd9) RETI();                                            NEXT();
+    OPCODE(0xda)
+        CPU_FETCH_WORD(operand);
+        JP(operand, 0, FLAG_C);
+        NEXT();
+    OPCODE(0xdc)
+        CPU_FETCH_WORD(operand);
+        CALL(operand, FLAG_C);
+        NEXT();
+    OPCODE(0xde)
+        operand = CPU_FETCH_BYTE();
+        SUB(operand, FLAG_C);
+        NEXT();
+    OPCODE(0xdf) RST_N(0x18);                                       NEXT();
+    OPCODE(0xe0)
+        operand = CPU_FETCH_BYTE();
+        LDH_INDIRECT_N_A(operand);
+        NEXT();
+    OPCODE(0xe1) CPU_POP_WORD(cpu.hl.val);                          NEXT();
+    OPCODE(0xe2) LDH_INDIRECT_C_A();                                NEXT();
+    OPCODE(0xe5) PUSH_RR(cpu.hl.val);                               NEXT();
+    OPCODE(0xe6)
+        operand = CPU_FETCH_BYTE();
+        AND(operand);
+        NEXT();
+    OPCODE(0xe7) RST_N(0x20);                                       NEXT();
+    OPCODE(0xe8)
+        operand = CPU_FETCH_BYTE();
+        ADD_SP_I8(operand);
+        NEXT();
+    OPCODE(0xe9) cpu.pc = cpu.hl.val;                               NEXT();
+    OPCODE(0xea)
+        CPU_FETCH_WORD(operand);
+        bus_write(gb, operand, cpu.af.a);
+        NEXT();
+    OPCODE(0xee)
+        operand = CPU_FETCH_BYTE();
+        XOR(operand);
+        NEXT();
+    OPCODE(0xef) RST_N(0x28);                                       NEXT();
+    OPCODE(0xf0)
+        operand = CPU_FETCH_BYTE();
+        LDH_A_INDIRECT_N(operand);
+        NEXT();
+    OPCODE(0xf1)
+        CPU_POP_WORD(operand);
+        cpu.af.val = (operand & 0xfff0) & ~0x000f;
+        LOAD_FLAGS();
+        NEXT();
+    OPCODE(0xf2) LDH_A_INDIRECT_C();                                NEXT();
+    OPCODE(0xf3) DI();                                              NEXT();
+    OPCODE(0xf5)
+        STORE_FLAGS();
+        PUSH_RR(cpu.af.val);
+        NEXT();
+    OPCODE(0xf6)
+        operand = CPU_FETCH_BYTE();
+        OR(operand);
+        NEXT();
+    OPCODE(0xf7) RST_N(0x30);                                       NEXT();
+    OPCODE(0xf8)
+        operand = CPU_FETCH_BYTE();
+        LD_HL_SP_PLUS_I8(operand);
+        NEXT();
+    OPCODE(0xf9) cpu.sp = cpu.hl.val;                               NEXT();
+    OPCODE(0xfa)
+        CPU_FETCH_WORD(operand);
+        cpu.af.a = bus_read(gb, operand);
+        NEXT();
+    OPCODE(0xfb) EI();                                              NEXT();
+    OPCODE(0xfe)
+        operand = CPU_FETCH_BYTE();
+        CP(operand);
+        NEXT();
+    OPCODE(0xff) RST_N(0x38);                                       NEXT();
+    OPCODE_UNKNOWN()
+        printf("Unknown opcode 0x%02x\n", opcode);
+        NEXT();
+    DISPATCH_END()
+}
+
+#undef bus_read
+#undef bus_write
+#undef MBC_WRITE
+#undef CPU_RUN
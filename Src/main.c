@@ -31,6 +31,7 @@
 #include <stdbool.h>
 // #include "Kirby_Dream_Land.gb.h"
 // #include "Super_Mario_Land.gb.h"
+#include "bsp_driver_sd.h"
 #include "gbdarm.h"
 #include "ili9225.h"
 /* USER CODE END Includes */
@@ -42,6 +43,20 @@
 
 /* Private define ------------------------------------------------------------*/
 /* USER CODE BEGIN PD */
+// GRAM horizontal address of the first scaled line, later lines count down
+#define LCD_FIRST_LINE    (LCD_WIDTH - 1)
+/* send the changed lines through a small ring as they are drawn instead of
+ * triple buffering whole frames, the panel's GRAM holds the frame */
+#ifndef RACE_THE_BEAM
+#define RACE_THE_BEAM     1
+#endif
+/* the boot from before the ROM streamed in: read all of it, then init the
+ * LCD with HAL_Delay(), then run; bootTimes is kept the same way, to compare */
+#ifndef SERIAL_BOOT
+#define SERIAL_BOOT       0
+#endif
+#define ROM_READ_RETRIES  3     // DMA reads of a chunk before the boot stops with an error
+#define LCD_POLL_CYCLES   (FRAME_CYCLES / 16)   // about 1 ms of emulation between LCD init polls
 /* USER CODE END PD */
 
 /* Private macro -------------------------------------------------------------*/
@@ -52,13 +67,54 @@
 /* Private variables ---------------------------------------------------------*/
 
 /* USER CODE BEGIN PV */
-FRAME_BUFFER uint16_t frontFrameBuffer[SCREEN_HEIGHT * SCREEN_WIDTH];
-FRAME_BUFFER uint16_t backFrameBuffer[SCREEN_HEIGHT * SCREEN_WIDTH];
-uint16_t backgroundBuffer[LCD_HEIGHT * LCD_WIDTH];
-// FRAME_BUFFER uint16_t frontFrameBuffer[LCD_HEIGHT * LCD_WIDTH];
-// FRAME_BUFFER uint16_t backFrameBuffer[LCD_HEIGHT * LCD_WIDTH];
+#if RACE_THE_BEAM
+FRAME_BUFFER struct line_ring lineRing;
+burst ringBurst;
+int ringSending;            // lines of ringBurst in flight
+/* taken by ring_kick() to start sending, then kept by the SPI interrupt
+ * until the ring runs dry, so the two never send at once */
+bool ringOwned;
+#else
+FRAME_BUFFER uint16_t frameBuffers[FRAME_BUFFER_COUNT][SCALED_LINES * SCALED_LINE_LENGTH];
+struct frame_buffers buffers;
+struct line_span spans[ILI9225_MAX_BURSTS];
+burst bursts[ILI9225_MAX_BURSTS];
+// lines changed since the frame on the panel, up to the newest queued one
+uint32_t queuedLines[DIRTY_LINE_WORDS];
+volatile bool displayFree;  // the last burst is out, set by the SPI interrupt
+#endif
 struct gb gb;
-uint8_t rom[256 * KiB];
+// the whole ROM, or bank 0 and the bank cache's slots for a bigger one
+__attribute__((aligned(32))) uint8_t rom[256 * KiB];    // SD DMA, cache line aligned
+FATFS fatFS;
+FIL romFile;
+DWORD romLinkMap[64];       // cluster link map for fast seek
+struct rom_cache romCache;
+/* the ROM file as runs of SD blocks, read into rom[] by DMA a bank at most
+ * per transfer while the emulator runs */
+struct {
+  DWORD *run;               // next (clusters, first cluster) pair in romLinkMap
+  DWORD database;           // first block of cluster 2
+  uint32_t clusterBlocks;
+  uint32_t block;           // next block to read
+  uint32_t runBlocks;       // blocks left in its run
+  uint32_t offset;          // bytes of rom[] read so far
+  uint32_t size;            // bytes to read
+  uint32_t chunk;           // blocks in flight, 0 when idle
+  int retries;
+  uint32_t errors;
+  bool failed;              // a chunk never read, the stream stopped there
+} romRead;
+struct rom_stream romStream;
+/* ms since HAL_Init() for the debugger: bank 0 and all of the ROM in, the
+ * LCD up and the first frame drawn for it */
+struct {
+  uint32_t romBank0;
+  uint32_t romLoaded;
+  uint32_t lcdReady;
+  uint32_t firstFrame;
+} bootTimes;
+uint32_t frameStart;
 /* USER CODE END PV */
 
 /* Private function prototypes -----------------------------------------------*/
@@ -72,27 +128,165 @@ void SystemClock_Config(void);
 
 void system_init(void)
 {
-  for (int i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; i++)
-  // for (int i = 0; i < LCD_WIDTH * LCD_HEIGHT; i++)
-    frontFrameBuffer[i] = backFrameBuffer[i] = ILI9225_WHITE;
-  for (int i = 0; i < LCD_WIDTH * LCD_HEIGHT; i++) {
-    backgroundBuffer[i] = ILI9225_BLACK;
+#if !RACE_THE_BEAM
+  for (int i = 0; i < FRAME_BUFFER_COUNT; i++)
+    for (int j = 0; j < SCALED_LINES * SCALED_LINE_LENGTH; j++)
+      frameBuffers[i][j] = ILI9225_WHITE;
+#endif
+}
+
+// read a ROM bank from the SD card into a slot of the bank cache
+bool rom_fill(struct rom_cache *cache, int bank, uint8_t *dst)
+{
+  UINT RWC;
+
+  if (f_lseek(&romFile, (FSIZE_t)bank * ROM_BANK_SIZE) != FR_OK)
+    return false;
+  return f_read(&romFile, dst, ROM_BANK_SIZE, &RWC) == FR_OK && RWC == ROM_BANK_SIZE;
+}
+
+// the chunk in flight is done
+void rom_stream_advance(void)
+{
+  SCB_InvalidateDCache_by_Addr((uint32_t *)(rom + romRead.offset), romRead.chunk * BLOCKSIZE);
+  romRead.offset += romRead.chunk * BLOCKSIZE;
+  romRead.block += romRead.chunk;
+  romRead.runBlocks -= romRead.chunk;
+  romRead.retries = 0;
+  if (!bootTimes.romBank0 && romRead.offset >= ROM_BANK_SIZE)
+    bootTimes.romBank0 = HAL_GetTick();
+  __atomic_store_n(&romStream.loaded, romRead.offset / ROM_BANK_SIZE, __ATOMIC_RELEASE);
+}
+
+/* a read of the chunk failed: true to read it again, false once it has
+ * failed ROM_READ_RETRIES times. Then the stream stops there, loaded stays
+ * below that bank and rom_stream_wait() stops the boot if it is read. */
+bool rom_stream_retry(void)
+{
+  romRead.errors++;
+  if (++romRead.retries <= ROM_READ_RETRIES)
+    return true;
+  romRead.chunk = 0;
+  romRead.failed = true;
+  return false;
+}
+
+/* start the DMA read of the next chunk, which stops at a bank boundary so
+ * the banks land one by one */
+void rom_stream_next(void)
+{
+  uint32_t blocks;
+
+  while (romRead.offset < romRead.size) {
+    if (romRead.runBlocks == 0) {
+      if (!romRead.run[0]) {
+        romRead.failed = true;  // the link map ended early
+        romRead.chunk = 0;
+        return;
+      }
+      romRead.runBlocks = romRead.run[0] * romRead.clusterBlocks;
+      romRead.block = romRead.database + (romRead.run[1] - 2) * romRead.clusterBlocks;
+      romRead.run += 2;
+    }
+    blocks = (ROM_BANK_SIZE - romRead.offset % ROM_BANK_SIZE) / BLOCKSIZE;
+    if (blocks > romRead.runBlocks)
+      blocks = romRead.runBlocks;
+    if (blocks > (romRead.size - romRead.offset + BLOCKSIZE - 1) / BLOCKSIZE)
+      blocks = (romRead.size - romRead.offset + BLOCKSIZE - 1) / BLOCKSIZE;
+    romRead.chunk = blocks;
+    // no dirty line may be written back over what the DMA puts there
+    SCB_InvalidateDCache_by_Addr((uint32_t *)(rom + romRead.offset), blocks * BLOCKSIZE);
+    if (BSP_SD_ReadBlocks_DMA((uint32_t *)(rom + romRead.offset), romRead.block, blocks) == MSD_OK)
+      return;
+    if (!rom_stream_retry())
+      return;
+  }
+  romRead.chunk = 0;
+  bootTimes.romLoaded = HAL_GetTick();
+  __atomic_store_n(&romStream.loaded, ROM_MAX_BANKS, __ATOMIC_RELEASE);
+}
+
+void BSP_SD_ReadCpltCallback(void)
+{
+  rom_stream_advance();
+  rom_stream_next();
+}
+
+void HAL_SD_ErrorCallback(SD_HandleTypeDef *hsd)
+{
+  // a failed stop command still completes the read afterwards
+  if (!romRead.chunk || hsd->State != HAL_SD_STATE_READY)
+    return;
+  if (rom_stream_retry())
+    rom_stream_next();
+}
+
+/* the emulator read a bank that has not landed yet; SysTick wakes it every
+ * ms at least, so the LCD init goes on meanwhile */
+void rom_stream_wait(struct rom_stream *stream, int bank)
+{
+  while (__atomic_load_n(&stream->loaded, __ATOMIC_ACQUIRE) <= bank) {
+    if (romRead.failed)
+      Error_Handler();      // the bank will never land
+    ili9225_init_poll();
+    __WFI();
   }
 }
 
+/* Returns once bank 0 is in. A ROM that fits in rom[] goes on streaming in
+ * behind the emulator, which waits in mbc_read() for a bank that has not
+ * landed; a bigger one pages the others in through the bank cache. */
 void rom_load(void)
 {
-  FATFS fatFS;
-  FIL fp;
-  FRESULT fResult;
-  FATFS *fsPtr;
-  UINT RWC, WWC;
-
-  fResult = f_mount(&fatFS, SDPath, 1);
-  fResult = f_open(&fp, "Dr_Mario.gb", FA_READ);
-  f_read(&fp, rom, f_size(&fp), &RWC);
-  f_close(&fp);
-  fResult = f_mount(NULL, "", 0);
+  UINT RWC;
+  bool fits;
+
+  // FatFs blocks, keep the LCD init going between its calls
+  f_mount(&fatFS, SDPath, 1);
+  ili9225_init_poll();
+  f_open(&romFile, "Dr_Mario.gb", FA_READ);
+  ili9225_init_poll();
+  fits = f_size(&romFile) <= sizeof(rom);
+  /* with the link map the file's blocks are known up front, so they can be
+   * read without FatFs, and a seek needs no FAT reads */
+  romLinkMap[0] = sizeof(romLinkMap) / sizeof(romLinkMap[0]);
+  romFile.cltbl = romLinkMap;
+  if (f_lseek(&romFile, CREATE_LINKMAP) != FR_OK)
+    romFile.cltbl = NULL;   // too fragmented, seek through the FAT
+  if (SERIAL_BOOT || !romFile.cltbl) {
+    f_read(&romFile, rom, fits ? f_size(&romFile) : ROM_BANK_SIZE, &RWC);
+    bootTimes.romBank0 = bootTimes.romLoaded = HAL_GetTick();
+  } else {
+    // FatFs sectors are SD blocks, sd_diskio.c reads them one to one
+    romRead.run = romLinkMap + 1;
+    romRead.database = fatFS.database;
+    romRead.clusterBlocks = fatFS.csize;
+    romRead.size = fits ? f_size(&romFile) : ROM_BANK_SIZE;
+    romStream.loaded = 0;
+    romStream.wait = rom_stream_wait;
+    rom_stream_next();
+    rom_stream_wait(&romStream, 0);
+    /* a big ROM streams bank 0 only, so the polled reads of rom_fill() never
+     * meet the DMA */
+    if (fits)
+      gb.cart.romStream = &romStream;
+  }
+  if (fits) {
+    f_close(&romFile);
+    f_mount(NULL, "", 0);
+    return;
+  }
+  rom_cache_init(&romCache, rom + ROM_BANK_SIZE, sizeof(rom) / ROM_BANK_SIZE - 1, rom_fill);
+  gb.cart.romCache = &romCache;
+}
+
+// the LCD is up, draw from the next frame on
+void lcd_start(void)
+{
+  bootTimes.lcdReady = HAL_GetTick();
+  ili9225_set_window_area(0, LCD_HEIGHT - 1, 0, LCD_WIDTH - 1);
+  gb.frameSkip.ratio = FRAMESKIP_AUTO;
+  gb_draw_next_frame(&gb);
 }
 
 void joypad_check(void)
@@ -160,11 +354,12 @@ static void MPU_Config(void)
   MPU_InitStruct.SubRegionDisable = 0x00;
   HAL_MPU_ConfigRegion(&MPU_InitStruct);
 
-  /* configure the D2 RAM region, make it non-cacheable*/
+  /* configure the D2 RAM region, make it non-cacheable; the scaled frame
+   * buffers take 227 KiB of it */
   MPU_InitStruct.Enable = MPU_REGION_ENABLE;
   MPU_InitStruct.Number = MPU_REGION_NUMBER0;
   MPU_InitStruct.BaseAddress = 0x30000000;
-  MPU_InitStruct.Size = MPU_REGION_SIZE_128KB;
+  MPU_InitStruct.Size = MPU_REGION_SIZE_256KB;
   MPU_InitStruct.AccessPermission = MPU_REGION_FULL_ACCESS;
   MPU_InitStruct.IsBufferable = MPU_ACCESS_BUFFERABLE;
   MPU_InitStruct.IsCacheable = MPU_ACCESS_NOT_CACHEABLE;
@@ -187,12 +382,78 @@ static void CPU_CACHE_Enable(void)
   SCB_EnableDCache();
 }
 
+#if RACE_THE_BEAM
+// start sending the next run of lines in the ring, or let go of it if empty
+void ring_send(void)
+{
+  uint16_t *pixels;
+  uint8_t first;
+
+  ringSending = line_ring_peek(&lineRing, &pixels, &first);
+  if (!ringSending) {
+    __atomic_clear(&ringOwned, __ATOMIC_RELEASE);
+    return;
+  }
+  ringBurst.bitMap = pixels;
+  ringBurst.length = ringSending * lineRing.lineLength;
+  ringBurst.verticalStart = 0;
+  ringBurst.verticalEnd = lineRing.lineLength - 1;
+  ringBurst.horizontalStart = LCD_FIRST_LINE - (first + ringSending - 1);
+  ringBurst.horizontalEnd = LCD_FIRST_LINE - first;
+  ili9225_draw_bursts(&ringBurst, 1);
+}
+
+/* the PPU has lines waiting; while the SPI interrupt owns the ring it sends
+ * them after the run in flight, since lines are committed before the kick */
+void ring_kick(struct line_ring *ring)
+{
+  if (!__atomic_test_and_set(&ringOwned, __ATOMIC_ACQUIRE))
+    ring_send();
+}
+
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+  if (ili9225_next_burst())
+    return;
+  line_ring_release(&lineRing, ringSending);
+  ring_send();
+}
+#else
+/* once the display is free, send the lines of the newest finished frame
+ * that changed since the frame on the panel */
+void frame_send(void)
+{
+  uint16_t *front;
+  int count;
+
+  if (ili9225_busy())
+    return;
+  displayFree = false;
+  front = frame_buffers_scanout(&buffers);
+  if (!front)
+    return;
+  gb.frontBufferPtr = front;
+  count = ppu_line_spans(queuedLines, spans, ILI9225_MAX_BURSTS);
+  count = scaler_map_spans(&gb, spans, count);
+  for (int i = 0; i < count; i++) {
+    bursts[i].bitMap = gb.frontBufferPtr + spans[i].first * SCALED_LINE_LENGTH;
+    bursts[i].length = spans[i].count * SCALED_LINE_LENGTH;
+    bursts[i].verticalStart = 0;
+    bursts[i].verticalEnd = SCALED_LINE_LENGTH - 1;
+    bursts[i].horizontalStart = LCD_FIRST_LINE - (spans[i].first + spans[i].count - 1);
+    bursts[i].horizontalEnd = LCD_FIRST_LINE - spans[i].first;
+  }
+  ili9225_draw_bursts(bursts, count);
+}
+
+/* frame_buffers is the main loop's alone, so it starts the next frame, the
+ * first time it looks between slices of emulation */
 void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
 {
-  ili9225_set_cs(STATE_DISABLE);
-  gb.whichBuffer = (gb.whichBuffer == FRONT) ? BACK : FRONT;
-  gb.frontBufferPtr = (gb.whichBuffer == FRONT) ? frontFrameBuffer : backFrameBuffer;
+  if (!ili9225_next_burst())
+    displayFree = true;
 }
+#endif
 
 /* USER CODE END 0 */
 
@@ -236,18 +497,31 @@ int main(void)
   MX_SDMMC1_SD_Init();
   MX_FATFS_Init();
   /* USER CODE BEGIN 2 */
-  gb.frontBufferPtr = frontFrameBuffer;
-  gb.backBufferPtr = backFrameBuffer;
-  gb.whichBuffer = FRONT;
+#if RACE_THE_BEAM
+  lineRing.kick = ring_kick;
+  gb.lineRing = &lineRing;
+#else
+  uint16_t *bufferPtrs[FRAME_BUFFER_COUNT] = {frameBuffers[0], frameBuffers[1], frameBuffers[2]};
+  gb.frontBufferPtr = frameBuffers[0];
+  gb.backBufferPtr = frame_buffers_init(&buffers, bufferPtrs);
+#endif
   system_init();
+#if SERIAL_BOOT
   rom_load();
   ili9225_init();
+#else
+  /* the LCD powers up step by step while the card is mounted and the ROM
+   * streams in, and the emulator runs headless from bank 0 meanwhile */
+  ili9225_init_start();
+  rom_load();
+#endif
   cartridge_load(&gb, rom);
+  gb.frameSkip.ratio = FRAMESKIP_HEADLESS;
+  gb.scaler.mode = SCALER_BLEND;
   load_state_after_booting(&gb);
-  // ili9225_set_gram_ptr(153, 0);
-  ili9225_set_gram_ptr(0, 0);
-  ili9225_draw_bitmap(backgroundBuffer, LCD_HEIGHT, LCD_WIDTH, PLAINSPI);
-  ili9225_set_window_area(0, 159, 9, 153);
+  if (ili9225_ready())
+    lcd_start();
+  frameStart = HAL_GetTick();
   /* USER CODE END 2 */
 
   /* Infinite loop */
@@ -258,18 +532,36 @@ int main(void)
 
     /* USER CODE BEGIN 3 */
     // ili9225_draw_bitmap(gb.frontBufferPtr, LCD_HEIGHT, LCD_WIDTH, DMA);
-    ili9225_draw_bitmap(gb.frontBufferPtr, SCREEN_WIDTH, SCREEN_HEIGHT, DMA);
-    while (!gb.ppu.frameReady)
-      cpu_step(&gb);
-    joypad_check();
-    if (gb.whichBuffer == BACK) {
-      gb.backBufferPtr = frontFrameBuffer;
-    } else if (gb.whichBuffer == FRONT) {
-      gb.backBufferPtr = backFrameBuffer;
+    // with the LCD off no frame completes, keep polling the keys meanwhile
+    do {
+      /* until the LCD is up, run in short slices to poll its init steps, and
+       * with frame buffers always, to start a queued frame once the display
+       * is free rather than at the end of the next one */
+      gb_run_cycles(&gb, (ili9225_init_poll() && RACE_THE_BEAM) ? FRAME_CYCLES : LCD_POLL_CYCLES);
+      joypad_check();
+#if !RACE_THE_BEAM
+      if (displayFree)
+        frame_send();
+#endif
+    } while (!gb.ppu.frameReady);
+#if !RACE_THE_BEAM
+    // queue the frame and go on drawing into a free buffer, never waiting for SPI
+    gb.backBufferPtr = frame_buffers_done(&buffers, gb.frameSkip.drawn);
+    for (int i = 0; i < DIRTY_LINE_WORDS; i++) {
+      queuedLines[i] |= gb.ppu.dirtyLines[i];
+      gb.ppu.dirtyLines[i] = 0;
     }
-    // ili9225_set_gram_ptr(0, 0);
-    ili9225_set_gram_ptr(153, 0);
+    if (ili9225_ready())
+      frame_send();
+#endif
+    if (gb.frameSkip.drawn && !bootTimes.firstFrame)
+      bootTimes.firstFrame = HAL_GetTick();
     gb.ppu.frameReady = false;
+    // skip drawing the next frame if we fell behind 59.73 Hz
+    gb_frame_skip_update(&gb, (HAL_GetTick() - frameStart) * 1000);
+    frameStart = HAL_GetTick();
+    if (gb.frameSkip.ratio == FRAMESKIP_HEADLESS && ili9225_ready())
+      lcd_start();
   }
   /* USER CODE END 3 */
 }
@@ -349,6 +641,10 @@ void Error_Handler(void)
 {
   /* USER CODE BEGIN Error_Handler_Debug */
   /* User can add his own implementation to report the HAL error return state */
+  __disable_irq();
+  while (1)
+  {
+  }
   /* USER CODE END Error_Handler_Debug */
 }
 